@@ -0,0 +1,98 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+/*
+ * Subscribe to a REAL array and print it whenever any element moves by
+ * more than the deadband.  The library does the polling.
+ */
+
+#define TAG_PATH "protocol=ab_eip&gateway=10.206.1.39&path=1,0&cpu=LGX&elem_size=4&elem_count=10&name=TestREALArray"
+#define ELEM_COUNT 10
+#define ELEM_SIZE 4
+#define PERIOD_MS 250
+#define DEADBAND 0.5f
+#define RUN_TIME_MS 30000
+
+
+static void tag_changed(plc_tag tag, int status, void *userdata)
+{
+    int i;
+
+    (void)userdata;
+
+    if(status != PLCTAG_STATUS_OK) {
+        fprintf(stderr,"Read failed: %s\n", plc_tag_decode_error(status));
+        return;
+    }
+
+    for(i=0; i < ELEM_COUNT; i++) {
+        fprintf(stderr,"data[%d]=%f\n",i,plc_tag_get_float32(tag,(i*ELEM_SIZE)));
+    }
+}
+
+
+int main()
+{
+    plc_tag tag = PLC_TAG_NULL;
+    int rc;
+
+    /* create the tag */
+    tag = plc_tag_create(TAG_PATH);
+
+    /* everything OK? */
+    if(!tag) {
+        fprintf(stderr,"ERROR: Could not create tag!\n");
+
+        return 0;
+    }
+
+    /* let the connect succeed we hope */
+    while(plc_tag_status(tag) == PLCTAG_STATUS_PENDING) {
+        sleep_ms(100);
+    }
+
+    if(plc_tag_status(tag) != PLCTAG_STATUS_OK) {
+        fprintf(stderr,"Error setting up tag internal state. Error %s\n", plc_tag_decode_error(plc_tag_status(tag)));
+        return 0;
+    }
+
+    rc = plc_tag_subscribe(tag, PERIOD_MS, DEADBAND, tag_changed, NULL);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        fprintf(stderr,"ERROR: Unable to subscribe to the tag! Got error code %d: %s\n",rc, plc_tag_decode_error(rc));
+        plc_tag_destroy(tag);
+        return 0;
+    }
+
+    /* the callback does all the work. */
+    sleep_ms(RUN_TIME_MS);
+
+    plc_tag_unsubscribe(tag);
+
+    /* we are done */
+    plc_tag_destroy(tag);
+
+    return 0;
+}
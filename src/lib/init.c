@@ -27,6 +27,7 @@
 #include <ab/ab.h>
 #include <system/system.h>
 #include <lib/init.h>
+#include <lib/subscription.h>
 
 
 /*
@@ -131,6 +132,8 @@ tag_create_function find_tag_create_func(attr attributes)
 
 void destroy_modules(void)
 {
+    subscription_teardown();
+
     ab_teardown();
 
     lib_teardown();
@@ -158,6 +161,10 @@ int initialize_modules(void)
         pdebug(DEBUG_INFO,"Initialized library modules.");
         rc = lib_init();
 
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = subscription_init();
+        }
+
         if(rc == PLCTAG_STATUS_OK) {
             rc = ab_init();
         }
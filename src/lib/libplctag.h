@@ -108,6 +108,7 @@ extern "C" {
     #define PLCTAG_ERR_NOT_FOUND        (-34)
     #define PLCTAG_ERR_ABORT            (-35)
     #define PLCTAG_ERR_WINSOCK          (-36)
+    #define PLCTAG_ERR_BUSY             (-37)
 
 
 
@@ -222,6 +223,32 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_set_stream_callback
+     *
+     * Have reads hand the data to the callback as each reply arrives
+     * instead of only after the whole tag has been read.  The callback
+     * gets the byte offset of each chunk in the tag.  Chunks arrive in
+     * offset order.  If a read has to be restarted, the chunks start
+     * over from offset zero.  Reads served from the read cache or shared
+     * with another read do not call the callback.
+     *
+     * With the attribute stream=1, the tag has no data buffer at all.
+     * The callback is then the only way to get the data, and the tag
+     * accessors and writes return PLCTAG_ERR_NO_DATA.
+     *
+     * The callback is called from within plc_tag_read or plc_tag_status
+     * while the library holds the tag's lock.  It must not call library
+     * functions on the same tag.  Pass a NULL callback to stop streaming.
+     * Shared tags cannot stream.
+     */
+
+    typedef void (*plc_tag_stream_callback_func)(plc_tag tag, int offset, const uint8_t *data, int size, void *userdata);
+
+    LIB_EXPORT int plc_tag_set_stream_callback(plc_tag tag, plc_tag_stream_callback_func callback, void *userdata);
+
+
+
 
     /*
      * plc_tag_status
@@ -254,6 +281,114 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_write_bit
+     *
+     * Set or clear one bit in the PLC without writing the rest of the tag.
+     * offset_bit counts as for plc_tag_set_bit.  The PLC changes the bit
+     * itself, so bits the PLC logic changes in the same word are not
+     * overwritten.  Bit writes made while another operation on the tag is
+     * in flight are sent together when it finishes, one request per word.
+     * The local copy of the bit is changed too.  The timeout works as for
+     * plc_tag_write.
+     *
+     * Returns PLCTAG_ERR_UNSUPPORTED if the PLC type cannot do this.
+     */
+    LIB_EXPORT int plc_tag_write_bit(plc_tag tag, int offset_bit, int val, int timeout);
+
+
+
+
+    /*
+     * Request priorities.
+     *
+     * Requests to the PLC are sent in priority order.  The default priority
+     * of a tag is set with the "priority" attribute (low, normal or high).
+     * Writes go one level above the tag's priority.  The calls below
+     * override the priority for a single operation.
+     */
+
+    #define PLCTAG_PRIORITY_LOW         (0)
+    #define PLCTAG_PRIORITY_NORMAL      (1)
+    #define PLCTAG_PRIORITY_HIGH        (2)
+
+    LIB_EXPORT int plc_tag_read_with_priority(plc_tag tag, int timeout, int priority);
+    LIB_EXPORT int plc_tag_write_with_priority(plc_tag tag, int timeout, int priority);
+
+
+
+    /*
+     * plc_tag_get_int_attribute
+     *
+     * Get information the library keeps about a tag, such as statistics
+     * about the connection it uses.  The available attributes depend on
+     * the protocol.  Returns default_value if the attribute is not known.
+     */
+
+    LIB_EXPORT int plc_tag_get_int_attribute(plc_tag tag, const char *attrib_name, int default_value);
+
+
+
+    /*
+     * plc_tag_list
+     *
+     * List the tags in the PLC that the passed tag talks to.  The callback
+     * is called once for each controller and program scoped tag.  Program
+     * scoped tags are named "Program:<program>.<tag>".  The symbol is only
+     * valid during the callback, which must not use the same tag handle.
+     *
+     * The type is the raw PLC type word.  Dimensions that are not used are
+     * zero.  Only Logix-class PLCs support this, others return
+     * PLCTAG_ERR_UNSUPPORTED.
+     *
+     * The list is read from the PLC the first time and then kept for the
+     * life of the connection to the PLC.
+     */
+
+    typedef struct {
+        const char *name;
+        uint32_t instance_id;
+        uint16_t type;
+        uint32_t dims[3];
+    } plc_tag_symbol;
+
+    typedef void (*plc_tag_list_callback_func)(const plc_tag_symbol *symbol, void *userdata);
+
+    LIB_EXPORT int plc_tag_list(plc_tag tag, plc_tag_list_callback_func callback, void *userdata);
+
+
+
+    /*
+     * Structure fields.
+     *
+     * plc_tag_get_field_offset returns the byte offset in the tag data of
+     * a field of a Logix structure (UDT) tag, or an error.  Nested fields
+     * and array elements are named as in tag names, for example
+     * "Motor.Speed" or "Axis[2].Position".  The offset is from the start
+     * of the tag's first element.
+     *
+     * The structure definitions are read from the PLC once per connection.
+     * Look the offset up once and keep it; it can be passed straight to the
+     * data accessors so access in a loop costs nothing extra.
+     *
+     * plc_tag_get_field_info also returns the field's type word, its bit
+     * number if it is a BOOL (-1 otherwise), and its element count and
+     * element size.
+     */
+
+    typedef struct {
+        int offset;
+        int type;
+        int bit;
+        int elem_count;
+        int elem_size;
+    } plc_tag_field_info;
+
+    LIB_EXPORT int plc_tag_get_field_offset(plc_tag tag, const char *field_name);
+    LIB_EXPORT int plc_tag_get_field_info(plc_tag tag, const char *field_name, plc_tag_field_info *info);
+
+
+
 
     /*
      * Tag data accessors.
@@ -286,6 +421,124 @@ extern "C" {
     LIB_EXPORT int plc_tag_set_float32(plc_tag tag, int offset, float val);
 
 
+    /*
+     * Direct data access.
+     *
+     * plc_tag_borrow_data returns a read-only pointer to the tag's data buffer
+     * and its size without copying.  The tag must not have an operation
+     * in flight.  Until the matching plc_tag_return_data call, reads and
+     * all setters on the tag return PLCTAG_ERR_BUSY, so the view stays
+     * consistent.  plc_tag_destroy also returns PLCTAG_ERR_BUSY, return the
+     * data first.  Do not hold the pointer after returning it.
+     */
+
+    LIB_EXPORT int plc_tag_borrow_data(plc_tag tag, const uint8_t **data, int *size);
+    LIB_EXPORT int plc_tag_return_data(plc_tag tag);
+
+
+    /*
+     * Bit accessors.
+     *
+     * Bit offsets count from the start of the tag data, so bit N of a packed
+     * BOOL array or DINT is at offset_bit N.  plc_tag_get_bit returns 0 or 1,
+     * or a negative error code.
+     *
+     * plc_tag_get_bits unpacks count bits starting at bit_offset into out, one
+     * byte (0 or 1) per bit.  The out buffer must hold at least count bytes.
+     */
+
+    LIB_EXPORT int plc_tag_get_bit(plc_tag tag, int offset_bit);
+    LIB_EXPORT int plc_tag_set_bit(plc_tag tag, int offset_bit, int val);
+
+    LIB_EXPORT int plc_tag_get_bits(plc_tag tag, int bit_offset, uint8_t *out, int count);
+
+
+
+    /*
+     * Subscriptions.
+     *
+     * plc_tag_subscribe has the library read the tag every period_ms in a
+     * background thread.  The callback is called with PLCTAG_STATUS_OK when
+     * the tag data has changed since the last callback, or with the error
+     * code when a read fails.  A failure is only reported once until the
+     * status changes again.
+     *
+     * If deadband is zero, any change in the data counts.  Otherwise the
+     * data is treated as an array of REAL (float32) values and a value must
+     * move more than the deadband to count.
+     *
+     * The callback is called from the library's thread.  It may use the tag
+     * accessors but must not block for long.  A tag has at most one
+     * subscription; subscribing again replaces it.  Destroying the tag ends
+     * the subscription.
+     */
+
+    typedef void (*plc_tag_callback_func)(plc_tag tag, int status, void *userdata);
+
+    LIB_EXPORT int plc_tag_subscribe(plc_tag tag, int period_ms, float deadband, plc_tag_callback_func callback, void *userdata);
+    LIB_EXPORT int plc_tag_unsubscribe(plc_tag tag);
+
+
+    /*
+     * Scan classes.
+     *
+     * A scan class reads all of its tags together once every period_ms.
+     * plc_tag_scan_class_create returns a scan class ID or an error.  Lower
+     * priority values are more important.  While a more important class is
+     * overrunning its period, less important classes skip cycles so the PLC
+     * can catch up.
+     *
+     * Tags are added with a deadband and callback that work as for
+     * plc_tag_subscribe.  Adding a tag replaces any subscription it had.
+     *
+     * Times in the statistics are in milliseconds.  Jitter is how late a
+     * cycle started.
+     */
+
+    typedef struct {
+        int64_t cycles;
+        int64_t overruns;
+        int64_t shed_cycles;
+        int64_t last_cycle_ms;
+        int64_t max_cycle_ms;
+        int64_t total_cycle_ms;
+        int64_t last_jitter_ms;
+        int64_t max_jitter_ms;
+    } plc_tag_scan_class_stats;
+
+    LIB_EXPORT int plc_tag_scan_class_create(int period_ms, int priority);
+    LIB_EXPORT int plc_tag_scan_class_destroy(int scan_class);
+    LIB_EXPORT int plc_tag_scan_class_add_tag(int scan_class, plc_tag tag, float deadband, plc_tag_callback_func callback, void *userdata);
+    LIB_EXPORT int plc_tag_scan_class_get_stats(int scan_class, plc_tag_scan_class_stats *stats);
+
+
+
+    /*
+     * Write-behind.
+     *
+     * In write-behind mode plc_tag_write returns PLCTAG_STATUS_OK at once
+     * and the library's thread writes the tag later.  Only one write per
+     * tag is in flight.  Writes made while it is in flight are merged and
+     * the next write sends the tag data as it is when that write starts.
+     * Values that were replaced before then are never sent.
+     *
+     * Once the first write-behind write has finished, the tag accessors
+     * can be used while later writes are in flight.
+     *
+     * The callback, if not NULL, is called from the library's thread when
+     * each write finishes.  It gets the status and the data that was
+     * written.  The data is only valid during the callback.
+     *
+     * Disabling write-behind mode or destroying the tag drops any write
+     * that has not started yet.
+     */
+
+    typedef void (*plc_tag_write_callback_func)(plc_tag tag, int status, const uint8_t *data, int size, void *userdata);
+
+    LIB_EXPORT int plc_tag_write_behind_enable(plc_tag tag, plc_tag_write_callback_func callback, void *userdata);
+    LIB_EXPORT int plc_tag_write_behind_disable(plc_tag tag);
+
+
 #ifdef __cplusplus
 }
 #endif
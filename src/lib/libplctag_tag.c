@@ -37,6 +37,8 @@
 #include <lib/libplctag.h>
 #include <lib/libplctag_tag.h>
 #include <lib/init.h>
+#include <lib/shared_tag.h>
+#include <lib/subscription.h>
 #include <platform.h>
 #include <util/attr.h>
 #include <util/debug.h>
@@ -49,7 +51,13 @@ static int allocate_new_tag_to_id_mapping(plc_tag_p tag);
 static int release_tag_to_id_mapping(plc_tag_p tag);
 static int api_lock(int index);
 static int api_unlock(int index);
+static void api_unlock_shared(int index);
 static int tag_ptr_to_tag_index(plc_tag tag_id_ptr);
+static void tag_mark_dirty(plc_tag_p tag, int offset, int length);
+static void tag_clear_dirty(plc_tag_p tag);
+static int tag_data_status(plc_tag_p tag);
+static int tag_read_common(plc_tag tag_id, int timeout, int priority);
+static int tag_write_common(plc_tag tag_id, int timeout, int priority, uint8_t **snapshot, int *snapshot_size);
 
 
 
@@ -69,6 +77,12 @@ static volatile int next_tag_id = MAX_TAG_ENTRIES;
 static volatile plc_tag_p tag_map[MAX_TAG_ENTRIES + 1] = {0,};
 static volatile mutex_p tag_api_mutex[MAX_TAG_ENTRIES + 1] = {0,};
 
+/* the shared tag locked along with each API mutex, if any. */
+static volatile plc_tag_p tag_api_shared[MAX_TAG_ENTRIES + 1] = {0,};
+
+/* one entry per byte value, each bit expanded to a 0/1 byte in bit order. */
+static uint8_t bit_unpack_table[256][8];
+
 
 
 #define api_block(tag_id)                                              \
@@ -104,6 +118,13 @@ int lib_init(void)
         rc = mutex_create((mutex_p*)&tag_api_mutex[i]);
     }
 
+    /* set up the table used to unpack BOOL arrays a byte at a time. */
+    for(int i=0; i < 256; i++) {
+        for(int j=0; j < 8; j++) {
+            bit_unpack_table[i][j] = (uint8_t)((i >> j) & 0x01);
+        }
+    }
+
     pdebug(DEBUG_INFO,"Done.");
 
     return rc;
@@ -188,6 +209,7 @@ LIB_EXPORT const char* plc_tag_decode_error(int rc)
         case PLCTAG_ERR_NOT_FOUND: return "PLCTAG_ERR_NOT_FOUND"; break;
         case PLCTAG_ERR_ABORT: return "PLCTAG_ERR_ABORT"; break;
         case PLCTAG_ERR_WINSOCK: return "PLCTAG_ERR_WINSOCK"; break;
+        case PLCTAG_ERR_BUSY: return "PLCTAG_ERR_BUSY"; break;
 
         default: return "Unknown error."; break;
     }
@@ -210,6 +232,8 @@ LIB_EXPORT plc_tag plc_tag_create(const char *attrib_str)
     attr attribs = NULL;
     int rc = PLCTAG_STATUS_OK;
     int read_cache_ms = 0;
+    int read_coalesce_ms = 0;
+    const char *priority = NULL;
     tag_create_function tag_constructor;
 
     pdebug(DEBUG_INFO,"Starting");
@@ -245,7 +269,12 @@ LIB_EXPORT plc_tag plc_tag_create(const char *attrib_str)
         return PLC_TAG_NULL;
     }
 
-    tag = tag_constructor(attribs);
+    /* identical tags can share one underlying tag if asked. */
+    if(attr_get_int(attribs, "share_tag", 0)) {
+        tag = shared_tag_create(attribs, tag_constructor);
+    } else {
+        tag = tag_constructor(attribs);
+    }
 
     /*
      * FIXME - this really should be here???  Maybe not?  But, this is
@@ -268,6 +297,33 @@ LIB_EXPORT plc_tag plc_tag_create(const char *attrib_str)
     tag->read_cache_expire = (uint64_t)0;
     tag->read_cache_ms = (uint64_t)read_cache_ms;
 
+    /* set up read coalescing. */
+    read_coalesce_ms = attr_get_int(attribs,"read_coalesce_ms",0);
+
+    if(read_coalesce_ms < 0) {
+        pdebug(DEBUG_WARN, "read_coalesce_ms value must be positive, using zero.");
+        read_coalesce_ms = 0;
+    }
+
+    tag->read_coalesce_ms = (int64_t)read_coalesce_ms;
+
+    /* set up the request priority. */
+    priority = attr_get_str(attribs, "priority", "normal");
+
+    if(str_cmp_i(priority, "low") == 0) {
+        tag->priority = PLCTAG_PRIORITY_LOW;
+    } else if(str_cmp_i(priority, "high") == 0) {
+        tag->priority = PLCTAG_PRIORITY_HIGH;
+    } else {
+        if(str_cmp_i(priority, "normal") != 0) {
+            pdebug(DEBUG_WARN, "Unknown priority %s, using normal.", priority);
+        }
+
+        tag->priority = PLCTAG_PRIORITY_NORMAL;
+    }
+
+    tag->op_priority = tag->priority;
+
     /* create tag mutex */
     rc = mutex_create(&tag->mut);
 
@@ -398,6 +454,7 @@ int plc_tag_abort_mapped(plc_tag_p tag)
 
     /* who knows what state the tag data is in.  */
     tag->read_cache_expire = (uint64_t)0;
+    tag->read_in_flight = 0;
 
     if(!tag->vtable || !tag->vtable->abort) {
         pdebug(DEBUG_WARN,"Tag does not have a abort function!");
@@ -482,8 +539,16 @@ int plc_tag_destroy_mapped(plc_tag_p tag)
     /* destroy the tag's mutex */
     mutex_destroy(&tag->mut);
 
-    /* abort anything in flight */
-    rc = plc_tag_abort_mapped(tag);
+    /* abort anything in flight, shared tags are aborted by their last handle. */
+    if(shared_tag_data_owner(tag) == tag) {
+        rc = plc_tag_abort_mapped(tag);
+    }
+
+    /* the dirty word map is owned by the generic layer. */
+    if(tag->dirty_words) {
+        mem_free(tag->dirty_words);
+        tag->dirty_words = NULL;
+    }
 
     /* call the destructor */
     if(!tag->vtable || !tag->vtable->destroy) {
@@ -515,7 +580,14 @@ LIB_EXPORT int plc_tag_destroy(plc_tag tag_id)
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
             rc = PLCTAG_ERR_NOT_FOUND;
+        } else if(shared_tag_data_owner(tag)->borrow_count > 0) {
+            /* freeing the data would leave the borrower with a dangling pointer. */
+            pdebug(DEBUG_WARN, "Tag data is borrowed, cannot destroy the tag!");
+            rc = PLCTAG_ERR_BUSY;
         } else {
+            /* the destructor may free the shared tag and its lock. */
+            api_unlock_shared(tag_ptr_to_tag_index(tag_id));
+
             /* the tag was still mapped, so destroy it. */
             rc = plc_tag_destroy_mapped(tag);
         }
@@ -540,9 +612,29 @@ LIB_EXPORT int plc_tag_destroy(plc_tag tag_id)
  */
 
 LIB_EXPORT int plc_tag_read(plc_tag tag_id, int timeout)
+{
+    return tag_read_common(tag_id, timeout, -1);
+}
+
+
+LIB_EXPORT int plc_tag_read_with_priority(plc_tag tag_id, int timeout, int priority)
+{
+    if(priority < PLCTAG_PRIORITY_LOW || priority > PLCTAG_PRIORITY_HIGH) {
+        pdebug(DEBUG_WARN, "Priority %d is not valid.", priority);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return tag_read_common(tag_id, timeout, priority);
+}
+
+
+/* a negative priority means use the tag's priority. */
+static int tag_read_common(plc_tag tag_id, int timeout, int priority)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    int64_t call_time = time_ms();
+    int join_read = 0;
 
     pdebug(DEBUG_INFO, "Starting.");
 
@@ -568,17 +660,60 @@ LIB_EXPORT int plc_tag_read(plc_tag tag_id, int timeout)
             break;
         }
 
-        /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->read(tag);
-
-        /* if error, return now */
-        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+        /* a read would overwrite data that someone is looking at. */
+        if(shared_tag_data_owner(tag)->borrow_count > 0) {
+            pdebug(DEBUG_WARN, "Tag data is borrowed, cannot start a read!");
+            rc = PLCTAG_ERR_BUSY;
             break;
         }
 
-        /* set up the cache time */
-        if(tag->read_cache_ms) {
-            tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+        /*
+         * read coalescing.  If another read was in flight when we were
+         * called, share its result instead of sending a duplicate request
+         * to the PLC.  The shared read must not be older than the allowed
+         * staleness.
+         */
+        if(tag->read_coalesce_ms && (time_ms() - tag->read_issue_time) <= tag->read_coalesce_ms) {
+            /* this updates the read tracking state. */
+            rc = plc_tag_status_mapped(tag);
+
+            if(tag->read_in_flight && rc == PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_INFO, "Joining read already in flight.");
+                join_read = 1;
+            } else if(rc == PLCTAG_STATUS_OK && tag->read_complete_time >= call_time) {
+                pdebug(DEBUG_INFO, "Returning data from read that completed while waiting.");
+                break;
+            }
+        }
+
+        if(!join_read) {
+            tag->op_priority = (priority < 0 ? tag->priority : priority);
+            tag->op_deadline = (timeout > 0 ? time_ms() + timeout : 0);
+
+            /* the protocol implementation does not do the timeout. */
+            rc = tag->vtable->read(tag);
+
+            /* if error, return now */
+            if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            /* the local changes will be overwritten by the PLC's data. */
+            tag_clear_dirty(tag);
+
+            /* set up the cache time */
+            if(tag->read_cache_ms) {
+                tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+            }
+
+            /* track the read so that other callers can share it. */
+            tag->read_issue_time = time_ms();
+
+            if(rc == PLCTAG_STATUS_PENDING) {
+                tag->read_in_flight = 1;
+            } else {
+                tag->read_complete_time = tag->read_issue_time;
+            }
         }
 
         /*
@@ -626,6 +761,40 @@ LIB_EXPORT int plc_tag_read(plc_tag tag_id, int timeout)
 
 
 
+LIB_EXPORT int plc_tag_set_stream_callback(plc_tag tag_id, plc_tag_stream_callback_func callback, void *userdata)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        /* the reads land in the shared tag, not in this one. */
+        if(shared_tag_data_owner(tag) != tag) {
+            pdebug(DEBUG_WARN,"Shared tags cannot stream.");
+            rc = PLCTAG_ERR_NOT_ALLOWED;
+            break;
+        }
+
+        tag->stream_callback = callback;
+        tag->stream_userdata = userdata;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
 
 
 /*
@@ -641,6 +810,8 @@ LIB_EXPORT int plc_tag_read(plc_tag tag_id, int timeout)
 
 int plc_tag_status_mapped(plc_tag_p tag)
 {
+    int rc = PLCTAG_STATUS_OK;
+
     /* pdebug(DEBUG_DETAIL, "Starting."); */
     if(!tag) {
         pdebug(DEBUG_ERROR,"Null tag passed!");
@@ -652,7 +823,23 @@ int plc_tag_status_mapped(plc_tag_p tag)
         return PLCTAG_ERR_NOT_IMPLEMENTED;
     }
 
-    return tag->vtable->status(tag);
+    rc = tag->vtable->status(tag);
+
+    /* note when a read finishes so that later readers can share it. */
+    if(tag->read_in_flight && rc != PLCTAG_STATUS_PENDING) {
+        tag->read_in_flight = 0;
+
+        if(rc == PLCTAG_STATUS_OK) {
+            tag->read_complete_time = time_ms();
+        }
+    }
+
+    if(tag->write_behind_in_flight && rc != PLCTAG_STATUS_PENDING) {
+        tag->write_behind_in_flight = 0;
+        tag->write_behind_ready |= (rc == PLCTAG_STATUS_OK);
+    }
+
+    return rc;
 }
 
 
@@ -698,9 +885,35 @@ LIB_EXPORT int plc_tag_status(plc_tag tag_id)
  */
 
 LIB_EXPORT int plc_tag_write(plc_tag tag_id, int timeout)
+{
+    return tag_write_common(tag_id, timeout, -1, NULL, NULL);
+}
+
+
+LIB_EXPORT int plc_tag_write_with_priority(plc_tag tag_id, int timeout, int priority)
+{
+    if(priority < PLCTAG_PRIORITY_LOW || priority > PLCTAG_PRIORITY_HIGH) {
+        pdebug(DEBUG_WARN, "Priority %d is not valid.", priority);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return tag_write_common(tag_id, timeout, priority, NULL, NULL);
+}
+
+
+/*
+ * a negative priority means use the tag's priority.  Writes go one
+ * level higher than reads of the same tag so that a setpoint change does
+ * not wait behind polling.
+ *
+ * If snapshot is not NULL, this is the write-behind thread starting the
+ * write and *snapshot is set to a copy of the data being written.
+ */
+static int tag_write_common(plc_tag tag_id, int timeout, int priority, uint8_t **snapshot, int *snapshot_size)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_INFO, "Starting.");
 
@@ -712,6 +925,8 @@ LIB_EXPORT int plc_tag_write(plc_tag tag_id, int timeout)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* check for null parts */
         if(!tag->vtable || !tag->vtable->write) {
             pdebug(DEBUG_WARN, "Tag does not have a write function!");
@@ -719,6 +934,21 @@ LIB_EXPORT int plc_tag_write(plc_tag tag_id, int timeout)
             break;
         }
 
+        /* the write-behind thread will write the latest data later. */
+        if(tag->write_behind && !snapshot) {
+            write_behind_request(tag_id);
+            rc = PLCTAG_STATUS_OK;
+            break;
+        }
+
+        if(priority < 0) {
+            tag->op_priority = (tag->priority < PLCTAG_PRIORITY_HIGH ? tag->priority + 1 : tag->priority);
+        } else {
+            tag->op_priority = priority;
+        }
+
+        tag->op_deadline = (timeout > 0 ? time_ms() + timeout : 0);
+
         /* the protocol implementation does not do the timeout. */
         rc = tag->vtable->write(tag);
 
@@ -728,6 +958,20 @@ LIB_EXPORT int plc_tag_write(plc_tag tag_id, int timeout)
             break;
         }
 
+        /* the whole buffer is on its way to the PLC. */
+        tag_clear_dirty(tag);
+
+        if(snapshot) {
+            tag->write_behind_in_flight = (rc == PLCTAG_STATUS_PENDING);
+
+            *snapshot = (uint8_t*)mem_alloc(data_tag->size);
+            *snapshot_size = (*snapshot ? data_tag->size : 0);
+
+            if(*snapshot) {
+                mem_copy(*snapshot, data_tag->data, data_tag->size);
+            }
+        }
+
         /*
          * if there is a timeout, then loop until we get
          * an error or we timeout.
@@ -770,124 +1014,191 @@ LIB_EXPORT int plc_tag_write(plc_tag tag_id, int timeout)
 
 
 
-
-
 /*
- * Tag data accessors.
+ * tag_write_behind_start
+ *
+ * Start a write for the write-behind thread.  *data is set to a copy of
+ * the data being written, which the caller must free.
  */
 
+int tag_write_behind_start(plc_tag tag_id, uint8_t **data, int *size)
+{
+    *data = NULL;
+    *size = 0;
+
+    return tag_write_common(tag_id, 0, -1, data, size);
+}
 
 
-LIB_EXPORT int plc_tag_get_size(plc_tag tag_id)
+
+int tag_set_write_behind(plc_tag tag_id, int enable)
 {
-    int result = 0;
+    int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
 
-    pdebug(DEBUG_INFO, "Starting.");
-
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
-            result = PLCTAG_ERR_NOT_FOUND;
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        result = tag->size;
+        tag->write_behind = enable;
     }
 
-    return result;
+    return rc;
 }
 
 
 
+/*
+ * tag_copy_data
+ *
+ * Copy the tag data for the subscription thread.  *data is set to the
+ * copy, which the caller must free.  This does not borrow the data, so
+ * it never gets in the way of the caller's own use of the tag.
+ */
 
-LIB_EXPORT uint32_t plc_tag_get_uint32(plc_tag tag_id, int offset)
+int tag_copy_data(plc_tag tag_id, uint8_t **data, int *size)
 {
-    uint32_t res = UINT32_MAX;
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    *data = NULL;
+    *size = 0;
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
-            pdebug(DEBUG_WARN,"Tag not in good state!");
+        data_tag = shared_tag_data_owner(tag);
+
+        /* the data must not be changing underneath us. */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK) {
             break;
         }
 
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
+        if(!data_tag->data) {
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        *data = (uint8_t*)mem_alloc(data_tag->size);
+        if(!*data) {
+            pdebug(DEBUG_ERROR,"Unable to allocate copy of tag data!");
+            rc = PLCTAG_ERR_NO_MEM;
             break;
         }
 
-        res = ((uint32_t)(tag->data[offset])) +
-              ((uint32_t)(tag->data[offset+1]) << 8) +
-              ((uint32_t)(tag->data[offset+2]) << 16) +
-              ((uint32_t)(tag->data[offset+3]) << 24);
+        mem_copy(*data, data_tag->data, data_tag->size);
+        *size = data_tag->size;
     }
 
-    return res;
+    return rc;
 }
 
 
 
-LIB_EXPORT int plc_tag_set_uint32(plc_tag tag_id, int offset, uint32_t val)
+/*
+ * plc_tag_write_bit
+ *
+ * Change one bit in the PLC with the protocol's read-modify-write
+ * support.  The local copy is changed too but not marked dirty as it is
+ * already on its way to the PLC.
+ */
+
+LIB_EXPORT int plc_tag_write_bit(plc_tag tag_id, int offset_bit, int val, int timeout)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+    uint8_t mask = 0;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
-            pdebug(DEBUG_WARN,"Tag not in good state!");
+        data_tag = shared_tag_data_owner(tag);
+
+        if(!tag->vtable || !tag->vtable->write_bit) {
+            pdebug(DEBUG_WARN, "Tag does not support bit writes!");
+            rc = PLCTAG_ERR_UNSUPPORTED;
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        if((offset_bit < 0) || ((offset_bit / 8) >= data_tag->size)) {
+            pdebug(DEBUG_WARN,"Bit offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /* write the data. */
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-    }
+        tag->op_priority = (tag->priority < PLCTAG_PRIORITY_HIGH ? tag->priority + 1 : tag->priority);
+        tag->op_deadline = (timeout > 0 ? time_ms() + timeout : 0);
+
+        rc = tag->vtable->write_bit(tag, offset_bit, val);
+
+        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Response from bit write command is not OK!");
+            break;
+        }
+
+        mask = (uint8_t)(1 << (offset_bit % 8));
+
+        if(val) {
+            data_tag->data[offset_bit / 8] |= mask;
+        } else {
+            data_tag->data[offset_bit / 8] &= (uint8_t)~mask;
+        }
+
+        if(timeout) {
+            int64_t timeout_time = timeout + time_ms();
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                rc = plc_tag_status_mapped(tag);
+
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                sleep_ms(5); /* MAGIC */
+            }
+
+            if(rc == PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Bit write operation timed out.");
+                plc_tag_abort_mapped(tag);
+                rc = PLCTAG_ERR_TIMEOUT;
+            }
+        }
+    } /* end of api block */
+
+    pdebug(DEBUG_INFO, "Done");
 
     return rc;
 }
@@ -895,13 +1206,24 @@ LIB_EXPORT int plc_tag_set_uint32(plc_tag tag_id, int offset, uint32_t val)
 
 
 
-LIB_EXPORT int32_t  plc_tag_get_int32(plc_tag tag_id, int offset)
+
+/*
+ * Tag data accessors.
+ */
+
+
+
+LIB_EXPORT int plc_tag_get_int_attribute(plc_tag tag_id, const char *attrib_name, int default_value)
 {
-    int32_t res = INT32_MIN;
-    int rc = PLCTAG_STATUS_OK;
+    int result = default_value;
     plc_tag_p tag = NULL;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!attrib_name) {
+        pdebug(DEBUG_WARN, "Attribute name is null.");
+        return default_value;
+    }
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
@@ -910,76 +1232,578 @@ LIB_EXPORT int32_t  plc_tag_get_int32(plc_tag tag_id, int offset)
             break;
         }
 
-        /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
-            pdebug(DEBUG_WARN,"Tag not in good state!");
-            break;
-        }
-
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        if(!tag->vtable || !tag->vtable->get_int_attrib) {
+            pdebug(DEBUG_DETAIL, "Tag does not support attributes.");
             break;
         }
 
-        res = (int32_t)(((uint32_t)(tag->data[offset])) +
-                        ((uint32_t)(tag->data[offset+1]) << 8) +
-                        ((uint32_t)(tag->data[offset+2]) << 16) +
-                        ((uint32_t)(tag->data[offset+3]) << 24));
+        result = tag->vtable->get_int_attrib(tag, attrib_name, default_value);
     }
 
-    return res;
+    pdebug(DEBUG_INFO, "Done.");
+
+    return result;
 }
 
 
 
-LIB_EXPORT int plc_tag_set_int32(plc_tag tag_id, int offset, int32_t ival)
+
+/*
+ * plc_tag_list
+ *
+ * List the tags in the PLC the tag talks to.  This can block while
+ * the list is read from the PLC.
+ */
+
+LIB_EXPORT int plc_tag_list(plc_tag tag_id, plc_tag_list_callback_func callback, void *userdata)
 {
-    uint32_t val = (uint32_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!callback) {
+        pdebug(DEBUG_WARN, "Callback is null.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
-            pdebug(DEBUG_WARN,"Tag not in good state!");
+        if(!tag->vtable || !tag->vtable->list) {
+            pdebug(DEBUG_WARN, "Tag does not support listing.");
+            rc = PLCTAG_ERR_UNSUPPORTED;
             break;
         }
 
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
-            break;
+        rc = tag->vtable->list(tag, callback, userdata);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_get_field_offset(plc_tag tag_id, const char *field_name)
+{
+    plc_tag_field_info info;
+    int rc = PLCTAG_STATUS_OK;
+
+    rc = plc_tag_get_field_info(tag_id, field_name, &info);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    return info.offset;
+}
+
+
+
+
+/*
+ * plc_tag_get_field_info
+ *
+ * Find a field in a structured tag.  This can block the first time
+ * while the structure definition is read from the PLC.
+ */
+
+LIB_EXPORT int plc_tag_get_field_info(plc_tag tag_id, const char *field_name, plc_tag_field_info *info)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!field_name || !info) {
+        pdebug(DEBUG_WARN, "Field name or info pointer is null.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        if(!tag->vtable || !tag->vtable->get_field_info) {
+            pdebug(DEBUG_WARN, "Tag does not support fields.");
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        rc = tag->vtable->get_field_info(tag, field_name, info);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_get_size(plc_tag tag_id)
+{
+    int result = 0;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            result = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        result = shared_tag_data_owner(tag)->size;
+    }
+
+    return result;
+}
+
+
+
+
+LIB_EXPORT uint32_t plc_tag_get_uint32(plc_tag tag_id, int offset)
+{
+    uint32_t res = UINT32_MAX;
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = ((uint32_t)(data_tag->data[offset])) +
+              ((uint32_t)(data_tag->data[offset+1]) << 8) +
+              ((uint32_t)(data_tag->data[offset+2]) << 16) +
+              ((uint32_t)(data_tag->data[offset+3]) << 24);
+    }
+
+    return res;
+}
+
+
+
+LIB_EXPORT int plc_tag_set_uint32(plc_tag tag_id, int offset, uint32_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        /* write the data. */
+        data_tag->data[offset]   = (uint8_t)(val & 0xFF);
+        data_tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        data_tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        data_tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_mark_dirty(tag, offset, 4);
+    }
+
+    return rc;
+}
+
+
+
+
+LIB_EXPORT int32_t  plc_tag_get_int32(plc_tag tag_id, int offset)
+{
+    int32_t res = INT32_MIN;
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = (int32_t)(((uint32_t)(data_tag->data[offset])) +
+                        ((uint32_t)(data_tag->data[offset+1]) << 8) +
+                        ((uint32_t)(data_tag->data[offset+2]) << 16) +
+                        ((uint32_t)(data_tag->data[offset+3]) << 24));
+    }
+
+    return res;
+}
+
+
+
+LIB_EXPORT int plc_tag_set_int32(plc_tag tag_id, int offset, int32_t ival)
+{
+    uint32_t val = (uint32_t)(ival);
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        data_tag->data[offset]   = (uint8_t)(val & 0xFF);
+        data_tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        data_tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        data_tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_mark_dirty(tag, offset, 4);
+    }
+
+    return rc;
+}
+
+
+
+
+
+
+
+
+
+LIB_EXPORT uint16_t plc_tag_get_uint16(plc_tag tag_id, int offset)
+{
+    uint16_t res = UINT16_MAX;
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = ((uint16_t)(data_tag->data[offset])) +
+              ((uint16_t)(data_tag->data[offset+1]) << 8);
+    }
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_uint16(plc_tag tag_id, int offset, uint16_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        data_tag->data[offset]   = (uint8_t)(val & 0xFF);
+        data_tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+
+        tag_mark_dirty(tag, offset, 2);
+    }
+
+    return rc;
+}
+
+
+
+
+
+
+
+
+
+LIB_EXPORT int16_t  plc_tag_get_int16(plc_tag tag_id, int offset)
+{
+    int16_t res = INT16_MIN;
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            break;
+        }
+
+        /* is there enough data */
+        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > data_tag->size)) {
+            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            break;
+        }
+
+        res = (int16_t)(((uint16_t)(data_tag->data[offset])) +
+                        ((uint16_t)(data_tag->data[offset+1]) << 8));
+    }
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_int16(plc_tag tag_id, int offset, int16_t ival)
+{
+    uint16_t val = (uint16_t)(ival);
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            break;
+        }
+
+        data_tag = shared_tag_data_owner(tag);
+
+        /* is the tag ready for this operation? */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+            pdebug(DEBUG_WARN,"Tag not in good state!");
+            break;
+        }
+
+        /* is there data? */
+        if(!data_tag->data) {
+            pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        data_tag->data[offset]   = (uint8_t)(val & 0xFF);
+        data_tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+
+        tag_mark_dirty(tag, offset, 2);
     }
 
     return rc;
@@ -992,12 +1816,12 @@ LIB_EXPORT int plc_tag_set_int32(plc_tag tag_id, int offset, int32_t ival)
 
 
 
-
-LIB_EXPORT uint16_t plc_tag_get_uint16(plc_tag tag_id, int offset)
+LIB_EXPORT uint8_t plc_tag_get_uint8(plc_tag tag_id, int offset)
 {
-    uint16_t res = UINT16_MAX;
+    uint8_t res = UINT8_MAX;
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1008,27 +1832,28 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(plc_tag tag_id, int offset)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = ((uint16_t)(tag->data[offset])) +
-              ((uint16_t)(tag->data[offset+1]) << 8);
+        res = data_tag->data[offset];
     }
 
     return res;
@@ -1037,10 +1862,11 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(plc_tag tag_id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint16(plc_tag tag_id, int offset, uint16_t val)
+LIB_EXPORT int plc_tag_set_uint8(plc_tag tag_id, int offset, uint8_t val)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1051,29 +1877,39 @@ LIB_EXPORT int plc_tag_set_uint16(plc_tag tag_id, int offset, uint16_t val)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        data_tag->data[offset] = val;
+
+        tag_mark_dirty(tag, offset, 1);
     }
 
     return rc;
@@ -1083,46 +1919,44 @@ LIB_EXPORT int plc_tag_set_uint16(plc_tag tag_id, int offset, uint16_t val)
 
 
 
-
-
-
-
-LIB_EXPORT int16_t  plc_tag_get_int16(plc_tag tag_id, int offset)
+LIB_EXPORT int8_t plc_tag_get_int8(plc_tag tag_id, int offset)
 {
-    int16_t res = INT16_MIN;
+    int8_t res = INT8_MIN;
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
-        if(!tag) {
+       if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = (int16_t)(((uint16_t)(tag->data[offset])) +
-                        ((uint16_t)(tag->data[offset+1]) << 8));
+        res = (int8_t)(data_tag->data[offset]);
     }
 
     return res;
@@ -1131,11 +1965,12 @@ LIB_EXPORT int16_t  plc_tag_get_int16(plc_tag tag_id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_int16(plc_tag tag_id, int offset, int16_t ival)
+LIB_EXPORT int plc_tag_set_int8(plc_tag tag_id, int offset, int8_t ival)
 {
-    uint16_t val = (uint16_t)(ival);
+    uint8_t val = (uint8_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1146,29 +1981,39 @@ LIB_EXPORT int plc_tag_set_int16(plc_tag tag_id, int offset, int16_t ival)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        data_tag->data[offset] = (uint8_t)val;
+
+        tag_mark_dirty(tag, offset, 1);
     }
 
     return rc;
@@ -1181,11 +2026,15 @@ LIB_EXPORT int plc_tag_set_int16(plc_tag tag_id, int offset, int16_t ival)
 
 
 
-LIB_EXPORT uint8_t plc_tag_get_uint8(plc_tag tag_id, int offset)
+
+
+LIB_EXPORT float plc_tag_get_float32(plc_tag tag_id, int offset)
 {
-    uint8_t res = UINT8_MAX;
-    int rc = PLCTAG_STATUS_OK;
+    uint32_t ures;
+    float res = FLT_MAX;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1196,40 +2045,51 @@ LIB_EXPORT uint8_t plc_tag_get_uint8(plc_tag tag_id, int offset)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(ures)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             break;
         }
 
-        res = tag->data[offset];
+        ures = ((uint32_t)(data_tag->data[offset])) +
+               ((uint32_t)(data_tag->data[offset+1]) << 8) +
+               ((uint32_t)(data_tag->data[offset+2]) << 16) +
+               ((uint32_t)(data_tag->data[offset+3]) << 24);
     }
 
+    /* copy the data */
+    mem_copy(&res,&ures,sizeof(res));
+
     return res;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_uint8(plc_tag tag_id, int offset, uint8_t val)
+LIB_EXPORT int plc_tag_set_float32(plc_tag tag_id, int offset, float fval)
 {
     int rc = PLCTAG_STATUS_OK;
+    uint32_t val = 0;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    /* copy the data */
+    mem_copy(&val, &fval, sizeof(val));
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
@@ -1238,28 +2098,42 @@ LIB_EXPORT int plc_tag_set_uint8(plc_tag tag_id, int offset, uint8_t val)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(val)) > data_tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset] = val;
+        data_tag->data[offset]   = (uint8_t)(val & 0xFF);
+        data_tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        data_tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        data_tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_mark_dirty(tag, offset, 4);
     }
 
     return rc;
@@ -1267,56 +2141,113 @@ LIB_EXPORT int plc_tag_set_uint8(plc_tag tag_id, int offset, uint8_t val)
 
 
 
+/*
+ * plc_tag_borrow_data
+ *
+ * Hand out a read-only pointer directly into the tag's data buffer.  The
+ * tag must not have any IO in flight.  While the data is borrowed, reads
+ * and setters fail with PLCTAG_ERR_BUSY so the buffer cannot change under
+ * the caller.  Borrows nest; each one must be matched with a call to
+ * plc_tag_return_data().
+ */
 
-
-LIB_EXPORT int8_t plc_tag_get_int8(plc_tag tag_id, int offset)
+LIB_EXPORT int plc_tag_borrow_data(plc_tag tag_id, const uint8_t **data, int *size)
 {
-    int8_t res = INT8_MIN;
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!data || !size) {
+        pdebug(DEBUG_WARN,"Null pointer passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *data = NULL;
+    *size = 0;
 
     api_block(tag_id) {
         tag = map_id_to_tag(tag_id);
-       if(!tag) {
+        if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        data_tag = shared_tag_data_owner(tag);
+
+        /* the data must not be changing underneath us. */
+        rc = tag_data_status(tag);
+        if(rc != PLCTAG_STATUS_OK) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        data_tag->borrow_count++;
+
+        *data = data_tag->data;
+        *size = data_tag->size;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+LIB_EXPORT int plc_tag_return_data(plc_tag tag_id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    api_block(tag_id) {
+        tag = map_id_to_tag(tag_id);
+        if(!tag) {
+            pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        if(shared_tag_data_owner(tag)->borrow_count <= 0) {
+            pdebug(DEBUG_WARN,"Tag data was not borrowed!");
+            rc = PLCTAG_ERR_NOT_ALLOWED;
             break;
         }
 
-        res = (int8_t)(tag->data[offset]);
+        shared_tag_data_owner(tag)->borrow_count--;
     }
 
-    return res;
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
 }
 
 
 
+/*
+ * Bit accessors.
+ *
+ * Bits are numbered from the start of the tag data.  Bit N is in byte N/8
+ * at bit position N%8.  Since the data is little-endian, this matches the
+ * bit numbering of a packed Logix BOOL array or a DINT.
+ */
 
-LIB_EXPORT int plc_tag_set_int8(plc_tag tag_id, int offset, int8_t ival)
+LIB_EXPORT int plc_tag_get_bit(plc_tag tag_id, int offset_bit)
 {
-    uint8_t val = (uint8_t)(ival);
-    int rc = PLCTAG_STATUS_OK;
+    int res = PLCTAG_ERR_NOT_FOUND;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1327,48 +2258,44 @@ LIB_EXPORT int plc_tag_set_int8(plc_tag tag_id, int offset, int8_t ival)
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
-        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        res = tag_data_status(tag);
+        if(res != PLCTAG_STATUS_OK && res != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
+            res = PLCTAG_ERR_NO_DATA;
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+        if((offset_bit < 0) || ((offset_bit / 8) >= data_tag->size)) {
+            pdebug(DEBUG_WARN,"Bit offset out of bounds.");
+            res = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset] = (uint8_t)val;
+        res = (data_tag->data[offset_bit / 8] >> (offset_bit % 8)) & 0x01;
     }
 
-    return rc;
+    return res;
 }
 
 
 
-
-
-
-
-
-
-
-LIB_EXPORT float plc_tag_get_float32(plc_tag tag_id, int offset)
+LIB_EXPORT int plc_tag_set_bit(plc_tag tag_id, int offset_bit, int val)
 {
-    uint32_t ures;
-    float res = FLT_MAX;
-    plc_tag_p tag = NULL;
     int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
+    int offset = 0;
+    uint8_t mask = 0;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1376,84 +2303,144 @@ LIB_EXPORT float plc_tag_get_float32(plc_tag tag_id, int offset)
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* is someone looking at the data? */
+        if(data_tag->borrow_count > 0) {
+            pdebug(DEBUG_WARN,"Tag data is borrowed!");
+            rc = PLCTAG_ERR_BUSY;
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        if((offset_bit < 0) || ((offset_bit / 8) >= data_tag->size)) {
+            pdebug(DEBUG_WARN,"Bit offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        ures = ((uint32_t)(tag->data[offset])) +
-               ((uint32_t)(tag->data[offset+1]) << 8) +
-               ((uint32_t)(tag->data[offset+2]) << 16) +
-               ((uint32_t)(tag->data[offset+3]) << 24);
-    }
+        offset = offset_bit / 8;
+        mask = (uint8_t)(1 << (offset_bit % 8));
 
-    /* copy the data */
-    mem_copy(&res,&ures,sizeof(res));
+        if(val) {
+            data_tag->data[offset] |= mask;
+        } else {
+            data_tag->data[offset] &= (uint8_t)~mask;
+        }
 
-    return res;
+        tag_mark_dirty(tag, offset, 1);
+    }
+
+    return rc;
 }
 
 
 
+/*
+ * plc_tag_get_bits
+ *
+ * Unpack count bits starting at bit_offset into out, one byte per bit.
+ * Each output byte is 0 or 1.
+ *
+ * Unaligned leading and trailing bits are handled one at a time.  All
+ * whole bytes in between are expanded eight bits at a time through a
+ * lookup table, so an 8k bit alarm array is only 1k table copies.
+ */
 
-LIB_EXPORT int plc_tag_set_float32(plc_tag tag_id, int offset, float fval)
+LIB_EXPORT int plc_tag_get_bits(plc_tag tag_id, int bit_offset, uint8_t *out, int count)
 {
     int rc = PLCTAG_STATUS_OK;
-    uint32_t val = 0;
     plc_tag_p tag = NULL;
+    plc_tag_p data_tag = NULL;
 
-    /* copy the data */
-    mem_copy(&val, &fval, sizeof(val));
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!out) {
+        pdebug(DEBUG_WARN,"Null output buffer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(bit_offset < 0 || count < 0) {
+        pdebug(DEBUG_WARN,"Bit offset and count must not be negative.");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
 
     api_block(tag_id) {
+        int bit = bit_offset;
+        int end_bit = 0;
+        uint8_t *outp = out;
+
         tag = map_id_to_tag(tag_id);
         if(!tag) {
             pdebug(DEBUG_WARN,"Tag not found.");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
+        data_tag = shared_tag_data_owner(tag);
+
         /* is the tag ready for this operation? */
-        rc = plc_tag_status_mapped(tag);
+        rc = tag_data_status(tag);
         if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_ERR_OUT_OF_BOUNDS) {
             pdebug(DEBUG_WARN,"Tag not in good state!");
             break;
         }
 
         /* is there data? */
-        if(!tag->data) {
+        if(!data_tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
             rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        if(((int64_t)bit_offset + (int64_t)count) > ((int64_t)data_tag->size * 8)) {
+            pdebug(DEBUG_WARN,"Bit range out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        /* this cannot overflow now that the range is inside the tag. */
+        end_bit = bit_offset + count;
+
+        /* leading bits up to a byte boundary. */
+        while(bit < end_bit && (bit % 8)) {
+            *outp++ = (data_tag->data[bit / 8] >> (bit % 8)) & 0x01;
+            bit++;
+        }
+
+        /* whole bytes. */
+        while((end_bit - bit) >= 8) {
+            mem_copy(outp, &bit_unpack_table[data_tag->data[bit / 8]][0], 8);
+            outp += 8;
+            bit += 8;
+        }
+
+        /* trailing bits. */
+        while(bit < end_bit) {
+            *outp++ = (data_tag->data[bit / 8] >> (bit % 8)) & 0x01;
+            bit++;
+        }
+
+        rc = PLCTAG_STATUS_OK;
     }
 
     return rc;
@@ -1512,6 +2499,16 @@ static int api_lock(int index)
 
     rc = mutex_lock(tag_api_mutex[index]);
 
+    /*
+     * Handles on a shared tag all use the same IO state and data, so
+     * they must also hold the shared tag's lock.
+     */
+    if(rc == PLCTAG_STATUS_OK && tag_map[index] && shared_tag_data_owner(tag_map[index]) != tag_map[index]) {
+        if(shared_tag_lock(tag_map[index]) == PLCTAG_STATUS_OK) {
+            tag_api_shared[index] = tag_map[index];
+        }
+    }
+
     pdebug(DEBUG_SPEW,"Done with status %d", rc);
 
     return rc;
@@ -1530,6 +2527,8 @@ static int api_unlock(int index)
         return PLCTAG_ERR_OUT_OF_BOUNDS;
     }
 
+    api_unlock_shared(index);
+
     rc = mutex_unlock(tag_api_mutex[index]);
 
     pdebug(DEBUG_SPEW,"Done with status %d", rc);
@@ -1539,6 +2538,23 @@ static int api_unlock(int index)
 
 
 
+/*
+ * api_unlock_shared
+ *
+ * Release the shared tag lock taken by api_lock, if any.  The API
+ * mutex must be held.
+ */
+
+static void api_unlock_shared(int index)
+{
+    if(tag_api_shared[index]) {
+        shared_tag_unlock(tag_api_shared[index]);
+        tag_api_shared[index] = NULL;
+    }
+}
+
+
+
 
 static int allocate_new_tag_to_id_mapping(plc_tag_p tag)
 {
@@ -1663,5 +2679,99 @@ static int release_tag_to_id_mapping(plc_tag_p tag)
 
 
 
+/*
+ * tag_mark_dirty
+ *
+ * Record that the 32-bit words covering the passed byte range have been
+ * changed locally.  The map is one bit per word and is allocated the first
+ * time it is needed.
+ *
+ * The map belongs to the tag that owns the data, which is the one the
+ * protocol writes.  For a shared tag, that means changes made through any
+ * handle are written by the next write on any handle.
+ *
+ * The caller must hold the tag's API lock.
+ */
+
+static void tag_mark_dirty(plc_tag_p tag, int offset, int length)
+{
+    plc_tag_p owner = shared_tag_data_owner(tag);
+    int num_words = (owner->size + 3) / 4;
+    int first_word = offset / 4;
+    int last_word = (offset + length - 1) / 4;
+
+    if(length <= 0) {
+        return;
+    }
+
+    if(!owner->dirty_words) {
+        owner->dirty_words = (uint8_t*)mem_alloc((num_words + 7) / 8);
+
+        if(!owner->dirty_words) {
+            pdebug(DEBUG_WARN,"Unable to allocate dirty word map!");
+            return;
+        }
+    }
+
+    for(int word = first_word; word <= last_word && word < num_words; word++) {
+        owner->dirty_words[word / 8] |= (uint8_t)(1 << (word % 8));
+    }
+}
+
+
+static void tag_clear_dirty(plc_tag_p tag)
+{
+    plc_tag_p owner = shared_tag_data_owner(tag);
+
+    if(owner->dirty_words) {
+        mem_set(owner->dirty_words, 0, ((owner->size + 3) / 4 + 7) / 8);
+    }
+}
+
+
+
+
+/*
+ * tag_data_status
+ *
+ * The status as far as the accessors are concerned.  The protocols copy
+ * the data into the requests when a write starts, so the local data can
+ * change while a write-behind write is in flight.  Until one such write
+ * has finished, the protocol might still be doing a read first, so the
+ * tag stays locked as usual.
+ *
+ * The caller must hold the tag's API lock.
+ */
+
+static int tag_data_status(plc_tag_p tag)
+{
+    int rc = plc_tag_status_mapped(tag);
+
+    if(rc == PLCTAG_STATUS_PENDING && tag->write_behind_in_flight && tag->write_behind_ready) {
+        rc = PLCTAG_STATUS_OK;
+    }
+
+    return rc;
+}
+
+
+
 
+/*
+ * tag_store_read_data
+ *
+ * Put a chunk of read data into the tag's buffer, if it has one, and
+ * pass it to the stream callback, if there is one.  The caller checks
+ * that the chunk fits in the tag.
+ */
+
+void tag_store_read_data(plc_tag_p tag, int offset, const uint8_t *data, int size)
+{
+    if(tag->data) {
+        mem_copy(tag->data + offset, (void*)data, size);
+    }
 
+    if(tag->stream_callback) {
+        tag->stream_callback((plc_tag)(intptr_t)tag->tag_id, offset, data, size, tag->stream_userdata);
+    }
+}
@@ -54,6 +54,18 @@ typedef int (*tag_write_func)(plc_tag_p tag);
 
 typedef int (*tag_vtable_func)(plc_tag_p tag);
 
+/* optional, returns protocol specific information about the tag. */
+typedef int (*tag_get_int_attrib_func)(plc_tag_p tag, const char *attrib_name, int default_value);
+
+/* optional, lists the tags in the PLC. */
+typedef int (*tag_list_func)(plc_tag_p tag, plc_tag_list_callback_func callback, void *userdata);
+
+/* optional, finds a field within structured tag data. */
+typedef int (*tag_get_field_info_func)(plc_tag_p tag, const char *field_name, plc_tag_field_info *info);
+
+/* optional, changes one bit in the PLC without touching the others. */
+typedef int (*tag_write_bit_func)(plc_tag_p tag, int offset_bit, int val);
+
 /* we'll need to set these per protocol type. */
 struct tag_vtable_t {
     tag_vtable_func abort;
@@ -61,6 +73,10 @@ struct tag_vtable_t {
     tag_vtable_func read;
     tag_vtable_func status;
     tag_vtable_func write;
+    tag_get_int_attrib_func get_int_attrib;
+    tag_list_func list;
+    tag_get_field_info_func get_field_info;
+    tag_write_bit_func write_bit;
 };
 
 typedef struct tag_vtable_t *tag_vtable_p;
@@ -80,8 +96,22 @@ typedef struct tag_vtable_t *tag_vtable_p;
                         int tag_id; \
                         int64_t read_cache_expire; \
                         int64_t read_cache_ms; \
+                        int64_t read_coalesce_ms; \
+                        int64_t read_issue_time; \
+                        int64_t read_complete_time; \
+                        int read_in_flight; \
+                        int priority; \
+                        int op_priority; \
+                        int64_t op_deadline; \
                         int size; \
-                        uint8_t *data
+                        uint8_t *data; \
+                        uint8_t *dirty_words; \
+                        int write_behind; \
+                        int write_behind_in_flight; \
+                        int write_behind_ready; \
+                        plc_tag_stream_callback_func stream_callback; \
+                        void *stream_userdata; \
+                        int borrow_count
 
 struct plc_tag_dummy {
     int tag_id;
@@ -101,6 +131,16 @@ extern int plc_tag_abort_mapped(plc_tag_p tag);
 extern int plc_tag_destroy_mapped(plc_tag_p tag);
 extern int plc_tag_status_mapped(plc_tag_p tag);
 
+/* for the write-behind support in subscription.c */
+extern int tag_set_write_behind(plc_tag tag_id, int enable);
+extern int tag_write_behind_start(plc_tag tag_id, uint8_t **data, int *size);
+
+/* for the subscription thread, so it never borrows the user's tag. */
+extern int tag_copy_data(plc_tag tag_id, uint8_t **data, int *size);
+
+/* for the protocols to hand over read data. */
+extern void tag_store_read_data(plc_tag_p tag, int offset, const uint8_t *data, int size);
+
 
 
 #endif
@@ -0,0 +1,533 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <lib/libplctag.h>
+#include <lib/libplctag_tag.h>
+#include <lib/shared_tag.h>
+#include <platform.h>
+#include <util/attr.h>
+#include <util/debug.h>
+
+
+#define MAX_SHARED_TAG_KEY (1024)
+
+
+typedef struct shared_tag_entry_t *shared_tag_entry_p;
+
+struct shared_tag_entry_t {
+    shared_tag_entry_p next;
+    char key[MAX_SHARED_TAG_KEY];
+    int handle_count;
+    plc_tag_p target;
+    mutex_p mut;
+};
+
+
+struct shared_tag_t {
+    TAG_BASE_STRUCT;
+
+    shared_tag_entry_p entry;
+};
+
+typedef struct shared_tag_t *shared_tag_p;
+
+
+static int shared_tag_abort(plc_tag_p tag);
+static int shared_tag_destroy(plc_tag_p tag);
+static int shared_tag_read(plc_tag_p tag);
+static int shared_tag_status(plc_tag_p tag);
+static int shared_tag_write(plc_tag_p tag);
+static int shared_tag_get_int_attrib(plc_tag_p tag, const char *attrib_name, int default_value);
+static int shared_tag_list(plc_tag_p tag, plc_tag_list_callback_func callback, void *userdata);
+static int shared_tag_get_field_info(plc_tag_p tag, const char *field_name, plc_tag_field_info *info);
+static int shared_tag_write_bit(plc_tag_p tag, int offset_bit, int val);
+
+static struct tag_vtable_t shared_tag_vtable = {
+    (tag_vtable_func)shared_tag_abort,
+    (tag_vtable_func)shared_tag_destroy,
+    (tag_vtable_func)shared_tag_read,
+    (tag_vtable_func)shared_tag_status,
+    (tag_vtable_func)shared_tag_write,
+    (tag_get_int_attrib_func)shared_tag_get_int_attrib,
+    (tag_list_func)shared_tag_list,
+    (tag_get_field_info_func)shared_tag_get_field_info,
+    (tag_write_bit_func)shared_tag_write_bit
+};
+
+
+/* protected by global_library_mutex */
+static shared_tag_entry_p shared_tags = NULL;
+
+
+
+static int make_shared_tag_key(attr attribs, char *key, int key_size);
+static shared_tag_entry_p reserve_entry(const char *key);
+static shared_tag_entry_p create_entry(attr attribs, tag_create_function tag_constructor, const char *key);
+static int release_entry(shared_tag_entry_p entry, int unshare);
+
+
+
+/*
+ * shared_tag_create
+ *
+ * Find or create the underlying tag for the passed attributes and
+ * return a new proxy for it.  The underlying tag is created with the
+ * passed constructor the first time it is needed.
+ *
+ * Tags that failed to be created are not shared, a later create will
+ * make a fresh one.
+ */
+
+plc_tag_p shared_tag_create(attr attribs, tag_create_function tag_constructor)
+{
+    shared_tag_p tag = NULL;
+    shared_tag_entry_p entry = NULL;
+    char key[MAX_SHARED_TAG_KEY];
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(make_shared_tag_key(attribs, key, (int)sizeof(key)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Tag identity is too long to share, creating an unshared tag.");
+        return tag_constructor(attribs);
+    }
+
+    tag = (shared_tag_p)mem_alloc(sizeof(struct shared_tag_t));
+
+    if(!tag) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for shared tag!");
+        return PLC_TAG_P_NULL;
+    }
+
+    /* is there a healthy tag we can use? */
+    entry = reserve_entry(key);
+
+    if(entry) {
+        critical_block(entry->mut) {
+            rc = entry->target->vtable->status(entry->target);
+        }
+
+        if(rc == PLCTAG_STATUS_OK || rc == PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_DETAIL, "Sharing existing tag %p for %s", entry->target, key);
+        } else {
+            pdebug(DEBUG_DETAIL, "Existing tag %p for %s is in error, not sharing it.", entry->target, key);
+            release_entry(entry, 1);
+            entry = NULL;
+        }
+    }
+
+    if(!entry) {
+        entry = create_entry(attribs, tag_constructor, key);
+    }
+
+    if(!entry) {
+        mem_free(tag);
+        return PLC_TAG_P_NULL;
+    }
+
+    /* the data and size stay with the shared tag, see shared_tag_data_owner(). */
+    tag->vtable = &shared_tag_vtable;
+    tag->entry = entry;
+    tag->endian = entry->target->endian;
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return (plc_tag_p)tag;
+}
+
+
+
+/*
+ * shared_tag_data_owner
+ *
+ * Return the tag that owns the data buffer.  For proxies that is the
+ * shared tag, otherwise it is the passed tag.
+ */
+
+plc_tag_p shared_tag_data_owner(plc_tag_p tag)
+{
+    if(tag && tag->vtable == &shared_tag_vtable) {
+        return ((shared_tag_p)tag)->entry->target;
+    }
+
+    return tag;
+}
+
+
+
+/*
+ * shared_tag_lock
+ *
+ * Lock the shared tag behind a proxy.  The API layer holds this lock
+ * for the whole of each call on a handle, so the proxy functions below
+ * and the data accessors never run at the same time for two handles.
+ */
+
+int shared_tag_lock(plc_tag_p tag)
+{
+    if(!tag || tag->vtable != &shared_tag_vtable) {
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+    return mutex_lock(((shared_tag_p)tag)->entry->mut);
+}
+
+
+
+int shared_tag_unlock(plc_tag_p tag)
+{
+    if(!tag || tag->vtable != &shared_tag_vtable) {
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+    return mutex_unlock(((shared_tag_p)tag)->entry->mut);
+}
+
+
+
+/*
+ * The proxy functions.  These pass operations through to the
+ * shared tag.  Except for destroy, they are called with the shared
+ * tag locked.
+ */
+
+
+/*
+ * Only the last handle can abort the shared tag.  The other handles
+ * may still be waiting for the result of the operation in flight.
+ */
+static int shared_tag_abort(plc_tag_p tag)
+{
+    shared_tag_p stag = (shared_tag_p)tag;
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(global_library_mutex) {
+        if(stag->entry->handle_count == 1) {
+            rc = stag->entry->target->vtable->abort(stag->entry->target);
+        }
+    }
+
+    return rc;
+}
+
+
+
+static int shared_tag_destroy(plc_tag_p tag)
+{
+    shared_tag_p stag = (shared_tag_p)tag;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = release_entry(stag->entry, 0);
+
+    mem_free(stag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+static int shared_tag_read(plc_tag_p tag)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    target->op_priority = tag->op_priority;
+    target->op_deadline = tag->op_deadline;
+
+    return target->vtable->read(target);
+}
+
+
+
+static int shared_tag_status(plc_tag_p tag)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    return target->vtable->status(target);
+}
+
+
+
+static int shared_tag_write(plc_tag_p tag)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    target->op_priority = tag->op_priority;
+    target->op_deadline = tag->op_deadline;
+
+    return target->vtable->write(target);
+}
+
+
+
+static int shared_tag_get_int_attrib(plc_tag_p tag, const char *attrib_name, int default_value)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    if(!target->vtable->get_int_attrib) {
+        return default_value;
+    }
+
+    return target->vtable->get_int_attrib(target, attrib_name, default_value);
+}
+
+
+
+static int shared_tag_list(plc_tag_p tag, plc_tag_list_callback_func callback, void *userdata)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    if(!target->vtable->list) {
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    return target->vtable->list(target, callback, userdata);
+}
+
+
+
+static int shared_tag_get_field_info(plc_tag_p tag, const char *field_name, plc_tag_field_info *info)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    if(!target->vtable->get_field_info) {
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    return target->vtable->get_field_info(target, field_name, info);
+}
+
+
+
+static int shared_tag_write_bit(plc_tag_p tag, int offset_bit, int val)
+{
+    plc_tag_p target = ((shared_tag_p)tag)->entry->target;
+
+    if(!target->vtable->write_bit) {
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    target->op_priority = tag->op_priority;
+    target->op_deadline = tag->op_deadline;
+
+    return target->vtable->write_bit(target, offset_bit, val);
+}
+
+
+
+
+/*
+ * reserve_entry
+ *
+ * Find the shared tag for the key and add a handle to it so that it
+ * cannot go away.  The caller checks the tag's status.
+ */
+
+static shared_tag_entry_p reserve_entry(const char *key)
+{
+    shared_tag_entry_p entry = NULL;
+
+    critical_block(global_library_mutex) {
+        for(entry = shared_tags; entry; entry = entry->next) {
+            if(str_cmp(entry->key, key) == 0) {
+                entry->handle_count++;
+                break;
+            }
+        }
+    }
+
+    return entry;
+}
+
+
+
+/*
+ * create_entry
+ *
+ * Create a new underlying tag with one handle.  It is only put in the
+ * list for sharing if it looks like it will work.
+ *
+ * Creating the tag can wait on the network, so it is done without the
+ * library mutex held.  If another thread shared a tag for the same key
+ * in the meantime, that one is used and the new one is thrown away.
+ */
+
+static shared_tag_entry_p create_entry(attr attribs, tag_create_function tag_constructor, const char *key)
+{
+    shared_tag_entry_p entry = NULL;
+    shared_tag_entry_p existing = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    entry = (shared_tag_entry_p)mem_alloc(sizeof(struct shared_tag_entry_t));
+
+    if(!entry) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for shared tag entry!");
+        return NULL;
+    }
+
+    if(mutex_create(&entry->mut) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create shared tag mutex!");
+        mem_free(entry);
+        return NULL;
+    }
+
+    entry->target = tag_constructor(attribs);
+
+    if(!entry->target) {
+        pdebug(DEBUG_WARN, "Unable to create underlying tag!");
+        mutex_destroy(&entry->mut);
+        mem_free(entry);
+        return NULL;
+    }
+
+    str_copy(entry->key, MAX_SHARED_TAG_KEY, key);
+    entry->handle_count = 1;
+
+    /* only share tags that look like they will work. */
+    rc = entry->target->vtable->status(entry->target);
+
+    critical_block(global_library_mutex) {
+        for(existing = shared_tags; existing; existing = existing->next) {
+            if(str_cmp(existing->key, key) == 0) {
+                existing->handle_count++;
+                break;
+            }
+        }
+
+        if(!existing && (rc == PLCTAG_STATUS_OK || rc == PLCTAG_STATUS_PENDING)) {
+            entry->next = shared_tags;
+            shared_tags = entry;
+        }
+    }
+
+    if(existing) {
+        pdebug(DEBUG_DETAIL, "Shared tag %p for %s was created while we made ours, using it.", existing->target, key);
+        release_entry(entry, 0);
+        return existing;
+    }
+
+    pdebug(DEBUG_DETAIL, "Created new shared tag %p for %s", entry->target, key);
+
+    return entry;
+}
+
+
+
+/*
+ * release_entry
+ *
+ * Drop a handle from the shared tag and destroy the tag with the last
+ * one.  If unshare is set, the tag is taken out of the list so that
+ * later creates do not find it.
+ *
+ * Once the tag is out of the list and has no handles, nothing else can
+ * reach it, so it is destroyed without holding its lock.
+ */
+
+static int release_entry(shared_tag_entry_p entry, int unshare)
+{
+    shared_tag_entry_p *walker = NULL;
+    int last_handle = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(global_library_mutex) {
+        entry->handle_count--;
+
+        if(entry->handle_count <= 0) {
+            last_handle = 1;
+        }
+
+        if(last_handle || unshare) {
+            /* unlink it if it was in the list. */
+            for(walker = &shared_tags; *walker && *walker != entry; walker = &((*walker)->next)) { }
+
+            if(*walker) {
+                *walker = entry->next;
+            }
+        }
+    }
+
+    if(last_handle) {
+        pdebug(DEBUG_DETAIL, "Destroying shared tag %p.", entry->target);
+
+        entry->target->vtable->abort(entry->target);
+
+        /* the handles mark their changes in the shared tag's dirty word map. */
+        if(entry->target->dirty_words) {
+            mem_free(entry->target->dirty_words);
+            entry->target->dirty_words = NULL;
+        }
+
+        rc = entry->target->vtable->destroy(entry->target);
+
+        mutex_destroy(&entry->mut);
+        mem_free(entry);
+    }
+
+    return rc;
+}
+
+
+
+
+/*
+ * make_shared_tag_key
+ *
+ * Build a string out of all the attributes, in name order.  Almost all
+ * of them change the underlying tag, so only the few that the API layer
+ * handles per handle are left out.
+ */
+
+static int make_shared_tag_key(attr attribs, char *key, int key_size)
+{
+    const char *handle_attribs[] = { "read_cache_ms", "read_coalesce_ms", "priority", "debug", "share_tag" };
+    int num_handle_attribs = (int)(sizeof(handle_attribs)/sizeof(handle_attribs[0]));
+    const char *name = NULL;
+    int offset = 0;
+    int rc = 0;
+
+    key[0] = 0;
+
+    for(name = attr_next_name(attribs, NULL); name; name = attr_next_name(attribs, name)) {
+        int skip = 0;
+
+        for(int i=0; i < num_handle_attribs && !skip; i++) {
+            skip = (str_cmp(name, handle_attribs[i]) == 0);
+        }
+
+        if(skip) {
+            continue;
+        }
+
+        rc = snprintf_platform(key + offset, (size_t)(key_size - offset), "%s=%s&", name, attr_get_str(attribs, name, ""));
+
+        if(rc < 0 || rc >= (key_size - offset)) {
+            return PLCTAG_ERR_TOO_LONG;
+        }
+
+        offset += rc;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
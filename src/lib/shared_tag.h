@@ -0,0 +1,41 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __LIB_SHARED_TAG_H__
+#define __LIB_SHARED_TAG_H__ 1
+
+#include <lib/libplctag_tag.h>
+#include <lib/init.h>
+#include <util/attr.h>
+
+/*
+ * Tags created with share_tag=1 that have the same attributes share one
+ * underlying tag.  The cache, coalescing, priority and debug attributes
+ * are not compared as each handle gets a light-weight proxy that has its
+ * own settings for those but points at the shared tag's data buffer and
+ * IO.
+ */
+
+extern plc_tag_p shared_tag_create(attr attribs, tag_create_function tag_constructor);
+extern plc_tag_p shared_tag_data_owner(plc_tag_p tag);
+extern int shared_tag_lock(plc_tag_p tag);
+extern int shared_tag_unlock(plc_tag_p tag);
+
+#endif
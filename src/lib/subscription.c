@@ -0,0 +1,1161 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Tag subscriptions and scan classes.
+ *
+ * A single background thread polls all subscribed tags.  It reads through
+ * the public tag API so it gets the same locking, caching and read
+ * coalescing as any other caller.  It copies the data to check it for
+ * changes instead of borrowing it, so it never locks the caller out of
+ * the tag.  Callbacks are called from this thread without any library
+ * locks held.
+ *
+ * A subscription either has its own period or belongs to a scan class.
+ * All tags in a scan class are read together once per class cycle and the
+ * class keeps timing statistics for the cycles.
+ *
+ * Tags in write-behind mode are also written from this thread.  A write
+ * only records that the tag needs writing.  The thread writes whatever
+ * the tag data is when it gets to it, so values that were replaced
+ * before then never go on the wire.
+ */
+
+#define LIBPLCTAGDLL_EXPORTS 1
+
+#include <lib/libplctag.h>
+#include <lib/libplctag_tag.h>
+#include <lib/subscription.h>
+#include <platform.h>
+#include <util/debug.h>
+
+
+typedef struct scan_class_t *scan_class_p;
+
+struct scan_class_t {
+    scan_class_p next;
+
+    int id;
+    int period_ms;
+    int priority;
+    int cancelled;
+
+    int64_t next_cycle_time;
+    int64_t cycle_start_time;
+    int in_cycle;
+
+    /* set when the last cycle did not finish within the period. */
+    int overloaded;
+
+    plc_tag_scan_class_stats stats;
+};
+
+
+typedef struct subscription_t *subscription_p;
+
+struct subscription_t {
+    subscription_p next;
+
+    plc_tag tag;
+    int period_ms;
+    float deadband;
+    plc_tag_callback_func callback;
+    void *userdata;
+
+    /* NULL if the subscription has its own period. */
+    scan_class_p scan_class;
+
+    int64_t next_read_time;
+    int read_pending;
+    int last_status;
+    int cancelled;
+
+    /* the data as of the last notification. */
+    uint8_t *last_data;
+    int last_data_size;
+};
+
+
+typedef struct write_behind_t *write_behind_p;
+
+struct write_behind_t {
+    write_behind_p next;
+
+    plc_tag tag;
+    plc_tag_write_callback_func callback;
+    void *userdata;
+    int cancelled;
+
+    /* set by plc_tag_write, cleared when the thread starts the write. */
+    volatile int write_requested;
+    int write_pending;
+
+    /* the data of the write in flight. */
+    uint8_t *data;
+    int data_size;
+};
+
+
+/*
+ * The lists are protected by the mutex.  New entries are only ever
+ * pushed on the head.  Entries are only unlinked and freed by the
+ * subscription thread, so that thread can walk the lists without the
+ * mutex.
+ */
+static mutex_p subscription_mutex = NULL;
+static volatile subscription_p subscriptions = NULL;
+static volatile scan_class_p scan_classes = NULL;
+static volatile write_behind_p write_behinds = NULL;
+static volatile int subscription_serial = 0;
+static volatile int scan_class_serial = 0;
+
+static thread_p subscription_thread = NULL;
+static volatile int subscriptions_terminating = 0;
+
+
+static int add_subscription(plc_tag tag, int scan_class_id, int period_ms, float deadband, plc_tag_callback_func callback, void *userdata);
+static int start_subscription_thread_unsafe(void);
+static scan_class_p find_scan_class_unsafe(int id);
+static void process_subscription(subscription_p sub, int64_t now);
+static void process_scan_class(scan_class_p scan_class, int64_t now);
+static int scan_class_should_shed(scan_class_p scan_class);
+static void start_subscription_read(subscription_p sub);
+static void check_subscription_read(subscription_p sub);
+static void finish_subscription_read(subscription_p sub, int rc);
+static int check_for_change(subscription_p sub);
+static void process_write_behind(write_behind_p wb);
+static void finish_write_behind(write_behind_p wb, int rc);
+static void remove_cancelled_entries(void);
+
+#ifdef _WIN32
+DWORD __stdcall subscription_handler_func(LPVOID not_used);
+#else
+void* subscription_handler_func(void* not_used);
+#endif
+
+
+
+int subscription_init(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!subscription_mutex) {
+        rc = mutex_create(&subscription_mutex);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create subscription mutex!");
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+void subscription_teardown(void)
+{
+    subscription_p sub = NULL;
+    scan_class_p scan_class = NULL;
+    write_behind_p wb = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(subscription_thread) {
+        pdebug(DEBUG_INFO, "Terminating subscription thread.");
+
+        subscriptions_terminating = 1;
+
+        thread_join(subscription_thread);
+        thread_destroy(&subscription_thread);
+    }
+
+    while(subscriptions) {
+        sub = subscriptions;
+        subscriptions = sub->next;
+
+        if(sub->last_data) {
+            mem_free(sub->last_data);
+        }
+
+        mem_free(sub);
+    }
+
+    while(scan_classes) {
+        scan_class = scan_classes;
+        scan_classes = scan_class->next;
+        mem_free(scan_class);
+    }
+
+    while(write_behinds) {
+        wb = write_behinds;
+        write_behinds = wb->next;
+
+        if(wb->data) {
+            mem_free(wb->data);
+        }
+
+        mem_free(wb);
+    }
+
+    if(subscription_mutex) {
+        mutex_destroy(&subscription_mutex);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+}
+
+
+
+
+/*
+ * plc_tag_subscribe
+ *
+ * Poll the tag every period_ms and call the callback when the data
+ * changes.  Subscribing a tag that is already subscribed replaces the
+ * old subscription.
+ */
+
+LIB_EXPORT int plc_tag_subscribe(plc_tag tag, int period_ms, float deadband, plc_tag_callback_func callback, void *userdata)
+{
+    if(period_ms <= 0) {
+        pdebug(DEBUG_WARN, "Period must be greater than zero.");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return add_subscription(tag, 0, period_ms, deadband, callback, userdata);
+}
+
+
+
+LIB_EXPORT int plc_tag_unsubscribe(plc_tag tag)
+{
+    subscription_p walker = NULL;
+    int rc = PLCTAG_ERR_NOT_FOUND;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!subscription_mutex) {
+        return rc;
+    }
+
+    critical_block(subscription_mutex) {
+        for(walker = subscriptions; walker; walker = walker->next) {
+            if(walker->tag == tag && !walker->cancelled) {
+                walker->cancelled = 1;
+                rc = PLCTAG_STATUS_OK;
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_scan_class_create
+ *
+ * Create a scan class that reads all its tags every period_ms.  Lower
+ * priority values are more important.  Returns the scan class ID or an
+ * error.
+ */
+
+LIB_EXPORT int plc_tag_scan_class_create(int period_ms, int priority)
+{
+    scan_class_p scan_class = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(period_ms <= 0 || priority < 0) {
+        pdebug(DEBUG_WARN, "Period must be greater than zero and priority must not be negative.");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(!subscription_mutex) {
+        pdebug(DEBUG_ERROR, "Subscriptions not initialized!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    scan_class = (scan_class_p)mem_alloc(sizeof(struct scan_class_t));
+
+    if(!scan_class) {
+        pdebug(DEBUG_ERROR, "Unable to allocate scan class!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    scan_class->period_ms = period_ms;
+    scan_class->priority = priority;
+    scan_class->next_cycle_time = time_ms() + period_ms;
+
+    critical_block(subscription_mutex) {
+        rc = start_subscription_thread_unsafe();
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        scan_class->id = ++scan_class_serial;
+
+        scan_class->next = scan_classes;
+        scan_classes = scan_class;
+
+        rc = scan_class->id;
+    }
+
+    if(rc < 0) {
+        mem_free(scan_class);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * plc_tag_scan_class_destroy
+ *
+ * Stop the scan class.  All its subscriptions are cancelled.
+ */
+
+LIB_EXPORT int plc_tag_scan_class_destroy(int scan_class_id)
+{
+    scan_class_p scan_class = NULL;
+    subscription_p sub = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!subscription_mutex) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(subscription_mutex) {
+        scan_class = find_scan_class_unsafe(scan_class_id);
+
+        if(!scan_class) {
+            pdebug(DEBUG_WARN, "Scan class %d not found.", scan_class_id);
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        for(sub = subscriptions; sub; sub = sub->next) {
+            if(sub->scan_class == scan_class) {
+                sub->cancelled = 1;
+            }
+        }
+
+        scan_class->cancelled = 1;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * plc_tag_scan_class_add_tag
+ *
+ * Subscribe the tag as part of the scan class.  This replaces any
+ * existing subscription for the tag.
+ */
+
+LIB_EXPORT int plc_tag_scan_class_add_tag(int scan_class_id, plc_tag tag, float deadband, plc_tag_callback_func callback, void *userdata)
+{
+    if(scan_class_id <= 0) {
+        pdebug(DEBUG_WARN, "Bad scan class ID %d.", scan_class_id);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return add_subscription(tag, scan_class_id, 0, deadband, callback, userdata);
+}
+
+
+
+LIB_EXPORT int plc_tag_scan_class_get_stats(int scan_class_id, plc_tag_scan_class_stats *stats)
+{
+    scan_class_p scan_class = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!stats) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!subscription_mutex) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(subscription_mutex) {
+        scan_class = find_scan_class_unsafe(scan_class_id);
+
+        if(!scan_class) {
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        *stats = scan_class->stats;
+    }
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_write_behind_enable
+ *
+ * Put the tag in write-behind mode.  Enabling it again replaces the
+ * callback.
+ */
+
+LIB_EXPORT int plc_tag_write_behind_enable(plc_tag tag, plc_tag_write_callback_func callback, void *userdata)
+{
+    write_behind_p wb = NULL;
+    write_behind_p walker = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!subscription_mutex) {
+        pdebug(DEBUG_ERROR, "Subscriptions not initialized!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    wb = (write_behind_p)mem_alloc(sizeof(struct write_behind_t));
+
+    if(!wb) {
+        pdebug(DEBUG_ERROR, "Unable to allocate write-behind entry!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    wb->tag = tag;
+    wb->callback = callback;
+    wb->userdata = userdata;
+
+    critical_block(subscription_mutex) {
+        rc = start_subscription_thread_unsafe();
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* a write already asked for carries over to the new entry. */
+        for(walker = write_behinds; walker; walker = walker->next) {
+            if(walker->tag == tag && !walker->cancelled) {
+                wb->write_requested |= walker->write_requested;
+                walker->cancelled = 1;
+            }
+        }
+
+        wb->next = write_behinds;
+        write_behinds = wb;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        mem_free(wb);
+        return rc;
+    }
+
+    /*
+     * the entry must exist before the tag is switched over or a write
+     * could be requested with nothing to pick it up.
+     */
+    rc = tag_set_write_behind(tag, 1);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        critical_block(subscription_mutex) {
+            wb->cancelled = 1;
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * plc_tag_write_behind_disable
+ *
+ * Go back to normal writes.  A write in flight finishes but a write that
+ * has not been started yet is dropped.
+ */
+
+LIB_EXPORT int plc_tag_write_behind_disable(plc_tag tag)
+{
+    write_behind_p walker = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = tag_set_write_behind(tag, 0);
+
+    if(rc != PLCTAG_STATUS_OK || !subscription_mutex) {
+        return rc;
+    }
+
+    critical_block(subscription_mutex) {
+        for(walker = write_behinds; walker; walker = walker->next) {
+            if(walker->tag == tag) {
+                walker->cancelled = 1;
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * write_behind_request
+ *
+ * Called by plc_tag_write for a tag in write-behind mode.  If the tag
+ * was already waiting to be written, this write merges with that one.
+ */
+
+void write_behind_request(plc_tag tag)
+{
+    write_behind_p walker = NULL;
+
+    if(!subscription_mutex) {
+        return;
+    }
+
+    critical_block(subscription_mutex) {
+        for(walker = write_behinds; walker; walker = walker->next) {
+            if(walker->tag == tag && !walker->cancelled) {
+                walker->write_requested = 1;
+            }
+        }
+    }
+}
+
+
+
+
+
+#ifdef _WIN32
+DWORD __stdcall subscription_handler_func(LPVOID not_used)
+#else
+void* subscription_handler_func(void* not_used)
+#endif
+{
+    subscription_p sub = NULL;
+    scan_class_p scan_class = NULL;
+    write_behind_p wb = NULL;
+
+    pdebug(DEBUG_DETAIL,"Starting with arg %p",not_used);
+
+    while(!subscriptions_terminating) {
+        remove_cancelled_entries();
+
+        for(scan_class = scan_classes; scan_class; scan_class = scan_class->next) {
+            if(!scan_class->cancelled) {
+                process_scan_class(scan_class, time_ms());
+            }
+        }
+
+        for(sub = subscriptions; sub; sub = sub->next) {
+            if(!sub->cancelled && !sub->scan_class) {
+                process_subscription(sub, time_ms());
+            }
+        }
+
+        for(wb = write_behinds; wb; wb = wb->next) {
+            if(!wb->cancelled || wb->write_pending) {
+                process_write_behind(wb);
+            }
+        }
+
+        sleep_ms(1);
+    }
+
+    thread_stop();
+
+    /* FIXME -- this should be factored out as a platform dependency.*/
+#ifdef _WIN32
+    return (DWORD)0;
+#else
+    return NULL;
+#endif
+}
+
+
+
+
+/*
+ * add_subscription
+ *
+ * Common code for plain and scan class subscriptions.  A scan class ID
+ * of zero means the subscription has its own period.  Otherwise the
+ * period comes from the scan class.
+ */
+
+static int add_subscription(plc_tag tag, int scan_class_id, int period_ms, float deadband, plc_tag_callback_func callback, void *userdata)
+{
+    subscription_p sub = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!callback) {
+        pdebug(DEBUG_WARN, "Callback must not be null!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(deadband < 0.0f) {
+        pdebug(DEBUG_WARN, "Deadband must not be negative.");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(plc_tag_status(tag) == PLCTAG_ERR_NOT_FOUND) {
+        pdebug(DEBUG_WARN, "Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(!subscription_mutex) {
+        pdebug(DEBUG_ERROR, "Subscriptions not initialized!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    sub = (subscription_p)mem_alloc(sizeof(struct subscription_t));
+
+    if(!sub) {
+        pdebug(DEBUG_ERROR, "Unable to allocate subscription!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    sub->tag = tag;
+    sub->period_ms = period_ms;
+    sub->deadband = deadband;
+    sub->callback = callback;
+    sub->userdata = userdata;
+    sub->last_status = PLCTAG_STATUS_PENDING;
+
+    critical_block(subscription_mutex) {
+        subscription_p walker = subscriptions;
+
+        rc = start_subscription_thread_unsafe();
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        if(scan_class_id) {
+            sub->scan_class = find_scan_class_unsafe(scan_class_id);
+
+            if(!sub->scan_class) {
+                pdebug(DEBUG_WARN, "Scan class %d not found.", scan_class_id);
+                rc = PLCTAG_ERR_NOT_FOUND;
+                break;
+            }
+
+            sub->period_ms = sub->scan_class->period_ms;
+        }
+
+        /* replace any existing subscription. */
+        for(; walker; walker = walker->next) {
+            if(walker->tag == tag) {
+                walker->cancelled = 1;
+            }
+        }
+
+        /*
+         * spread the first reads across the period so that tags subscribed
+         * together do not all hit the PLC at the same time.  Stepping
+         * by 0.618 of the period keeps successive phases well apart.
+         */
+        sub->next_read_time = time_ms() + ((int64_t)subscription_serial * sub->period_ms * 618 / 1000) % sub->period_ms; /* MAGIC */
+        subscription_serial++;
+
+        sub->next = subscriptions;
+        subscriptions = sub;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        mem_free(sub);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+static int start_subscription_thread_unsafe(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    /* start the thread the first time it is needed. */
+    if(!subscription_thread) {
+        rc = thread_create(&subscription_thread, subscription_handler_func, 32*1024, NULL);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create subscription thread!");
+            subscription_thread = NULL;
+        }
+    }
+
+    return rc;
+}
+
+
+
+static scan_class_p find_scan_class_unsafe(int id)
+{
+    scan_class_p scan_class = scan_classes;
+
+    while(scan_class && (scan_class->id != id || scan_class->cancelled)) {
+        scan_class = scan_class->next;
+    }
+
+    return scan_class;
+}
+
+
+
+
+/*
+ * process_subscription
+ *
+ * Start a read when one is due, or check on the one in flight.
+ */
+
+static void process_subscription(subscription_p sub, int64_t now)
+{
+    if(sub->read_pending) {
+        check_subscription_read(sub);
+        return;
+    }
+
+    if(now < sub->next_read_time) {
+        return;
+    }
+
+    /* keep to the schedule, but do not try to catch up missed reads. */
+    sub->next_read_time += sub->period_ms;
+
+    if(sub->next_read_time <= now) {
+        pdebug(DEBUG_DETAIL, "Subscription for tag %p overran its period.", sub->tag);
+        sub->next_read_time = now + sub->period_ms;
+    }
+
+    start_subscription_read(sub);
+}
+
+
+
+
+/*
+ * process_scan_class
+ *
+ * Start a cycle when one is due by starting reads of all the tags in the
+ * class back to back.  Since they are all queued at once, the protocol
+ * layer can send them in the same pass.  The cycle ends when the last
+ * read finishes.
+ *
+ * Jitter is how late a cycle started.  A cycle that takes longer than the
+ * period, or starts so late that the next cycle is already due, is an
+ * overrun.  While a more important class is overloaded, this class skips
+ * its cycles so that the PLC can catch up.
+ */
+
+static void process_scan_class(scan_class_p scan_class, int64_t now)
+{
+    subscription_p sub = NULL;
+    int reads_pending = 0;
+
+    if(scan_class->in_cycle) {
+        for(sub = subscriptions; sub; sub = sub->next) {
+            if(sub->scan_class == scan_class && !sub->cancelled && sub->read_pending) {
+                check_subscription_read(sub);
+                reads_pending |= sub->read_pending;
+            }
+        }
+
+        if(!reads_pending) {
+            int64_t cycle_time = time_ms() - scan_class->cycle_start_time;
+
+            scan_class->in_cycle = 0;
+
+            scan_class->stats.cycles++;
+            scan_class->stats.last_cycle_ms = cycle_time;
+            scan_class->stats.total_cycle_ms += cycle_time;
+
+            if(cycle_time > scan_class->stats.max_cycle_ms) {
+                scan_class->stats.max_cycle_ms = cycle_time;
+            }
+
+            if(cycle_time > scan_class->period_ms) {
+                pdebug(DEBUG_DETAIL, "Scan class %d overran, cycle took %dms.", scan_class->id, (int)cycle_time);
+                scan_class->stats.overruns++;
+                scan_class->overloaded = 1;
+            } else {
+                scan_class->overloaded = 0;
+            }
+        }
+
+        return;
+    }
+
+    if(now < scan_class->next_cycle_time) {
+        return;
+    }
+
+    /* how late are we? */
+    scan_class->stats.last_jitter_ms = now - scan_class->next_cycle_time;
+
+    if(scan_class->stats.last_jitter_ms > scan_class->stats.max_jitter_ms) {
+        scan_class->stats.max_jitter_ms = scan_class->stats.last_jitter_ms;
+    }
+
+    /* keep to the schedule, but do not try to catch up missed cycles. */
+    scan_class->next_cycle_time += scan_class->period_ms;
+
+    if(scan_class->next_cycle_time <= now) {
+        scan_class->stats.overruns++;
+        scan_class->next_cycle_time = now + scan_class->period_ms;
+    }
+
+    if(scan_class_should_shed(scan_class)) {
+        pdebug(DEBUG_DETAIL, "Shedding cycle of scan class %d.", scan_class->id);
+        scan_class->stats.shed_cycles++;
+        return;
+    }
+
+    scan_class->in_cycle = 1;
+    scan_class->cycle_start_time = now;
+
+    for(sub = subscriptions; sub; sub = sub->next) {
+        if(sub->scan_class == scan_class && !sub->cancelled) {
+            start_subscription_read(sub);
+        }
+    }
+}
+
+
+
+/* shed when any more important class is not keeping up. */
+static int scan_class_should_shed(scan_class_p scan_class)
+{
+    scan_class_p walker = scan_classes;
+
+    for(; walker; walker = walker->next) {
+        if(!walker->cancelled && walker->overloaded && walker->priority < scan_class->priority) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+static void start_subscription_read(subscription_p sub)
+{
+    int rc = plc_tag_read(sub->tag, 0);
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        sub->read_pending = 1;
+    } else if(rc == PLCTAG_ERR_BUSY) {
+        /* the caller has the data borrowed, try again next cycle. */
+        pdebug(DEBUG_DETAIL, "Tag %p is busy, skipping this read.", sub->tag);
+    } else {
+        finish_subscription_read(sub, rc);
+    }
+}
+
+
+
+static void check_subscription_read(subscription_p sub)
+{
+    int rc = plc_tag_status(sub->tag);
+
+    if(rc != PLCTAG_STATUS_PENDING) {
+        sub->read_pending = 0;
+        finish_subscription_read(sub, rc);
+    }
+}
+
+
+
+/*
+ * finish_subscription_read
+ *
+ * Call the callback if the data changed or the status changed to an
+ * error.
+ */
+
+static void finish_subscription_read(subscription_p sub, int rc)
+{
+    int notify = 0;
+
+    /* the tag was destroyed out from under us. */
+    if(rc == PLCTAG_ERR_NOT_FOUND) {
+        pdebug(DEBUG_INFO, "Tag %p is gone, cancelling subscription.", sub->tag);
+        sub->cancelled = 1;
+        return;
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        notify = check_for_change(sub) || (sub->last_status != PLCTAG_STATUS_OK);
+    } else {
+        notify = (rc != sub->last_status);
+    }
+
+    sub->last_status = rc;
+
+    if(notify) {
+        sub->callback(sub->tag, rc, sub->userdata);
+    }
+}
+
+
+
+
+/*
+ * check_for_change
+ *
+ * Compare the tag's data with the data from the last notification.  If
+ * there is a deadband, the data is treated as an array of REAL values
+ * and only changes larger than the deadband count.  Any trailing bytes
+ * that are not part of a whole REAL must match exactly.
+ */
+
+static int check_for_change(subscription_p sub)
+{
+    uint8_t *data = NULL;
+    int size = 0;
+    int changed = 0;
+
+    if(tag_copy_data(sub->tag, &data, &size) != PLCTAG_STATUS_OK) {
+        return 0;
+    }
+
+    if(!sub->last_data || sub->last_data_size != size) {
+        changed = 1;
+    } else if(mem_cmp(sub->last_data, data, size) == 0) {
+        changed = 0;
+    } else if(sub->deadband == 0.0f) {
+        changed = 1;
+    } else {
+        int num_reals = size / 4;
+
+        for(int i=0; i < num_reals && !changed; i++) {
+            const uint8_t *old_p = sub->last_data + (i*4);
+            const uint8_t *new_p = data + (i*4);
+            uint32_t old_bits = ((uint32_t)old_p[0]) + ((uint32_t)old_p[1] << 8) + ((uint32_t)old_p[2] << 16) + ((uint32_t)old_p[3] << 24);
+            uint32_t new_bits = ((uint32_t)new_p[0]) + ((uint32_t)new_p[1] << 8) + ((uint32_t)new_p[2] << 16) + ((uint32_t)new_p[3] << 24);
+            float old_val, new_val, diff;
+
+            mem_copy(&old_val, &old_bits, sizeof(old_val));
+            mem_copy(&new_val, &new_bits, sizeof(new_val));
+
+            diff = new_val - old_val;
+
+            /* NaN compares false both ways, so treat any difference as a change. */
+            changed = (diff > sub->deadband || diff < -sub->deadband || diff != diff);
+        }
+
+        if(!changed && (size % 4)) {
+            changed = (mem_cmp(sub->last_data + num_reals*4, data + num_reals*4, size % 4) != 0);
+        }
+    }
+
+    /* keep the copy as the data of this notification. */
+    if(changed) {
+        if(sub->last_data) {
+            mem_free(sub->last_data);
+        }
+
+        sub->last_data = data;
+        sub->last_data_size = size;
+    } else {
+        mem_free(data);
+    }
+
+    return changed;
+}
+
+
+
+
+/*
+ * process_write_behind
+ *
+ * Check on the write in flight.  Once there is none, start a new write
+ * if one was asked for.  The write takes the tag data as it is now, so
+ * any number of writes since the last one go out as one.
+ */
+
+static void process_write_behind(write_behind_p wb)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int requested = 0;
+
+    if(wb->write_pending) {
+        rc = plc_tag_status(wb->tag);
+
+        if(rc == PLCTAG_STATUS_PENDING) {
+            return;
+        }
+
+        wb->write_pending = 0;
+        finish_write_behind(wb, rc);
+    }
+
+    if(wb->cancelled) {
+        return;
+    }
+
+    critical_block(subscription_mutex) {
+        requested = wb->write_requested;
+        wb->write_requested = 0;
+    }
+
+    if(!requested) {
+        return;
+    }
+
+    if(wb->data) {
+        mem_free(wb->data);
+        wb->data = NULL;
+        wb->data_size = 0;
+    }
+
+    rc = tag_write_behind_start(wb->tag, &wb->data, &wb->data_size);
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        wb->write_pending = 1;
+    } else {
+        finish_write_behind(wb, rc);
+    }
+}
+
+
+
+/*
+ * finish_write_behind
+ *
+ * Tell the caller which data ended up in the PLC, or why it did not.
+ */
+
+static void finish_write_behind(write_behind_p wb, int rc)
+{
+    /* the tag was destroyed out from under us. */
+    if(rc == PLCTAG_ERR_NOT_FOUND) {
+        pdebug(DEBUG_INFO, "Tag %p is gone, cancelling write-behind.", wb->tag);
+        wb->cancelled = 1;
+        return;
+    }
+
+    if(wb->callback) {
+        wb->callback(wb->tag, rc, wb->data, wb->data_size, wb->userdata);
+    }
+}
+
+
+
+
+/*
+ * remove_cancelled_entries
+ *
+ * Free cancelled subscriptions and then cancelled scan classes.  A
+ * cancelled scan class never has live subscriptions left.  Cancelled
+ * write-behind entries are kept until their write in flight is done.
+ */
+
+static void remove_cancelled_entries(void)
+{
+    subscription_p *walker = NULL;
+    subscription_p sub = NULL;
+    scan_class_p *class_walker = NULL;
+    scan_class_p scan_class = NULL;
+    write_behind_p *wb_walker = NULL;
+    write_behind_p wb = NULL;
+
+    critical_block(subscription_mutex) {
+        walker = (subscription_p*)&subscriptions;
+
+        while(*walker) {
+            sub = *walker;
+
+            if(sub->cancelled) {
+                *walker = sub->next;
+
+                if(sub->last_data) {
+                    mem_free(sub->last_data);
+                }
+
+                mem_free(sub);
+            } else {
+                walker = &(sub->next);
+            }
+        }
+
+        class_walker = (scan_class_p*)&scan_classes;
+
+        while(*class_walker) {
+            scan_class = *class_walker;
+
+            if(scan_class->cancelled) {
+                *class_walker = scan_class->next;
+                mem_free(scan_class);
+            } else {
+                class_walker = &(scan_class->next);
+            }
+        }
+
+        wb_walker = (write_behind_p*)&write_behinds;
+
+        while(*wb_walker) {
+            wb = *wb_walker;
+
+            if(wb->cancelled && !wb->write_pending) {
+                *wb_walker = wb->next;
+
+                if(wb->data) {
+                    mem_free(wb->data);
+                }
+
+                mem_free(wb);
+            } else {
+                wb_walker = &(wb->next);
+            }
+        }
+    }
+}
@@ -117,6 +117,19 @@ extern void mem_copy(void *d1, void *d2, int size)
 
 
 
+/*
+ * mem_cmp
+ *
+ * compare memory.  Returns zero if the two buffers have the same
+ * contents for the passed number of bytes.
+ */
+extern int mem_cmp(void *d1, void *d2, int size)
+{
+    return memcmp(d1, d2, size);
+}
+
+
+
 
 /***************************************************************************
  ******************************* Strings ***********************************
@@ -154,6 +167,18 @@ extern int str_cmp_i(const char *first, const char *second)
 
 
 
+/*
+ * str_cmp_i_n
+ *
+ * Compare at most num_chars characters of the strings, ignoring case.
+ */
+extern int str_cmp_i_n(const char *first, const char *second, int num_chars)
+{
+    return strncasecmp(first, second, (size_t)num_chars);
+}
+
+
+
 /*
  * str_copy
  *
@@ -813,6 +838,12 @@ extern int socket_read(sock_p s, uint8_t *buf, int size)
         }
     }
 
+    /* zero bytes when we asked for some means the other end closed the socket. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN,"Socket closed by the remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
     return rc;
 }
 
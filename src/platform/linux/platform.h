@@ -48,10 +48,12 @@ extern void *mem_alloc(int size);
 extern void mem_free(const void *mem);
 extern void mem_set(void *d1, int c, int size);
 extern void mem_copy(void *d1, void *d2, int size);
+extern int mem_cmp(void *d1, void *d2, int size);
 
 /* string functions/defs */
 extern int str_cmp(const char *first, const char *second);
 extern int str_cmp_i(const char *first, const char *second);
+extern int str_cmp_i_n(const char *first, const char *second, int num_chars);
 extern int str_copy(char *dst, int dst_size, const char *src);
 extern int str_length(const char *str);
 extern char *str_dup(const char *str);
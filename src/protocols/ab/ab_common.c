@@ -37,6 +37,10 @@
 #include <ab/eip_pccc.h>
 #include <ab/eip_dhp_pccc.h>
 #include <ab/session.h>
+#include <ab/symbol.h>
+#include <ab/pccc_file.h>
+#include <ab/template.h>
+#include <ab/meta_cache.h>
 #include <ab/connection.h>
 #include <ab/tag.h>
 #include <ab/request.h>
@@ -55,6 +59,9 @@ volatile mutex_p global_session_mut = NULL;
 /* request/response handling thread */
 volatile thread_p io_handler_thread = NULL;
 
+/* reconnects lost sessions so that the IO thread never blocks on them */
+volatile thread_p reconnect_thread = NULL;
+
 volatile int library_terminating = 0;
 
 
@@ -105,18 +112,24 @@ int ab_init(void)
     plc_dhp_vtable.read     = (tag_read_func)eip_dhp_pccc_tag_read_start;
     plc_dhp_vtable.status   = (tag_status_func)eip_dhp_pccc_tag_status;
     plc_dhp_vtable.write    = (tag_write_func)eip_dhp_pccc_tag_write_start;
+    plc_dhp_vtable.get_int_attrib = (tag_get_int_attrib_func)ab_tag_get_int_attrib;
 
     plc_vtable.abort        = (tag_abort_func)ab_tag_abort;
     plc_vtable.destroy      = (tag_destroy_func)ab_tag_destroy;
     plc_vtable.read         = (tag_read_func)eip_pccc_tag_read_start;
     plc_vtable.status       = (tag_status_func)eip_pccc_tag_status;
     plc_vtable.write        = (tag_write_func)eip_pccc_tag_write_start;
+    plc_vtable.get_int_attrib = (tag_get_int_attrib_func)ab_tag_get_int_attrib;
 
     cip_vtable.abort        = (tag_abort_func)ab_tag_abort;
     cip_vtable.destroy      = (tag_destroy_func)ab_tag_destroy;
     cip_vtable.read         = (tag_read_func)eip_cip_tag_read_start;
     cip_vtable.status       = (tag_status_func)eip_cip_tag_status;
     cip_vtable.write        = (tag_write_func)eip_cip_tag_write_start;
+    cip_vtable.get_int_attrib = (tag_get_int_attrib_func)ab_tag_get_int_attrib;
+    cip_vtable.list         = (tag_list_func)ab_tag_list;
+    cip_vtable.get_field_info = (tag_get_field_info_func)ab_tag_get_field_info;
+    cip_vtable.write_bit    = (tag_write_bit_func)eip_cip_tag_write_bit;
 
     /* this is a mutex used to synchronize most activities in this protocol */
     rc = mutex_create((mutex_p*)&global_session_mut);
@@ -126,6 +139,13 @@ int ab_init(void)
         return rc;
     }
 
+    rc = meta_cache_init();
+
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to set up the metadata cache!");
+        return rc;
+    }
+
     /* create the background IO handler thread */
     rc = thread_create((thread_p*)&io_handler_thread, request_handler_func, 32*1024, NULL);
 
@@ -134,6 +154,14 @@ int ab_init(void)
         return rc;
     }
 
+    /* create the thread that brings back lost sessions */
+    rc = thread_create((thread_p*)&reconnect_thread, reconnect_handler_func, 32*1024, NULL);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_INFO,"Unable to create reconnect thread!");
+        return rc;
+    }
+
 
     pdebug(DEBUG_INFO,"Finished initializing AB protocol library.");
 
@@ -155,6 +183,14 @@ void ab_teardown(void)
     thread_join(io_handler_thread);
     thread_destroy((thread_p*)&io_handler_thread);
 
+    pdebug(DEBUG_INFO,"Terminating reconnect thread.");
+    /* this waits for any connect attempt or cache flush in progress. */
+    thread_join(reconnect_thread);
+    thread_destroy((thread_p*)&reconnect_thread);
+
+    pdebug(DEBUG_INFO,"Saving metadata cache.");
+    meta_cache_teardown();
+
     pdebug(DEBUG_INFO,"Freeing global session mutex.");
     /* clean up the mutex */
     mutex_destroy((mutex_p*)&global_session_mut);
@@ -170,6 +206,7 @@ plc_tag_p ab_tag_create(attr attribs)
     const char *path;
     int num_retries;
     int default_retry_interval;
+    int stream_only;
 
     pdebug(DEBUG_INFO,"Starting.");
 
@@ -210,26 +247,21 @@ plc_tag_p ab_tag_create(attr attribs)
     /* AB PLCs are little endian. */
     tag->endian = PLCTAG_DATA_LITTLE_ENDIAN;
 
-    /* allocate memory for the data */
-    tag->elem_count = attr_get_int(attribs,"elem_count",1);
+    /*
+     * Logix tags can leave out the size, it is looked up in the PLC's
+     * symbol table once we can talk to the PLC.
+     */
+    tag->elem_count = attr_get_int(attribs,"elem_count",0);
     tag->elem_size = attr_get_int(attribs,"elem_size",0);
-    tag->size = (tag->elem_count) * (tag->elem_size);
+    tag->size = (tag->elem_count ? tag->elem_count : 1) * (tag->elem_size);
 
-    if(tag->size == 0) {
+    if(tag->size == 0 && tag->protocol_type != AB_PROTOCOL_LGX) {
         /* failure! Need data_size! */
         pdebug(DEBUG_WARN,"Tag size is zero!");
         tag->status = PLCTAG_ERR_BAD_PARAM;
         return (plc_tag_p)tag;
     }
 
-    tag->data = (uint8_t*)mem_alloc(tag->size);
-
-    if(tag->data == NULL) {
-        pdebug(DEBUG_WARN,"Unable to allocate tag data!");
-        tag->status = PLCTAG_ERR_NO_MEM;
-        return (plc_tag_p)tag;
-    }
-
     /* get the connection path, punt if there is not one and we have a Logix-class PLC. */
     path = attr_get_str(attribs,"path",NULL);
 
@@ -356,6 +388,58 @@ plc_tag_p ab_tag_create(attr attribs)
         return (plc_tag_p)tag;
     }
 
+    if(tag->size == 0 && set_tag_size_from_symbol(tag) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Tag size is zero and could not be found!");
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
+    /*
+     * Logix PLCs can address controller tags by symbol instance instead
+     * of by name.  This makes each request smaller.
+     */
+    if(tag->protocol_type == AB_PROTOCOL_LGX && attr_get_int(attribs, "use_instance_ids", 0)) {
+        symbol_encode_tag_instance(tag);
+    }
+
+    if(!tag->elem_count) {
+        tag->elem_count = 1;
+    }
+
+    /* allocate memory for the data, unless the data is only streamed. */
+    tag->size = (tag->elem_count) * (tag->elem_size);
+    stream_only = attr_get_int(attribs, "stream", 0);
+
+    if(!stream_only) {
+        tag->data = (uint8_t*)mem_alloc(tag->size);
+    }
+
+    if(tag->data == NULL && !stream_only) {
+        pdebug(DEBUG_WARN,"Unable to allocate tag data!");
+        tag->status = PLCTAG_ERR_NO_MEM;
+        return (plc_tag_p)tag;
+    }
+
+    /*
+     * skip the discovery read if an earlier run remembered the tag,
+     * otherwise plan it from the tag size.
+     */
+    if(tag->vtable == &cip_vtable) {
+        meta_cache_attach(tag, attribs);
+
+        if(tag->first_read) {
+            eip_cip_tag_plan_read(tag);
+        }
+    }
+
+    /* share one read of the data file with other tags in the same file. */
+    if(tag->vtable == &plc_vtable && attr_get_int(attribs, "file_cache", 0)) {
+        if((tag->status = pccc_file_attach(tag)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to share data file reads! Status=%d", tag->status);
+            return (plc_tag_p)tag;
+        }
+    }
+
     pdebug(DEBUG_INFO,"Done.");
 
     return (plc_tag_p)tag;
@@ -436,6 +520,112 @@ tag_vtable_p set_tag_vtable(ab_tag_p tag)
 }
 
 
+/*
+ * allocate_request_slot
+ *
+ * Increase the number of available request slots.
+ */
+int allocate_request_slot(ab_tag_p tag)
+{
+    int* old_sizes;
+    ab_request_p* old_reqs;
+    int i;
+    int old_max = tag->max_requests;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    /* bump up the number of allowed requests */
+    tag->max_requests += DEFAULT_MAX_REQUESTS;
+
+    pdebug(DEBUG_DETAIL, "setting max_requests = %d", tag->max_requests);
+
+    /* (re)allocate the read size array */
+    old_sizes = tag->read_req_sizes;
+    tag->read_req_sizes = (int*)mem_alloc(tag->max_requests * sizeof(int));
+
+    if (!tag->read_req_sizes) {
+        mem_free(old_sizes);
+        pdebug(DEBUG_WARN,"Unable to allocate read sizes array!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    /* copy the size data */
+    if (old_sizes) {
+        for (i = 0; i < old_max; i++) {
+            tag->read_req_sizes[i] = old_sizes[i];
+        }
+
+        mem_free(old_sizes);
+    }
+
+    /* (re)allocate the write size array */
+    old_sizes = tag->write_req_sizes;
+    tag->write_req_sizes = (int*)mem_alloc(tag->max_requests * sizeof(int));
+
+    if (!tag->write_req_sizes) {
+        mem_free(old_sizes);
+        pdebug(DEBUG_WARN,"Unable to allocate write sizes array!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    /* copy the size data */
+    if (old_sizes) {
+        for (i = 0; i < old_max; i++) {
+            tag->write_req_sizes[i] = old_sizes[i];
+        }
+
+        mem_free(old_sizes);
+    }
+
+    /* do the same for the request array */
+    old_reqs = tag->reqs;
+    tag->reqs = (ab_request_p*)mem_alloc(tag->max_requests * sizeof(ab_request_p));
+
+    if (!tag->reqs) {
+        pdebug(DEBUG_WARN,"Unable to allocate requests array!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    /* copy the request data, there shouldn't be anything here I think... */
+    if (old_reqs) {
+        for (i = 0; i < old_max; i++) {
+            tag->reqs[i] = old_reqs[i];
+        }
+
+        mem_free(old_reqs);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+int allocate_read_request_slot(ab_tag_p tag)
+{
+    /* increase the number of available request slots */
+    tag->num_read_requests++;
+
+    if (tag->num_read_requests > tag->max_requests) {
+        return allocate_request_slot(tag);
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+int allocate_write_request_slot(ab_tag_p tag)
+{
+    /* increase the number of available request slots */
+    tag->num_write_requests++;
+
+    if (tag->num_write_requests > tag->max_requests) {
+        return allocate_request_slot(tag);
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 /*
  * ab_tag_abort
  *
@@ -463,10 +653,151 @@ int ab_tag_abort(ab_tag_p tag)
 
     tag->read_in_progress = 0;
     tag->write_in_progress = 0;
+    tag->bit_write_in_progress = 0;
+
+    /* stop reading or waiting for a shared data file read. */
+    pccc_file_abort(tag);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/*
+ * ab_tag_check_request_errors
+ *
+ * The IO thread sets the status of a request when it gives up on it,
+ * for instance when its deadline passes.  If any request of the
+ * operation in flight failed, abort the operation and return the error.
+ */
+
+int ab_tag_check_request_errors(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    if(!tag->reqs || !(tag->read_in_progress || tag->write_in_progress)) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    for(i = 0; i < tag->max_requests && rc == PLCTAG_STATUS_OK; i++) {
+        if(tag->reqs[i] && tag->reqs[i]->status != PLCTAG_STATUS_OK) {
+            rc = tag->reqs[i]->status;
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Request failed in the IO thread, aborting operation. rc=%d", rc);
+        ab_tag_abort(tag);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * ab_tag_list
+ *
+ * Pass each symbol in the PLC's symbol table to the callback.
+ */
+
+int ab_tag_list(ab_tag_p tag, plc_tag_list_callback_func callback, void *userdata)
+{
+    ab_symbol_table_p table = NULL;
+    plc_tag_symbol symbol;
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(tag->protocol_type != AB_PROTOCOL_LGX) {
+        pdebug(DEBUG_WARN, "Only Logix-class PLCs have a symbol table.");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    rc = symbol_get_table(tag, &table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get symbol table! rc=%d", rc);
+        return rc;
+    }
+
+    /* a loaded table does not change and we hold it, so we can walk it without the mutex. */
+    for(i=0; i < table->num_symbols; i++) {
+        symbol.name = table->symbols[i].name;
+        symbol.instance_id = table->symbols[i].instance_id;
+        symbol.type = table->symbols[i].type;
+        symbol.dims[0] = table->symbols[i].dims[0];
+        symbol.dims[1] = table->symbols[i].dims[1];
+        symbol.dims[2] = table->symbols[i].dims[2];
+
+        callback(&symbol, userdata);
+    }
+
+    symbol_release_table(table);
+
+    pdebug(DEBUG_INFO, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
+
+
+
+/*
+ * ab_tag_get_field_info
+ *
+ * Find a field in a Logix structure tag using the PLC's templates.
+ */
+
+int ab_tag_get_field_info(ab_tag_p tag, const char *field_name, plc_tag_field_info *info)
+{
+    if(tag->protocol_type != AB_PROTOCOL_LGX) {
+        pdebug(DEBUG_WARN, "Only Logix-class PLCs have structure templates.");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    return template_get_field_info(tag, field_name, info);
+}
+
+
+
+
+/*
+ * ab_tag_get_int_attrib
+ *
+ * Report the settings and statistics of the rate limits of the tag's
+ * session and connection.  The names are "session_" or "connection_"
+ * followed by the rate limit attribute.  session_reconnects counts how
+ * often the session came back after losing its socket.
+ */
+
+int ab_tag_get_int_attrib(ab_tag_p tag, const char *attrib_name, int default_value)
+{
+    int result = default_value;
+    const char *session_prefix = "session_";
+    const char *connection_prefix = "connection_";
+
+    critical_block(global_session_mut) {
+        if(str_cmp_i(attrib_name, "session_reconnects") == 0) {
+            if(tag->session) {
+                result = tag->session->reconnect_count;
+            }
+        } else if(str_cmp_i_n(attrib_name, session_prefix, str_length(session_prefix)) == 0) {
+            if(tag->session) {
+                result = rate_limit_get_int_attrib_unsafe(&tag->session->rate_limit, attrib_name + str_length(session_prefix), default_value);
+            }
+        } else if(str_cmp_i_n(attrib_name, connection_prefix, str_length(connection_prefix)) == 0) {
+            if(tag->connection) {
+                result = rate_limit_get_int_attrib_unsafe(&tag->connection->rate_limit, attrib_name + str_length(connection_prefix), default_value);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+
 /*
  * ab_tag_destroy
  *
@@ -494,6 +825,9 @@ int ab_tag_destroy(ab_tag_p tag)
     connection = tag->connection;
     session = tag->session;
 
+    /* the shared file read lives in the session, leave it first. */
+    pccc_file_detach(tag);
+
     /* tags may have a connection.  Release if so. */
     if(connection) {
         pdebug(DEBUG_DETAIL, "Removing tag from connection.");
@@ -526,6 +860,16 @@ int ab_tag_destroy(ab_tag_p tag)
         tag->write_req_sizes = NULL;
     }
 
+    if (tag->bit_or_masks) {
+        mem_free(tag->bit_or_masks);
+        tag->bit_or_masks = NULL;
+    }
+
+    if (tag->bit_and_masks) {
+        mem_free(tag->bit_and_masks);
+        tag->bit_and_masks = NULL;
+    }
+
     if (tag->data) {
         mem_free(tag->data);
         tag->data = NULL;
@@ -611,6 +955,60 @@ int check_tag_name(ab_tag_p tag, const char* name)
 
 
 
+/*
+ * set_tag_size_from_symbol
+ *
+ * Fill in the element size, and the element count if not given, from
+ * the PLC's symbol table and structure templates.  A name that refers
+ * to a whole array gets the whole array.
+ */
+
+int set_tag_size_from_symbol(ab_tag_p tag)
+{
+    ab_symbol_table_p table = NULL;
+    uint16_t type = 0;
+    int elem_count = 0;
+    int elem_size = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(tag->protocol_type != AB_PROTOCOL_LGX) {
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    rc = symbol_get_table(tag, &table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get symbol table! rc=%d", rc);
+        return rc;
+    }
+
+    rc = template_find_tag_type(tag, table, &type, &elem_count);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        rc = template_get_type_size(tag, table, type, &elem_size);
+    }
+
+    symbol_release_table(table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to find the type of the tag! rc=%d", rc);
+        return rc;
+    }
+
+    tag->elem_size = elem_size;
+
+    if(!tag->elem_count) {
+        tag->elem_count = elem_count;
+    }
+
+    pdebug(DEBUG_INFO, "Tag has element size %d and %d elements.", tag->elem_size, elem_count);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
 /*
  * setup_session_mutex
  *
@@ -640,7 +1038,52 @@ int setup_session_mutex(void)
 }
 
 
-static int match_request_and_response(ab_request_p request, eip_cip_co_resp *response)
+/*
+ * match_pccc_response
+ *
+ * A PCCC response carries the transaction number of its request.  The
+ * encapsulation sender context and the connection sequence number change
+ * every time a request is sent, so this also matches a late response to
+ * an earlier send of a request that was sent again.
+ */
+
+static int match_pccc_response(ab_request_p request, eip_cip_co_resp *response, int response_size)
+{
+    uint8_t *data = (uint8_t *)response;
+    uint16_t tns;
+
+    /* the request buffer is going out the socket, do not overwrite it. */
+    if(request->send_in_progress) {
+        return 0;
+    }
+
+    if(request->pccc_tns_offset + (int)sizeof(tns) > response_size) {
+        return 0;
+    }
+
+    if(request->connected_request) {
+        if(response->encap_command != le2h16(AB_EIP_CONNECTED_SEND) || request->conn_id != le2h32(response->cpf_orig_conn_id)) {
+            return 0;
+        }
+    } else {
+        pccc_resp *pccc = (pccc_resp *)response;
+
+        /* extra status words would move the transaction number. */
+        if(pccc->encap_command != le2h16(AB_EIP_READ_RR_DATA) ||
+           pccc->reply_code != (AB_EIP_CMD_PCCC_EXECUTE | AB_EIP_CMD_CIP_OK) ||
+           pccc->status_size != 0) {
+            return 0;
+        }
+    }
+
+    mem_copy(&tns, data + request->pccc_tns_offset, sizeof(tns));
+
+    return (le2h16(tns) == request->pccc_tns);
+}
+
+
+
+static int match_request_and_response(ab_request_p request, eip_cip_co_resp *response, int response_size)
 {
     int connected_response = (response->encap_command == le2h16(AB_EIP_CONNECTED_SEND) ? 1 : 0);
 
@@ -655,6 +1098,9 @@ static int match_request_and_response(ab_request_p request, eip_cip_co_resp *res
     } else if(!connected_response && response->encap_sender_context != (uint64_t)0 && response->encap_sender_context == request->session_seq_id) {
         /* if it is not connected, match the sender context, note that this is sent in host order. */
         return 1;
+    } else if(request->pccc_tns_offset && match_pccc_response(request, response, response_size)) {
+        /* PCCC requests also match on the PCCC transaction number. */
+        return 1;
     }
 
     /* no match */
@@ -765,6 +1211,11 @@ int ok_to_resend(ab_session_p session, ab_request_p request)
         return 0;
     }
 
+    /* nobody will want the response after the deadline. */
+    if(request->deadline && (time_ms() + request->retry_interval) > request->deadline) {
+        return 0;
+    }
+
     pdebug(DEBUG_INFO,"Request waited %lldms, and has %d retries left need to resend.",(time_ms() - request->time_sent), request->num_retries_left);
 
     /* track how many times we've retried. */
@@ -784,7 +1235,7 @@ int process_response_packet_unsafe(ab_session_p session)
         /* need to get the next request now because we might be removing it in receive_response_unsafe */
         ab_request_p next_req = request->next;
 
-        if(match_request_and_response(request, response)) {
+        if(match_request_and_response(request, response, (int)session->recv_offset)) {
             receive_response_unsafe(session, request);
         }
 
@@ -914,33 +1365,154 @@ static int session_send_current_request(ab_session_p session)
 }
 
 
+/*
+ * session_next_request_to_send_unsafe
+ *
+ * Pick the waiting request with the highest priority that has room in
+ * the in-flight window.  Waiting requests age up in priority.  The
+ * reserved part of the window is only for requests that are high
+ * priority in their own right, not through aging.  Ties go to the
+ * earliest request in the queue.
+ *
+ * Requests that would exceed the rate limit of the session or of their
+ * connection are held back.  We remember when that started so that the
+ * wait can be counted when they are finally sent.
+ */
+
+static ab_request_p session_next_request_to_send_unsafe(ab_session_p session, int connected_requests_in_flight, int unconnected_requests_in_flight)
+{
+    ab_request_p request = session->requests;
+    ab_request_p best_request = NULL;
+    int best_priority = -1;
+    int64_t now = time_ms();
+
+    for(; request; request = request->next) {
+        int max_in_flight = 0;
+        int in_flight = 0;
+        int priority = 0;
+        int rate_limited_by = 0;
+
+        if(!request->send_request || request->abort_request) {
+            continue;
+        }
+
+        /* wait for the connection to be opened again after a reconnect. */
+        if(request->connected_request && request->connection && request->connection->reopen_needed) {
+            continue;
+        }
+
+        if(request->connected_request) {
+            /* each connection has its own window. */
+            if(request->connection) {
+                max_in_flight = request->connection->max_reqs_in_flight;
+                in_flight = request->connection->num_reqs_in_flight;
+            } else {
+                max_in_flight = SESSION_MAX_CONNECTED_REQUESTS_IN_FLIGHT;
+                in_flight = connected_requests_in_flight;
+            }
+
+            /* the window is small, so the reserved slots are on top of it. */
+            if(request->priority >= PLCTAG_PRIORITY_HIGH) {
+                max_in_flight += SESSION_RESERVED_CONNECTED_SLOTS;
+            }
+        } else {
+            max_in_flight = SESSION_MAX_UNCONNECTED_REQUESTS_IN_FLIGHT;
+            in_flight = unconnected_requests_in_flight;
+
+            if(request->priority < PLCTAG_PRIORITY_HIGH) {
+                max_in_flight -= SESSION_RESERVED_UNCONNECTED_SLOTS;
+            }
+        }
+
+        if(in_flight >= max_in_flight) {
+            continue;
+        }
+
+        rate_limited_by = 0;
+
+        if(!rate_limit_ok_unsafe(&session->rate_limit, request->request_size, now)) {
+            rate_limited_by |= RATE_LIMIT_SESSION;
+        }
+
+        if(request->connected_request && request->connection && !rate_limit_ok_unsafe(&request->connection->rate_limit, request->request_size, now)) {
+            rate_limited_by |= RATE_LIMIT_CONNECTION;
+        }
+
+        if(rate_limited_by) {
+            if(!request->time_rate_limited) {
+                request->time_rate_limited = now;
+            }
+
+            request->rate_limited_by |= rate_limited_by;
+
+            continue;
+        }
+
+        priority = request->priority + (int)((now - request->time_queued) / SESSION_PRIORITY_AGING_MS);
+
+        if(priority > PLCTAG_PRIORITY_HIGH) {
+            priority = PLCTAG_PRIORITY_HIGH;
+        }
+
+        if(priority > best_priority) {
+            best_request = request;
+            best_priority = priority;
+        }
+    }
+
+    return best_request;
+}
+
+
+
 static int session_check_outgoing_data_unsafe(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
     ab_request_p request = session->requests;
     int connected_requests_in_flight = 0;
     int unconnected_requests_in_flight = 0;
+    int64_t now = time_ms();
+    ab_connection_p connection = NULL;
+
+    for(connection = session->connections; connection; connection = connection->next) {
+        connection->num_reqs_in_flight = 0;
+    }
+
+    /* clean up aborted and expired requests, requeue resends and count what is in flight. */
+    while(request) {
+        /*
+         * drop requests whose deadline has passed unless they are part way
+         * out the socket.  The tag sees the error when it checks status.
+         */
+        if(request->deadline && request->deadline <= now && !request->resp_received && !request->send_in_progress) {
+            ab_request_p old_request = request;
+
+            pdebug(DEBUG_INFO, "Request deadline passed, dropping request.");
+
+            old_request->status = PLCTAG_ERR_TIMEOUT;
+            old_request->send_request = 0;
+            old_request->recv_in_progress = 0;
+
+            request = request->next;
+
+            session_remove_request_unsafe(session,old_request);
+
+            continue;
+        }
 
-    /* loop over the requests and process them one at a time. */
-    while(request && rc == PLCTAG_STATUS_OK) {
         if(request->abort_request) {
             ab_request_p old_request = request;
 
             /* skip to the next one */
             request = request->next;
 
-            //~ rc = handle_abort_request(old_request);
-            rc = session_remove_request_unsafe(session,old_request);
-
-            //request_destroy_unsafe(&old_request);
-            //~ request_release(old_request);
+            session_remove_request_unsafe(session,old_request);
 
             continue;
         }
 
         /* check resending */
         if(ok_to_resend(session, request)) {
-            //~ handle_resend(session, request);
             if(request->connected_request) {
                 pdebug(DEBUG_INFO,"Requeuing connected request.");
             } else {
@@ -953,7 +1525,10 @@ static int session_check_outgoing_data_unsafe(ab_session_p session)
 
         /* count requests in flight */
         if(request->recv_in_progress) {
-            if(request->connected_request) {
+            if(request->connected_request && request->connection) {
+                request->connection->num_reqs_in_flight++;
+                pdebug(DEBUG_SPEW,"%d connected requests in flight on connection %p.", request->connection->num_reqs_in_flight, request->connection);
+            } else if(request->connected_request) {
                 connected_requests_in_flight++;
                 pdebug(DEBUG_SPEW,"%d connected requests in flight.", connected_requests_in_flight);
             } else {
@@ -962,42 +1537,70 @@ static int session_check_outgoing_data_unsafe(ab_session_p session)
             }
         }
 
+        request = request->next;
+    }
 
+    /*
+     * send requests in priority order until the window is full or the
+     * socket will not take any more.
+     */
+    do {
         /* is there a request ready to send and can we send? */
-        if(!session->current_request && request->send_request) {
-            if(request->connected_request) {
-                if(connected_requests_in_flight < SESSION_MAX_CONNECTED_REQUESTS_IN_FLIGHT) {
-                    pdebug(DEBUG_INFO,"Readying connected packet to send.");
+        if(!session->current_request) {
+            request = session_next_request_to_send_unsafe(session, connected_requests_in_flight, unconnected_requests_in_flight);
+
+            if(!request) {
+                break;
+            }
 
-                    /* increment the refcount since we are storing a pointer to the request */
-                    request_acquire(request);
-                    session->current_request = request;
+            pdebug(DEBUG_INFO,"Readying %s packet with priority %d to send.", (request->connected_request ? "connected" : "unconnected"), request->priority);
 
-                    connected_requests_in_flight++;
+            if(!request->keepalive) {
+                session->last_activity = now;
 
-                    pdebug(DEBUG_INFO,"sending packet, so %d connected requests in flight.", connected_requests_in_flight);
+                if(request->connection) {
+                    request->connection->last_activity = now;
                 }
-            } else {
-                if(unconnected_requests_in_flight < SESSION_MAX_UNCONNECTED_REQUESTS_IN_FLIGHT) {
-                    pdebug(DEBUG_INFO,"Readying unconnected packet to send.");
+            }
 
-                    /* increment the refcount since we are storing a pointer to the request */
-                    request_acquire(request);
-                    session->current_request = request;
+            rate_limit_consume_unsafe(&session->rate_limit, request->request_size);
 
-                    unconnected_requests_in_flight++;
+            if(request->connected_request && request->connection) {
+                rate_limit_consume_unsafe(&request->connection->rate_limit, request->request_size);
+            }
+
+            if(request->time_rate_limited) {
+                int64_t wait_ms = time_ms() - request->time_rate_limited;
+
+                pdebug(DEBUG_DETAIL, "Request was held back by rate limiting for %dms.", (int)wait_ms);
 
-                    pdebug(DEBUG_INFO,"sending packet, so %d unconnected requests in flight.", unconnected_requests_in_flight);
+                if(request->rate_limited_by & RATE_LIMIT_SESSION) {
+                    rate_limit_record_wait_unsafe(&session->rate_limit, wait_ms);
                 }
+
+                if((request->rate_limited_by & RATE_LIMIT_CONNECTION) && request->connection) {
+                    rate_limit_record_wait_unsafe(&request->connection->rate_limit, wait_ms);
+                }
+
+                request->time_rate_limited = 0;
+                request->rate_limited_by = 0;
+            }
+
+            /* increment the refcount since we are storing a pointer to the request */
+            request_acquire(request);
+            session->current_request = request;
+
+            if(request->connected_request && request->connection) {
+                request->connection->num_reqs_in_flight++;
+            } else if(request->connected_request) {
+                connected_requests_in_flight++;
+            } else {
+                unconnected_requests_in_flight++;
             }
         }
 
-        /* call this often to make sure we get the data out. */
         rc = session_send_current_request(session);
-
-        /* get the next request to process */
-        request = request->next;
-    }
+    } while(rc == PLCTAG_STATUS_OK && !session->current_request);
 
     return rc;
 }
@@ -1006,11 +1609,13 @@ static int session_check_outgoing_data_unsafe(ab_session_p session)
 static void process_session_tasks_unsafe(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
+    ab_connection_p connection = NULL;
 
     pdebug(DEBUG_SPEW, "Checking for things to do with session %p", session);
 
 
-    if(!session->registered) {
+    /* the reconnect thread owns the socket of a session being reconnected. */
+    if(!session->registered || session->reconnect_pending) {
         return;
     }
 
@@ -1019,16 +1624,132 @@ static void process_session_tasks_unsafe(ab_session_p session)
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN, "Error when checking for incoming session data! %d", rc);
-        /* FIXME - do something useful with this error */
+
+        /* the socket is broken, start over. */
+        if(rc == PLCTAG_ERR_READ) {
+            session_disconnect_unsafe(session, rc);
+            return;
+        }
     }
 
-    /* check for incoming data. */
+    /* open the connections again if the session was reconnected. */
+    for(connection = session->connections; connection; connection = connection->next) {
+        connection_check_reopen_unsafe(connection);
+    }
+
+    /* keep idle sessions and connections alive or close them. */
+    session_check_idle_unsafe(session);
+
+    /* check for outgoing data. */
     rc = session_check_outgoing_data_unsafe(session);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN, "Error when checking for outgoing session data! %d", rc);
-        /* FIXME - do something useful with this error */
+
+        if(rc == PLCTAG_ERR_WRITE) {
+            session_disconnect_unsafe(session, rc);
+        }
+    }
+}
+
+
+
+/*
+ * reconnect_next_session
+ *
+ * Reconnect the first session that is due.  The connect and registration
+ * block, so this runs in the reconnect thread without the session mutex
+ * held.  The IO thread leaves the session alone until reconnect_pending
+ * is cleared.  We hold a reference so that the session cannot go away
+ * underneath us.
+ */
+
+static void reconnect_next_session(void)
+{
+    ab_session_p session = NULL;
+    int64_t now = time_ms();
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(global_session_mut) {
+        for(session = sessions; session; session = session->next) {
+            if(session->reconnect_pending && session->next_reconnect_time <= now) {
+                session_acquire(session);
+                break;
+            }
+        }
+    }
+
+    if(!session) {
+        return;
+    }
+
+    rc = session_reconnect(session);
+
+    critical_block(global_session_mut) {
+        if(rc == PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_INFO, "Session to %s reconnected.", session->host);
+
+            session->reconnect_pending = 0;
+            session->reconnect_attempts++;
+            session->reconnect_time = time_ms();
+            session->last_activity = session->reconnect_time;
+            session->reconnect_count++;
+            session->status = PLCTAG_STATUS_OK;
+
+            /* the PLC may have been downloaded to while we were away. */
+            symbol_drop_tables_unsafe(session);
+        } else {
+            /*
+             * not a short blip, so do not leave callers hanging.  Anything
+             * queued while we wait for the next attempt fails then too.
+             */
+            session_fail_requests_unsafe(session, PLCTAG_ERR_BAD_GATEWAY);
+
+            session->reconnect_attempts++;
+            session->next_reconnect_time = time_ms() + session_reconnect_delay(session->reconnect_attempts);
+        }
+    }
+
+    session_release(session);
+}
+
+
+
+
+/*
+ * reconnect_handler_func
+ *
+ * Bring back sessions that lost their sockets and save newly learned tag
+ * metadata.  This is a thread of its own because connecting to a PLC
+ * that is down and writing cache files can both block for a long time,
+ * which would stall every other session in the IO thread.
+ */
+
+#ifdef _WIN32
+DWORD __stdcall reconnect_handler_func(LPVOID not_used)
+#else
+void* reconnect_handler_func(void* not_used)
+#endif
+{
+    pdebug(DEBUG_DETAIL,"Starting with arg %p",not_used);
+
+    while (!library_terminating) {
+        reconnect_next_session();
+
+        /* save any newly learned tag metadata */
+        meta_cache_flush(0);
+
+        /* reconnects are at least SESSION_RECONNECT_MIN_DELAY_MS apart, no need to spin. */
+        sleep_ms(10);
     }
+
+    thread_stop();
+
+#ifdef _WIN32
+    return (DWORD)0;
+#else
+    return NULL;
+#endif
 }
 
 
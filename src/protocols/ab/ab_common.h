@@ -50,9 +50,17 @@ extern volatile thread_p io_handler_thread;
 
 
 int ab_tag_abort(ab_tag_p tag);
+int allocate_request_slot(ab_tag_p tag);
+int allocate_read_request_slot(ab_tag_p tag);
+int allocate_write_request_slot(ab_tag_p tag);
+int ab_tag_check_request_errors(ab_tag_p tag);
+int ab_tag_get_int_attrib(ab_tag_p tag, const char *attrib_name, int default_value);
+int ab_tag_list(ab_tag_p tag, plc_tag_list_callback_func callback, void *userdata);
+int ab_tag_get_field_info(ab_tag_p tag, const char *field_name, plc_tag_field_info *info);
 int ab_tag_destroy(ab_tag_p p_tag);
 int check_cpu(ab_tag_p tag, attr attribs);
 int check_tag_name(ab_tag_p tag, const char *name);
+int set_tag_size_from_symbol(ab_tag_p tag);
 int check_mutex(int debug);
 
 
@@ -67,4 +75,10 @@ DWORD __stdcall request_handler_func(LPVOID not_used);
 void *request_handler_func(void *not_used);
 #endif
 
+#ifdef _WIN32
+DWORD __stdcall reconnect_handler_func(LPVOID not_used);
+#else
+void *reconnect_handler_func(void *not_used);
+#endif
+
 #endif
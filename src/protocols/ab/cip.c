@@ -553,3 +553,151 @@ int cip_encode_tag_name(ab_tag_p tag,const char *name)
 
     return 1;
 }
+
+
+
+/*
+ * cip_encode_element_path()
+ *
+ * Build the path to the element elem_index elements past the start of
+ * the tag.  If the tag name ends in an array index, that index is moved
+ * along, otherwise an index is added unless it would be zero.  A name
+ * that ends in more than one index can only be used for its own element.
+ *
+ * data must have room for the encoded name plus six bytes.  *size is set
+ * to the size of the result including the word count byte.
+ */
+
+int cip_encode_element_path(ab_tag_p tag, int elem_index, uint8_t *data, int *size)
+{
+    uint8_t *name = tag->encoded_name;
+    int pos = 1;
+    int last_seg = -1;
+    int num_indexes = 0;
+    uint32_t val = 0;
+    uint8_t *dp = NULL;
+
+    /* find the last segment and count the indexes at the end. */
+    while(pos < tag->encoded_name_size) {
+        last_seg = pos;
+
+        switch(name[pos]) {
+            case 0x91: /* ASCII name */
+                pos += 2 + name[pos + 1] + (name[pos + 1] & 0x01);
+                num_indexes = 0;
+                break;
+
+            case 0x20: /* 8-bit class */
+            case 0x24: /* 8-bit instance */
+                pos += 2;
+                num_indexes = 0;
+                break;
+
+            case 0x28: /* 8-bit element */
+                pos += 2;
+                num_indexes++;
+                break;
+
+            case 0x25: /* 16-bit instance */
+                pos += 4;
+                num_indexes = 0;
+                break;
+
+            case 0x29: /* 16-bit element */
+                pos += 4;
+                num_indexes++;
+                break;
+
+            case 0x26: /* 32-bit instance */
+                pos += 6;
+                num_indexes = 0;
+                break;
+
+            case 0x2A: /* 32-bit element */
+                pos += 6;
+                num_indexes++;
+                break;
+
+            default:
+                pdebug(DEBUG_WARN, "Unexpected segment type 0x%x in tag name!", name[pos]);
+                return PLCTAG_ERR_BAD_PARAM;
+        }
+    }
+
+    if(last_seg < 0 || pos != tag->encoded_name_size) {
+        pdebug(DEBUG_WARN, "Encoded tag name is malformed!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* moving the last of several indexes would run off the end of the row. */
+    if(num_indexes > 1 && elem_index != 0) {
+        pdebug(DEBUG_WARN, "Tag name has %d indexes, only its first element can be addressed!", num_indexes);
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    /* keep everything before the index we are changing. */
+    switch(name[last_seg]) {
+        case 0x28:
+            val = name[last_seg + 1];
+            break;
+
+        case 0x29:
+            val = (uint32_t)name[last_seg + 2] | ((uint32_t)name[last_seg + 3] << 8);
+            break;
+
+        case 0x2A:
+            val = (uint32_t)name[last_seg + 2] | ((uint32_t)name[last_seg + 3] << 8)
+                  | ((uint32_t)name[last_seg + 4] << 16) | ((uint32_t)name[last_seg + 5] << 24);
+            break;
+
+        default:
+            /* not an array element, the first element is the tag itself. */
+            if(elem_index == 0) {
+                mem_copy(data, name, tag->encoded_name_size);
+                *size = tag->encoded_name_size;
+                return PLCTAG_STATUS_OK;
+            }
+
+            last_seg = tag->encoded_name_size;
+            break;
+    }
+
+    mem_copy(data, name, last_seg);
+    dp = data + last_seg;
+
+    val += (uint32_t)elem_index;
+
+    if(val > 0xFFFF) {
+        *dp = 0x2A;
+        dp++;
+        *dp = 0;
+        dp++;
+        *dp = val & 0xFF;
+        dp++;
+        *dp = (val >> 8) & 0xFF;
+        dp++;
+        *dp = (val >> 16) & 0xFF;
+        dp++;
+        *dp = (val >> 24) & 0xFF;
+        dp++;
+    } else if(val > 0xFF) {
+        *dp = 0x29;
+        dp++;
+        *dp = 0;
+        dp++;
+        *dp = val & 0xFF;
+        dp++;
+        *dp = (val >> 8) & 0xFF;
+        dp++;
+    } else {
+        *dp = 0x28;
+        dp++;
+        *dp = (uint8_t)val;
+        dp++;
+    }
+
+    *size = (int)(dp - data);
+    data[0] = (uint8_t)((*size - 1) / 2);
+
+    return PLCTAG_STATUS_OK;
+}
@@ -34,6 +34,7 @@
 int cip_encode_path(ab_tag_p tag, const char *path);
 //~ char *cip_decode_status(int status);
 int cip_encode_tag_name(ab_tag_p tag,const char *name);
+int cip_encode_element_path(ab_tag_p tag, int elem_index, uint8_t *data, int *size);
 
 
 
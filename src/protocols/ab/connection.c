@@ -56,6 +56,9 @@ extern "C"
 static ab_connection_p connection_create_unsafe(const char* path, ab_tag_p tag, int shared);
 static int connection_perform_forward_open(ab_connection_p connection);
 static int send_forward_open_req(ab_connection_p connection, ab_request_p req);
+static int build_forward_open_req(ab_connection_p connection, ab_request_p req);
+static int build_forward_close_req(ab_connection_p connection, ab_request_p req);
+static int connection_has_requests_unsafe(ab_connection_p connection);
 static int recv_forward_open_resp(ab_connection_p connection, ab_request_p req);
 //~ static int connection_add_tag_unsafe(ab_connection_p connection, ab_tag_p tag);
 //~ static int connection_add_tag(ab_connection_p connection, ab_tag_p tag);
@@ -84,6 +87,7 @@ int connection_find_or_create(ab_tag_p tag, attr attribs)
     int rc = PLCTAG_STATUS_OK;
     int is_new = 0;
     int shared_connection = attr_get_int(attribs, "share_connection", 1); /* share the session by default. */
+    int pool_size = attr_get_int(attribs, "connection_pool", 1);
 
     pdebug(DEBUG_INFO, "Starting.");
 
@@ -94,7 +98,7 @@ int connection_find_or_create(ab_tag_p tag, attr attribs)
 
     critical_block(global_session_mut) {
         if(shared_connection) {
-            connection = session_find_connection_by_path_unsafe(tag->session, path);
+            connection = session_find_connection_by_path_unsafe(tag->session, path, pool_size);
         } else {
             connection = AB_CONNECTION_NULL;
         }
@@ -104,6 +108,17 @@ int connection_find_or_create(ab_tag_p tag, attr attribs)
             connection = connection_create_unsafe(path, tag, shared_connection);
             is_new = 1;
 
+            /* the first tag to use the connection sets its rate limit and idle handling. */
+            if(connection) {
+                rate_limit_init(&connection->rate_limit,
+                                attr_get_int(attribs, "connection_packet_rate", 0),
+                                attr_get_int(attribs, "connection_byte_rate", 0));
+
+                connection->keepalive_ms = attr_get_int(attribs, "keepalive_ms", 0);
+                connection->idle_timeout_ms = attr_get_int(attribs, "connection_idle_timeout_ms", 0);
+                connection->last_activity = time_ms();
+            }
+
             if(shared_connection) {
                 pdebug(DEBUG_INFO, "Creating new connection.");
             } else {
@@ -158,6 +173,26 @@ int connection_release(ab_connection_p connection)
 }
 
 
+/*
+ * connection_get_new_pccc_tns
+ *
+ * Get the PCCC transaction number for a new request to the PLC at the
+ * end of the connection.  The PLC sends it back in the response, so
+ * several requests can be in flight at once.
+ */
+
+uint16_t connection_get_new_pccc_tns(ab_connection_p connection)
+{
+    uint16_t res = 0;
+
+    critical_block(global_session_mut) {
+        res = ++(connection->pccc_tns);
+    }
+
+    return res;
+}
+
+
 
 
 
@@ -183,7 +218,9 @@ ab_connection_p connection_create_unsafe(const char* path, ab_tag_p tag, int sha
 
     connection->session = tag->session;
     connection->conn_seq_num = 1 /*(uint16_t)(intptr_t)(connection)*/;
+    connection->pccc_tns = (uint16_t)session_get_new_seq_id_unsafe(connection->session); /* random start */
     connection->orig_connection_id = ++(connection->session->conn_serial_number);
+    connection->conn_serial_number = (uint16_t)connection->orig_connection_id; /* unique within the session */
     connection->status = PLCTAG_STATUS_PENDING;
     connection->exclusive = !shared;
 
@@ -218,6 +255,16 @@ ab_connection_p connection_create_unsafe(const char* path, ab_tag_p tag, int sha
             break;
     }
 
+    /*
+     * PCCC requests to DH+ PLCs are told apart by their transaction
+     * numbers, so more of them can be in flight at once.
+     */
+    if(tag->use_dhp_direct) {
+        connection->max_reqs_in_flight = CONNECTION_MAX_IN_FLIGHT;
+    } else {
+        connection->max_reqs_in_flight = SESSION_MAX_CONNECTED_REQUESTS_IN_FLIGHT;
+    }
+
     pdebug(DEBUG_DETAIL,"conn path size = %d", connection->conn_path_size);
 
     for(int j=0; j < connection->conn_path_size; j++) {
@@ -300,10 +347,30 @@ int connection_perform_forward_open(ab_connection_p connection)
 
 
 int send_forward_open_req(ab_connection_p connection, ab_request_p req)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    rc = build_forward_open_req(connection, req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    /* add the request to the session's list. */
+    rc = session_add_request(connection->session, req);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+int build_forward_open_req(ab_connection_p connection, ab_request_p req)
 {
     eip_forward_open_request_t *fo;
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
@@ -344,7 +411,7 @@ int send_forward_open_req(ab_connection_p connection, ab_request_p req)
     fo->orig_to_targ_conn_id = h2le32(0);             /* is this right?  Our connection id on the other machines? */
     fo->targ_to_orig_conn_id = h2le32(connection->orig_connection_id); /* connection id in the other direction. */
     /* this might need to be globally unique */
-    fo->conn_serial_number = h2le16((uint16_t)(intptr_t)(connection)); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(connection->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->conn_timeout_multiplier = AB_EIP_TIMEOUT_MULTIPLIER;     /* timeout = mult * RPI */
@@ -369,12 +436,12 @@ int send_forward_open_req(ab_connection_p connection, ab_request_p req)
     req->connected_request = 1;
     req->no_resend = 1; /* do not resend this, leads to problems.*/
 
-    /* add the request to the session's list. */
-    rc = session_add_request(connection->session, req);
+    /* nothing on the connection can go until this is done. */
+    req->priority = PLCTAG_PRIORITY_HIGH;
 
     pdebug(DEBUG_INFO, "Done");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -427,6 +494,239 @@ int recv_forward_open_resp(ab_connection_p connection, ab_request_p req)
 
 
 
+/*
+ * connection_check_reopen_unsafe
+ *
+ * Called by the IO thread, with the session mutex held, for the
+ * connections of a registered session.  After the session reconnects,
+ * its connections have to be opened again.  This cannot block like
+ * connection_perform_forward_open() because the IO thread is the one
+ * that sends the request, so it steps through the ForwardOpen a little
+ * on each pass.  Failed attempts are retried with back off.
+ */
+
+int connection_check_reopen_unsafe(ab_connection_p connection)
+{
+    ab_request_p req = connection->reopen_request;
+    int64_t now = time_ms();
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!connection->reopen_needed || connection->disconnect_in_progress) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* connections closed for being idle only come back when they are needed. */
+    if(connection->idle_closed) {
+        if(!connection_has_requests_unsafe(connection)) {
+            return PLCTAG_STATUS_OK;
+        }
+
+        pdebug(DEBUG_INFO, "Reopening idle connection.");
+
+        connection->idle_closed = 0;
+    }
+
+    /* is there one in flight? */
+    if(req) {
+        if(req->resp_received) {
+            rc = recv_forward_open_resp(connection, req);
+        } else if(req->status != PLCTAG_STATUS_OK || now > connection->reopen_timeout) {
+            pdebug(DEBUG_WARN, "Timed out waiting for ForwardOpen response!");
+            req->abort_request = 1;
+            rc = PLCTAG_ERR_TIMEOUT_ACK;
+        } else {
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        request_release(req);
+        connection->reopen_request = NULL;
+
+        if(rc == PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_INFO, "Connection reopened.");
+            connection->reopen_needed = 0;
+            connection->reopen_attempts = 0;
+            connection->last_activity = now;
+            return PLCTAG_STATUS_OK;
+        }
+
+        pdebug(DEBUG_WARN, "Unable to reopen connection, rc=%d.", rc);
+
+        connection->status = PLCTAG_STATUS_PENDING;
+        connection->reopen_attempts++;
+        connection->next_reopen_time = now + session_reconnect_delay(connection->reopen_attempts);
+
+        return rc;
+    }
+
+    if(now < connection->next_reopen_time) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    rc = request_create(&req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get new request.  rc=%d", rc);
+        return rc;
+    }
+
+    /*
+     * The PLC may still hold the old connection until it times out, so
+     * use new IDs rather than look like a duplicate.
+     */
+    connection->orig_connection_id = ++(connection->session->conn_serial_number);
+    connection->conn_serial_number = (uint16_t)connection->orig_connection_id;
+    connection->conn_seq_num = 1;
+
+    build_forward_open_req(connection, req);
+
+    rc = session_add_request_unsafe(connection->session, req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        request_release(req);
+        return rc;
+    }
+
+    connection->reopen_request = req;
+    connection->reopen_timeout = now + CONNECTION_SETUP_TIMEOUT;
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+/*
+ * connection_check_idle_unsafe
+ *
+ * Called by the IO thread with the session mutex held.  A connection
+ * that nobody has used for idle_timeout_ms is closed to free the slot in
+ * the PLC.  It is opened again when a request for it shows up.  Otherwise,
+ * if keepalive_ms is set, send a small connected request now and then so
+ * that the PLC does not time the connection out.  The close does not wait
+ * for its reply.  The keep alive stays queued until its reply is matched
+ * and dropped, or until its deadline passes if the reply is lost.
+ */
+
+int connection_check_idle_unsafe(ab_connection_p connection)
+{
+    ab_request_p req = NULL;
+    eip_cip_co_req *cip = NULL;
+    uint8_t *data = NULL;
+    int64_t now = time_ms();
+    int64_t last_traffic = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!connection->is_connected || connection->reopen_needed || connection->disconnect_in_progress) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(connection_has_requests_unsafe(connection)) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(connection->idle_timeout_ms && (now - connection->last_activity) > connection->idle_timeout_ms) {
+        pdebug(DEBUG_INFO, "Connection idle for %dms, closing it.", (int)(now - connection->last_activity));
+
+        rc = request_create(&req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to get new request.  rc=%d", rc);
+            return rc;
+        }
+
+        build_forward_close_req(connection, req);
+
+        req->abort_after_send = 1;
+        req->no_resend = 1;
+        req->keepalive = 1;
+
+        rc = session_add_request_unsafe(connection->session, req);
+
+        request_release(req);
+
+        connection->is_connected = 0;
+        connection->idle_closed = 1;
+        connection->reopen_needed = 1;
+        connection->reopen_attempts = 0;
+        connection->next_reopen_time = 0;
+
+        return rc;
+    }
+
+    if(!connection->keepalive_ms) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    last_traffic = (connection->last_activity > connection->last_keepalive ? connection->last_activity : connection->last_keepalive);
+
+    if(now - last_traffic < connection->keepalive_ms) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = request_create(&req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get new request.  rc=%d", rc);
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Connection idle, sending keep alive.");
+
+    cip = (eip_cip_co_req*)(req->data);
+    data = (req->data) + sizeof(eip_cip_co_req);
+
+    /* Get Attribute Single of the vendor ID of the Identity object, it is small. */
+    *data++ = AB_EIP_CMD_CIP_GET_ATTR_SINGLE;
+    *data++ = 3;    /* path size in 16-bit words */
+    *data++ = 0x20; /* class */
+    *data++ = 0x01; /* Identity */
+    *data++ = 0x24; /* instance */
+    *data++ = 0x01; /* instance 1 */
+    *data++ = 0x30; /* attribute */
+    *data++ = 0x01; /* vendor ID */
+
+    cip->encap_command = h2le16(AB_EIP_CONNECTED_SEND);
+    cip->router_timeout = h2le16(1);
+    cip->cpf_item_count = h2le16(2);
+    cip->cpf_cai_item_type = h2le16(AB_EIP_ITEM_CAI);
+    cip->cpf_cai_item_length = h2le16(4);
+    cip->cpf_cdi_item_type = h2le16(AB_EIP_ITEM_CDI);
+    cip->cpf_cdi_item_length = h2le16(data - (uint8_t*)(&cip->cpf_conn_seq_num));
+
+    req->request_size = data - (req->data);
+    req->connection = connection;
+    req->send_request = 1;
+    req->connected_request = 1;
+    req->no_resend = 1;
+    req->keepalive = 1;
+    req->priority = PLCTAG_PRIORITY_LOW;
+    req->deadline = now + connection->keepalive_ms;
+
+    rc = session_add_request_unsafe(connection->session, req);
+
+    request_release(req);
+
+    connection->last_keepalive = now;
+
+    return rc;
+}
+
+
+
+static int connection_has_requests_unsafe(ab_connection_p connection)
+{
+    ab_request_p req = NULL;
+
+    for(req = connection->session->requests; req; req = req->next) {
+        if(req->connection == connection && !req->keepalive) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
 
 void connection_destroy(void *connection_arg)
 {
@@ -467,12 +767,21 @@ void connection_destroy(void *connection_arg)
         /* make sure the session does not reference the connection */
         session_remove_connection_unsafe(connection->session, connection);
 
+        /* stop any ForwardOpen the IO thread has going. */
+        if(connection->reopen_request) {
+            connection->reopen_request->abort_request = 1;
+            request_release(connection->reopen_request);
+            connection->reopen_request = NULL;
+        }
+
         /* now no one can get a reference to this connection. */
     }
 
     if(really_destroy) {
         /* clean up connection with the PLC, ignore return code, we can't do anything about it. */
-        connection_close(connection);
+        if(connection->is_connected) {
+            connection_close(connection);
+        }
 
         session_release(connection->session);
 
@@ -564,10 +873,30 @@ int connection_close(ab_connection_p connection)
 
 
 int send_forward_close_req(ab_connection_p connection, ab_request_p req)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    rc = build_forward_close_req(connection, req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    /* add the request to the session's list. */
+    rc = session_add_request(connection->session, req);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+int build_forward_close_req(ab_connection_p connection, ab_request_p req)
 {
     eip_forward_close_req_t *fo;
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
@@ -605,7 +934,7 @@ int send_forward_close_req(ab_connection_p connection, ab_request_p req)
     /* Forward Open Params */
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
-    fo->conn_serial_number = h2le16((uint16_t)(intptr_t)(connection)); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(connection->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->path_size = connection->conn_path_size/2; /* size in 16-bit words */
@@ -624,12 +953,12 @@ int send_forward_close_req(ab_connection_p connection, ab_request_p req)
      */
     req->connected_request = 1;
 
-    /* add the request to the session's list. */
-    rc = session_add_request(connection->session, req);
+    /* nothing on the connection can go until this is done. */
+    req->priority = PLCTAG_PRIORITY_HIGH;
 
     pdebug(DEBUG_INFO, "Done");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -55,6 +55,7 @@ struct ab_connection_t {
     uint16_t packet;
     uint16_t conn_serial_number;
     uint16_t conn_seq_num;
+    uint16_t pccc_tns; /* PCCC transaction number, for DH+ PLCs */
 
     /* need to save the connection path for later */
     uint8_t conn_path[MAX_CONN_PATH];
@@ -78,6 +79,27 @@ struct ab_connection_t {
     //int request_in_flight[CONNECTION_MAX_IN_FLIGHT];
     //uint16_t seq_in_flight[CONNECTION_MAX_IN_FLIGHT];
 
+    /* recalculated by the IO thread on each pass. */
+    int num_reqs_in_flight;
+    int max_reqs_in_flight;
+
+    /* ForwardOpen again after the session reconnects */
+    int reopen_needed;
+    int reopen_attempts;
+    int64_t next_reopen_time;
+    int64_t reopen_timeout;
+    ab_request_p reopen_request;
+
+    /* idle tracking, times in milliseconds */
+    int keepalive_ms;
+    int idle_timeout_ms;
+    int idle_closed;
+    int64_t last_activity;
+    int64_t last_keepalive;
+
+    /* limit on the traffic over this connection */
+    struct ab_rate_limit_t rate_limit;
+
     /* maintain a ref count. */
     refcount rc;
 
@@ -91,6 +113,9 @@ extern int connection_find_or_create(ab_tag_p tag, attr attribs);
 //extern int connection_acquire(ab_connection_p connection);
 extern int connection_acquire(ab_connection_p connection);
 extern int connection_release(ab_connection_p connection);
+extern uint16_t connection_get_new_pccc_tns(ab_connection_p connection);
+extern int connection_check_reopen_unsafe(ab_connection_p connection);
+extern int connection_check_idle_unsafe(ab_connection_p connection);
 
 
 
@@ -63,7 +63,7 @@ int send_eip_request_unsafe(ab_request_p req)
             //~ mark_session_for_request(req);
 
             pdebug(DEBUG_INFO,"Sending unconnected packet with session sequence ID %llx",req->session->session_seq_id);
-        } else {
+        } else if(encap->encap_command == h2le16(AB_EIP_CONNECTED_SEND)) {
             eip_cip_co_req *conn_req = (eip_cip_co_req*)(req->data);
 
             /* set up the connection information */
@@ -66,6 +66,7 @@ int recv_eip_response_unsafe(ab_session_p session);
 #define AB_EIP_DEFAULT_TIMEOUT 2000 /* in ms */
 
 /* AB Commands */
+#define AB_EIP_NOP                  ((uint16_t)0x0000)
 #define AB_EIP_REGISTER_SESSION     ((uint16_t)0x0065)
 #define AB_EIP_UNREGISTER_SESSION   ((uint16_t)0x0066)
 #define AB_EIP_READ_RR_DATA         ((uint16_t)0x006F)
@@ -85,12 +86,22 @@ int recv_eip_response_unsafe(ab_session_p session);
 #define AB_EIP_CMD_CIP_WRITE            ((uint8_t)0x4D)
 #define AB_EIP_CMD_CIP_READ_FRAG        ((uint8_t)0x52)
 #define AB_EIP_CMD_CIP_WRITE_FRAG       ((uint8_t)0x53)
+#define AB_EIP_CMD_CIP_GET_ATTR_LIST    ((uint8_t)0x03)
+#define AB_EIP_CMD_CIP_GET_ATTR_SINGLE  ((uint8_t)0x0E)
+#define AB_EIP_CMD_CIP_LIST_ATTRIBS     ((uint8_t)0x55)
+#define AB_EIP_CMD_CIP_RMW              ((uint8_t)0x4E)
 
 /* flag set when command is OK */
 #define AB_EIP_CMD_CIP_OK               ((uint8_t)0x80)
 
 #define AB_CIP_STATUS_OK                ((uint8_t)0x00)
+#define AB_CIP_STATUS_PATH_SEGMENT_ERR  ((uint8_t)0x04)
+#define AB_CIP_STATUS_PATH_UNKNOWN      ((uint8_t)0x05)
 #define AB_CIP_STATUS_FRAG              ((uint8_t)0x06)
+#define AB_CIP_STATUS_EXT_ERR           ((uint8_t)0xFF)
+
+/* extended status for a request with the wrong data type */
+#define AB_CIP_EXT_STATUS_BAD_TYPE      ((uint16_t)0x2107)
 
 /* PCCC commands */
 #define AB_EIP_PCCC_TYPED_CMD ((uint8_t)0x0F)
@@ -44,13 +44,12 @@
 #include <ab/session.h>
 #include <ab/eip_cip.h>
 #include <ab/error_codes.h>
+#include <ab/meta_cache.h>
+#include <ab/symbol.h>
 #include <util/attr.h>
 #include <util/debug.h>
 
 
-int allocate_request_slot(ab_tag_p tag);
-int allocate_read_request_slot(ab_tag_p tag);
-int allocate_write_request_slot(ab_tag_p tag);
 int build_read_request_connected(ab_tag_p tag, int slot, int byte_offset);
 int build_read_request_unconnected(ab_tag_p tag, int slot, int byte_offset);
 int build_write_request_connected(ab_tag_p tag, int slot, int byte_offset);
@@ -60,6 +59,20 @@ static int check_read_status_unconnected(ab_tag_p tag);
 static int check_write_status_connected(ab_tag_p tag);
 static int check_write_status_unconnected(ab_tag_p tag);
 int calculate_write_sizes(ab_tag_p tag);
+static int write_data_per_packet(ab_tag_p tag);
+static int next_dirty_run(ab_tag_p tag, int byte_offset, int max_gap, int *run_start, int *run_end);
+static int start_dirty_write(ab_tag_p tag);
+static int build_service_request(ab_tag_p tag, uint8_t *service, int service_size, ab_request_p *result);
+static int check_service_reply(ab_tag_p tag, ab_request_p req, uint8_t service_code, uint8_t **reply, uint8_t **reply_end);
+static int start_bit_writes(ab_tag_p tag);
+static int check_bit_write_status(ab_tag_p tag);
+static int restart_first_read(ab_tag_p tag);
+static int plan_read_requests(ab_tag_p tag, int frag_size);
+static int check_planned_fragment(ab_tag_p tag, int slot, uint8_t *data, uint8_t **data_end);
+static void finish_planned_read(ab_tag_p tag);
+static void forget_read_plan(ab_tag_p tag);
+static void store_type_info(ab_tag_p tag, uint8_t *type_info, int type_info_size);
+static int is_type_mismatch(uint8_t *status);
 
 /*************************************************************************
  **************************** API Functions ******************************
@@ -77,6 +90,13 @@ int eip_cip_tag_status(ab_tag_p tag)
     int session_rc = PLCTAG_STATUS_OK;
     int connection_rc = PLCTAG_STATUS_OK;
 
+    /* did the IO thread give up on any of our requests? */
+    rc = ab_tag_check_request_errors(tag);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
     if (tag->read_in_progress) {
         if(tag->connection) {
             rc = check_read_status_connected(tag);
@@ -84,16 +104,33 @@ int eip_cip_tag_status(ab_tag_p tag)
             rc = check_read_status_unconnected(tag);
         }
 
+        /* the PLC did not send what the plan expected. */
+        if(tag->read_plan != READ_PLAN_NONE && (rc == PLCTAG_ERR_READ || rc == PLCTAG_ERR_TOO_LONG || rc == PLCTAG_ERR_NO_DATA)) {
+            rc = restart_first_read(tag);
+        }
+
+        /* send any bit changes that were held back by the read. */
+        if(rc == PLCTAG_STATUS_OK && tag->bit_writes_pending) {
+            rc = start_bit_writes(tag);
+        }
+
         return rc;
     }
 
     if (tag->write_in_progress) {
-        if(tag->connection) {
+        if(tag->bit_write_in_progress) {
+            rc = check_bit_write_status(tag);
+        } else if(tag->connection) {
             rc = check_write_status_connected(tag);
         } else {
             rc = check_write_status_unconnected(tag);
         }
 
+        /* send any bit changes that were held back by the write. */
+        if(rc == PLCTAG_STATUS_OK && tag->bit_writes_pending) {
+            rc = start_bit_writes(tag);
+        }
+
         return rc;
     }
 
@@ -173,6 +210,9 @@ int eip_cip_tag_read_start(ab_tag_p tag)
 
     pdebug(DEBUG_INFO, "Starting");
 
+    /* look the instance up again if the symbols moved. */
+    symbol_check_tag_instance(tag);
+
     /* is this the first read? */
     if (tag->first_read) {
         /*
@@ -247,6 +287,290 @@ int eip_cip_tag_read_start(ab_tag_p tag)
     return PLCTAG_STATUS_PENDING;
 }
 
+/*
+ * eip_cip_tag_plan_read
+ *
+ * The tag size is known when the tag is created, so rather than stepping
+ * through the tag one fragment at a time on the first read, guess how
+ * much data the PLC will fit in each reply and send all the requests at
+ * once.  The guess is on the small side.  If the PLC sends more, the
+ * overlap is dropped and the plan is fixed up after the read.  If it
+ * sends less, we fall back to stepping through the tag.
+ */
+
+int eip_cip_tag_plan_read(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int payload;
+    int frag_size;
+
+    if(tag->connection) {
+        payload = tag->connection->conn_params & 0x1FF;
+    } else {
+        payload = AB_EIP_LGX_PARAM & 0x1FF;
+    }
+
+    /* leave room for the sequence number, reply header and type info. */
+    frag_size = payload - 2 - 4 - 8;
+
+    /* keep the fragments 8-byte aligned. */
+    frag_size -= frag_size % 8;
+
+    if(frag_size <= 0 || tag->size <= frag_size) {
+        /* a single request, nothing to pipeline. */
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = plan_read_requests(tag, frag_size);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to plan read requests!");
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Planned %d read requests of up to %d bytes.", tag->num_read_requests, frag_size);
+
+    tag->read_plan = READ_PLAN_GUESSED;
+    tag->first_read = 0;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * eip_cip_tag_set_read_plan
+ *
+ * Set up the read requests and type information from what an earlier
+ * run learned, so that the first read is pipelined and a write does
+ * not need to read first.  The sizes must add up to the tag size.
+ */
+
+int eip_cip_tag_set_read_plan(ab_tag_p tag, int *read_req_sizes, int num_read_requests, uint8_t *type_info, int type_info_size)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int total = 0;
+    int i;
+
+    for(i=0; i < num_read_requests; i++) {
+        total += read_req_sizes[i];
+    }
+
+    if(total != tag->size || type_info_size > MAX_TAG_TYPE_INFO) {
+        pdebug(DEBUG_WARN, "Read plan does not match the tag!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag->num_read_requests = 0;
+
+    for(i=0; i < num_read_requests; i++) {
+        rc = allocate_read_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            tag->num_read_requests = 0;
+            return rc;
+        }
+
+        tag->read_req_sizes[i] = read_req_sizes[i];
+    }
+
+    mem_copy(tag->encoded_type_info, type_info, type_info_size);
+    tag->encoded_type_info_size = type_info_size;
+
+    tag->first_read = 0;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * restart_first_read
+ *
+ * The read plan was cached or guessed from the tag size and does not
+ * match the PLC, perhaps the program changed or the PLC sends smaller
+ * fragments than we thought.  Throw it away and learn it again.
+ */
+
+int restart_first_read(ab_tag_p tag)
+{
+    pdebug(DEBUG_WARN, "Read plan does not match the PLC, reading the tag from scratch.");
+
+    ab_tag_abort(tag);
+
+    forget_read_plan(tag);
+
+    return eip_cip_tag_read_start(tag);
+}
+
+
+
+/*
+ * forget_read_plan
+ *
+ * Drop the read plan and type so that the next read or write learns
+ * them from the PLC again.  The requests must already be aborted.
+ */
+
+void forget_read_plan(ab_tag_p tag)
+{
+    tag->read_plan = READ_PLAN_NONE;
+    tag->read_frag_size = 0;
+    tag->first_read = 1;
+    tag->num_read_requests = 0;
+    tag->num_write_requests = 0;
+    tag->encoded_type_info_size = 0;
+    tag->type_info_changed = 0;
+}
+
+
+
+/*
+ * store_type_info
+ *
+ * Every read reply carries the type of the tag.  Keep the latest one,
+ * the type the tag was created or cached with may be out of date if the
+ * PLC program changed.  A change is saved to the metadata cache when
+ * the read finishes.
+ */
+
+void store_type_info(ab_tag_p tag, uint8_t *type_info, int type_info_size)
+{
+    if (tag->encoded_type_info_size == type_info_size && mem_cmp(tag->encoded_type_info, type_info, type_info_size) == 0) {
+        return;
+    }
+
+    if (tag->encoded_type_info_size) {
+        pdebug(DEBUG_INFO, "Tag type changed in the PLC.");
+    }
+
+    mem_copy(tag->encoded_type_info, type_info, type_info_size);
+    tag->encoded_type_info_size = type_info_size;
+    tag->type_info_changed = 1;
+}
+
+
+
+/*
+ * is_type_mismatch
+ *
+ * Check the CIP status of a write reply for the extended status the PLC
+ * sends when the data type in the request is wrong.
+ */
+
+int is_type_mismatch(uint8_t *status)
+{
+    if (status[0] != AB_CIP_STATUS_EXT_ERR || status[1] < 1) {
+        return 0;
+    }
+
+    return (((uint16_t)status[2] + ((uint16_t)status[3] << 8)) == AB_CIP_EXT_STATUS_BAD_TYPE);
+}
+
+
+
+/*
+ * plan_read_requests
+ *
+ * Split the tag into read requests of frag_size bytes, the last one
+ * taking what is left.
+ */
+
+int plan_read_requests(ab_tag_p tag, int frag_size)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int byte_offset = 0;
+    int i = 0;
+
+    tag->num_read_requests = 0;
+
+    while(byte_offset < tag->size) {
+        rc = allocate_read_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            tag->num_read_requests = 0;
+            return rc;
+        }
+
+        if((tag->size - byte_offset) > frag_size) {
+            tag->read_req_sizes[i] = frag_size;
+        } else {
+            tag->read_req_sizes[i] = tag->size - byte_offset;
+        }
+
+        byte_offset += tag->read_req_sizes[i];
+        i++;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_planned_fragment
+ *
+ * Each request of a planned read asked for data at a fixed offset.  The
+ * PLC fills the reply as far as it can, so a reply bigger than planned
+ * just repeats the start of the next fragment and is cut short.  A reply
+ * smaller than planned leaves a hole and the plan is wrong.
+ */
+
+int check_planned_fragment(ab_tag_p tag, int slot, uint8_t *data, uint8_t **data_end)
+{
+    int got = (int)(*data_end - data);
+
+    if(got < tag->read_req_sizes[slot]) {
+        pdebug(DEBUG_DETAIL, "Request %d got %d bytes but the plan expected %d.", slot, got, tag->read_req_sizes[slot]);
+        return PLCTAG_ERR_READ;
+    }
+
+    if(got > tag->read_req_sizes[slot]) {
+        if(got > tag->read_frag_size) {
+            tag->read_frag_size = got;
+        }
+
+        *data_end = data + tag->read_req_sizes[slot];
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * finish_planned_read
+ *
+ * A planned read worked.  If the PLC had room for bigger fragments,
+ * replan with what it actually sent so later reads take fewer requests.
+ */
+
+void finish_planned_read(ab_tag_p tag)
+{
+    int plan = tag->read_plan;
+
+    tag->read_plan = READ_PLAN_KNOWN;
+
+    if(tag->read_frag_size) {
+        pdebug(DEBUG_DETAIL, "PLC sent fragments of up to %d bytes, replanning.", tag->read_frag_size);
+
+        if(plan_read_requests(tag, tag->read_frag_size) != PLCTAG_STATUS_OK) {
+            /* step through the tag on the next read instead. */
+            tag->read_plan = READ_PLAN_NONE;
+            tag->first_read = 1;
+        }
+
+        tag->read_frag_size = 0;
+    } else if(plan != READ_PLAN_GUESSED) {
+        return;
+    }
+
+    /* remember what we learned for the next restart. */
+    meta_cache_update(tag);
+}
+
+
+
 /*
  * eip_cip_tag_write_start
  *
@@ -264,6 +588,15 @@ int eip_cip_tag_write_start(ab_tag_p tag)
 
     pdebug(DEBUG_INFO, "Starting");
 
+    /* look the instance up again if the symbols moved. */
+    symbol_check_tag_instance(tag);
+
+    /* a streaming tag without a buffer has nothing to write. */
+    if (!tag->data) {
+        pdebug(DEBUG_WARN, "Tag has no data buffer to write!");
+        return PLCTAG_ERR_NO_DATA;
+    }
+
     /*
      * if the tag has not been read yet, read it.
      *
@@ -271,7 +604,7 @@ int eip_cip_tag_write_start(ab_tag_p tag)
      * buffers.
      */
 
-    if (tag->first_read) {
+    if (tag->first_read || !tag->encoded_type_info_size) {
         pdebug(DEBUG_DETAIL, "No read has completed yet, doing pre-read to get type information.");
 
         tag->pre_write_read = 1;
@@ -279,6 +612,19 @@ int eip_cip_tag_write_start(ab_tag_p tag)
         return eip_cip_tag_read_start(tag);
     }
 
+    /* the last write may have set up requests for only part of the tag. */
+    if (tag->write_partial) {
+        tag->write_partial = 0;
+        tag->num_write_requests = 0;
+    }
+
+    /* if the setters only changed part of the tag, just send that part. */
+    rc = start_dirty_write(tag);
+
+    if (rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
     /*
      * calculate the number and size of the write requests
      * if we have not already done so.
@@ -319,108 +665,86 @@ int eip_cip_tag_write_start(ab_tag_p tag)
 }
 
 /*
- * allocate_request_slot
+ * eip_cip_tag_write_bit
  *
- * Increase the number of available request slots.
+ * Record a bit change as OR and AND masks for the element holding the
+ * bit.  If the tag is idle, the changes go out right away as CIP
+ * Read-Modify-Write requests.  Otherwise they wait for the current
+ * operation to finish, so several changes to one element share a
+ * request.
  */
-int allocate_request_slot(ab_tag_p tag)
+
+int eip_cip_tag_write_bit(ab_tag_p tag, int offset_bit, int val)
 {
-    int* old_sizes;
-    ab_request_p* old_reqs;
+    int elem_bits = tag->elem_size * 8;
+    int elem;
+    uint64_t mask;
     int i;
-    int old_max = tag->max_requests;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    /* bump up the number of allowed requests */
-    tag->max_requests += DEFAULT_MAX_REQUESTS;
 
-    pdebug(DEBUG_DETAIL, "setting max_requests = %d", tag->max_requests);
-
-    /* (re)allocate the read size array */
-    old_sizes = tag->read_req_sizes;
-    tag->read_req_sizes = (int*)mem_alloc(tag->max_requests * sizeof(int));
+    pdebug(DEBUG_INFO, "Starting.");
 
-    if (!tag->read_req_sizes) {
-        mem_free(old_sizes);
-        pdebug(DEBUG_WARN,"Unable to allocate read sizes array!");
-        return PLCTAG_ERR_NO_MEM;
+    /* the masks must be the size of an atomic type. */
+    if(tag->elem_size != 1 && tag->elem_size != 2 && tag->elem_size != 4 && tag->elem_size != 8) {
+        pdebug(DEBUG_WARN, "Bit writes need an element size of 1, 2, 4 or 8 bytes, not %d!", tag->elem_size);
+        return PLCTAG_ERR_UNSUPPORTED;
     }
 
-    /* copy the size data */
-    if (old_sizes) {
-        for (i = 0; i < old_max; i++) {
-            tag->read_req_sizes[i] = old_sizes[i];
-        }
+    if(!tag->bit_or_masks) {
+        /* elements past the first are addressed with one index. */
+        if(tag->elem_count > 1 && tag->protocol_type == AB_PROTOCOL_LGX) {
+            int num_dims = 0;
+            int rc = symbol_get_tag_dims(tag, &num_dims);
 
-        mem_free(old_sizes);
-    }
+            if(rc != PLCTAG_STATUS_OK) {
+                return rc;
+            }
 
-    /* (re)allocate the write size array */
-    old_sizes = tag->write_req_sizes;
-    tag->write_req_sizes = (int*)mem_alloc(tag->max_requests * sizeof(int));
+            if(num_dims > 1) {
+                pdebug(DEBUG_WARN, "Bit writes to arrays with %d dimensions are not supported!", num_dims);
+                return PLCTAG_ERR_UNSUPPORTED;
+            }
+        }
 
-    if (!tag->write_req_sizes) {
-        mem_free(old_sizes);
-        pdebug(DEBUG_WARN,"Unable to allocate write sizes array!");
-        return PLCTAG_ERR_NO_MEM;
-    }
+        tag->bit_or_masks = (uint64_t*)mem_alloc(tag->elem_count * (int)sizeof(uint64_t));
+        tag->bit_and_masks = (uint64_t*)mem_alloc(tag->elem_count * (int)sizeof(uint64_t));
 
-    /* copy the size data */
-    if (old_sizes) {
-        for (i = 0; i < old_max; i++) {
-            tag->write_req_sizes[i] = old_sizes[i];
+        if(!tag->bit_or_masks || !tag->bit_and_masks) {
+            pdebug(DEBUG_ERROR, "Unable to allocate bit write masks!");
+            return PLCTAG_ERR_NO_MEM;
         }
 
-        mem_free(old_sizes);
+        for(i=0; i < tag->elem_count; i++) {
+            tag->bit_and_masks[i] = ~(uint64_t)0;
+        }
     }
 
-    /* do the same for the request array */
-    old_reqs = tag->reqs;
-    tag->reqs = (ab_request_p*)mem_alloc(tag->max_requests * sizeof(ab_request_p));
+    elem = offset_bit / elem_bits;
+    mask = (uint64_t)1 << (offset_bit % elem_bits);
 
-    if (!tag->reqs) {
-        pdebug(DEBUG_WARN,"Unable to allocate requests array!");
-        return PLCTAG_ERR_NO_MEM;
+    if(elem >= tag->elem_count) {
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
     }
 
-    /* copy the request data, there shouldn't be anything here I think... */
-    if (old_reqs) {
-        for (i = 0; i < old_max; i++) {
-            tag->reqs[i] = old_reqs[i];
-        }
-
-        mem_free(old_reqs);
+    if(val) {
+        tag->bit_or_masks[elem] |= mask;
+        tag->bit_and_masks[elem] |= mask;
+    } else {
+        tag->bit_or_masks[elem] &= ~mask;
+        tag->bit_and_masks[elem] &= ~mask;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
-
-    return PLCTAG_STATUS_OK;
-}
-
-int allocate_read_request_slot(ab_tag_p tag)
-{
-    /* increase the number of available request slots */
-    tag->num_read_requests++;
+    tag->bit_writes_pending = 1;
 
-    if (tag->num_read_requests > tag->max_requests) {
-        return allocate_request_slot(tag);
+    if(tag->read_in_progress || tag->write_in_progress) {
+        pdebug(DEBUG_DETAIL, "Tag is busy, bit write will go out when it is done.");
+        return PLCTAG_STATUS_PENDING;
     }
 
-    return PLCTAG_STATUS_OK;
+    return start_bit_writes(tag);
 }
 
-int allocate_write_request_slot(ab_tag_p tag)
-{
-    /* increase the number of available request slots */
-    tag->num_write_requests++;
 
-    if (tag->num_write_requests > tag->max_requests) {
-        return allocate_request_slot(tag);
-    }
 
-    return PLCTAG_STATUS_OK;
-}
 
 int build_read_request_connected(ab_tag_p tag, int slot, int byte_offset)
 {
@@ -502,6 +826,10 @@ int build_read_request_connected(ab_tag_p tag, int slot, int byte_offset)
     /* this request is connected, so it needs the session exclusively */
     req->connected_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -632,6 +960,10 @@ int build_read_request_unconnected(ab_tag_p tag, int slot, int byte_offset)
     /* mark it as ready to send */
     req->send_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -696,7 +1028,7 @@ int build_write_request_connected(ab_tag_p tag, int slot, int byte_offset)
      * This handles a bug where attempting fragmented requests
      * does not appear to work with a single boolean.
      */
-    *data = (tag->num_write_requests > 1) ? AB_EIP_CMD_CIP_WRITE_FRAG : AB_EIP_CMD_CIP_WRITE;
+    *data = (tag->num_write_requests > 1 || tag->write_partial) ? AB_EIP_CMD_CIP_WRITE_FRAG : AB_EIP_CMD_CIP_WRITE;
     data++;
 
     /* copy the tag name into the request */
@@ -716,7 +1048,7 @@ int build_write_request_connected(ab_tag_p tag, int slot, int byte_offset)
     *((uint16_t*)data) = h2le16(tag->elem_count);
     data += 2;
 
-    if (tag->num_write_requests > 1) {
+    if (tag->num_write_requests > 1 || tag->write_partial) {
         /* put in the byte offset */
         *((uint32_t*)data) = h2le32(byte_offset);
         data += 4;
@@ -759,6 +1091,10 @@ int build_write_request_connected(ab_tag_p tag, int slot, int byte_offset)
     /* mark the request as a connected request */
     req->connected_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -825,7 +1161,7 @@ int build_write_request_unconnected(ab_tag_p tag, int slot, int byte_offset)
      * This handles a bug where attempting fragmented requests
      * does not appear to work with a single boolean.
      */
-    *data = (tag->num_write_requests > 1) ? AB_EIP_CMD_CIP_WRITE_FRAG : AB_EIP_CMD_CIP_WRITE;
+    *data = (tag->num_write_requests > 1 || tag->write_partial) ? AB_EIP_CMD_CIP_WRITE_FRAG : AB_EIP_CMD_CIP_WRITE;
     data++;
 
     /* copy the tag name into the request */
@@ -845,7 +1181,7 @@ int build_write_request_unconnected(ab_tag_p tag, int slot, int byte_offset)
     *((uint16_t*)data) = h2le16(tag->elem_count);
     data += 2;
 
-    if (tag->num_write_requests > 1) {
+    if (tag->num_write_requests > 1 || tag->write_partial) {
         /* put in the byte offset */
         *((uint32_t*)data) = h2le32(byte_offset);
         data += 4;
@@ -913,6 +1249,10 @@ int build_write_request_unconnected(ab_tag_p tag, int slot, int byte_offset)
     /* mark it as ready to send */
     req->send_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -962,16 +1302,10 @@ static int check_read_status_connected(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    for (i = 0; i < tag->num_read_requests; i++) {
-        if (tag->reqs[i] && !tag->reqs[i]->resp_received) {
-            return PLCTAG_STATUS_PENDING;
-        }
-    }
-
     /*
-     * process each request.  If there is more than one request, then
-     * we need to make sure that we copy the data into the right part
-     * of the tag's data buffer.
+     * process each request in order as its response comes in.  If there
+     * is more than one request, then we need to make sure that we copy
+     * the data into the right part of the tag's data buffer.
      */
     for (i = 0; i < tag->num_read_requests; i++) {
         req = tag->reqs[i];
@@ -987,6 +1321,11 @@ static int check_read_status_connected(ab_tag_p tag)
             continue;
         }
 
+        /* the data must be handed over in order. */
+        if (!req->resp_received) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
         req->processed = 1;
 
         pdebug(DEBUG_DETAIL, "processing request %d", i);
@@ -1032,9 +1371,14 @@ static int check_read_status_connected(ab_tag_p tag)
             pdebug(DEBUG_INFO, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_LONG));
 
             switch (cip_resp->status) {
-                case 0x04: /* FIXME - should be defined constants */
-                case 0x05:
-                case 0x13:
+                case AB_CIP_STATUS_PATH_SEGMENT_ERR:
+                case AB_CIP_STATUS_PATH_UNKNOWN:
+                    /* the symbols may have moved under a tag addressed by instance. */
+                    symbol_instance_error(tag);
+                    rc = PLCTAG_ERR_BAD_PARAM;
+                    break;
+
+                case 0x13: /* FIXME - should be defined constants */
                 case 0x1C:
                     rc = PLCTAG_ERR_BAD_PARAM;
                     break;
@@ -1069,10 +1413,7 @@ static int check_read_status_connected(ab_tag_p tag)
         /* check for a simple/base type */
         if ((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = 2;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            store_type_info(tag, data, 2);
 
             /* skip the type byte and zero length byte */
             data += 2;
@@ -1094,10 +1435,7 @@ static int check_read_status_connected(ab_tag_p tag)
             }
 
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = type_length;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            store_type_info(tag, data, type_length);
 
             data += type_length;
         } else {
@@ -1106,6 +1444,15 @@ static int check_read_status_connected(ab_tag_p tag)
             break;
         }
 
+        /* a planned read gets checked against the plan. */
+        if (tag->read_plan != READ_PLAN_NONE) {
+            rc = check_planned_fragment(tag, i, data, &data_end);
+
+            if (rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
+
         /* copy data into the tag. */
         if ((byte_offset + (data_end - data)) > tag->size) {
             pdebug(DEBUG_WARN,
@@ -1125,7 +1472,7 @@ static int check_read_status_connected(ab_tag_p tag)
          * put into the tag's data buffer.
          */
         if (!tag->pre_write_read) {
-            mem_copy(tag->data + byte_offset, data, (data_end - data));
+            tag_store_read_data((plc_tag_p)tag, byte_offset, data, (int)(data_end - data));
         }
 
         /* save the size of the response for next time */
@@ -1163,6 +1510,13 @@ static int check_read_status_connected(ab_tag_p tag)
             }
         } else {
             /* done! */
+            if (tag->first_read || tag->type_info_changed) {
+                /* remember what we learned for the next restart. */
+                meta_cache_update(tag);
+            }
+
+            tag->type_info_changed = 0;
+
             tag->first_read = 0;
 
             tag->read_in_progress = 0;
@@ -1170,6 +1524,10 @@ static int check_read_status_connected(ab_tag_p tag)
             /* have the IO thread take care of the request buffers */
             ab_tag_abort(tag);
 
+            if (tag->read_plan != READ_PLAN_NONE) {
+                finish_planned_read(tag);
+            }
+
             /* if this is a pre-read for a write, then pass off the the write routine */
             if (tag->pre_write_read) {
                 pdebug(DEBUG_DETAIL, "Restarting write call now.");
@@ -1214,16 +1572,10 @@ static int check_read_status_unconnected(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    for (i = 0; i < tag->num_read_requests; i++) {
-        if (tag->reqs[i] && !tag->reqs[i]->resp_received) {
-            return PLCTAG_STATUS_PENDING;
-        }
-    }
-
     /*
-     * process each request.  If there is more than one request, then
-     * we need to make sure that we copy the data into the right part
-     * of the tag's data buffer.
+     * process each request in order as its response comes in.  If there
+     * is more than one request, then we need to make sure that we copy
+     * the data into the right part of the tag's data buffer.
      */
     for (i = 0; i < tag->num_read_requests; i++) {
         req = tag->reqs[i];
@@ -1239,6 +1591,11 @@ static int check_read_status_unconnected(ab_tag_p tag)
             continue;
         }
 
+        /* the data must be handed over in order. */
+        if (!req->resp_received) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
         req->processed = 1;
 
         pdebug(DEBUG_INFO, "processing request %d", i);
@@ -1284,14 +1641,19 @@ static int check_read_status_unconnected(ab_tag_p tag)
             pdebug(DEBUG_INFO, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_LONG));
 
             switch (cip_resp->status) {
-                case 0x04: /* FIXME - should be defined constants */
-                case 0x05:
-                case 0x13:
-                case 0x1C:
+                case AB_CIP_STATUS_PATH_SEGMENT_ERR:
+                case AB_CIP_STATUS_PATH_UNKNOWN:
+                    /* the symbols may have moved under a tag addressed by instance. */
+                    symbol_instance_error(tag);
                     rc = PLCTAG_ERR_BAD_PARAM;
                     break;
 
-                default:
+                case 0x13: /* FIXME - should be defined constants */
+                case 0x1C:
+                    rc = PLCTAG_ERR_BAD_PARAM;
+                    break;
+
+                default:
                     rc = PLCTAG_ERR_REMOTE_ERR;
                     break;
             }
@@ -1321,10 +1683,7 @@ static int check_read_status_unconnected(ab_tag_p tag)
         /* check for a simple/base type */
         if ((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = 2;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            store_type_info(tag, data, 2);
 
             /* skip the type byte and zero length byte */
             data += 2;
@@ -1346,10 +1705,7 @@ static int check_read_status_unconnected(ab_tag_p tag)
             }
 
             /* copy the type info for later. */
-            if (tag->encoded_type_info_size == 0) {
-                tag->encoded_type_info_size = type_length;
-                mem_copy(tag->encoded_type_info, data, tag->encoded_type_info_size);
-            }
+            store_type_info(tag, data, type_length);
 
             data += type_length;
         } else {
@@ -1358,6 +1714,15 @@ static int check_read_status_unconnected(ab_tag_p tag)
             break;
         }
 
+        /* a planned read gets checked against the plan. */
+        if (tag->read_plan != READ_PLAN_NONE) {
+            rc = check_planned_fragment(tag, i, data, &data_end);
+
+            if (rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
+
         /* copy data into the tag. */
         if ((byte_offset + (data_end - data)) > tag->size) {
             pdebug(DEBUG_WARN,
@@ -1378,7 +1743,7 @@ static int check_read_status_unconnected(ab_tag_p tag)
          * put into the tag's data buffer.
          */
         if (!tag->pre_write_read) {
-            mem_copy(tag->data + byte_offset, data, (data_end - data));
+            tag_store_read_data((plc_tag_p)tag, byte_offset, data, (int)(data_end - data));
         }
 
         /* save the size of the response for next time */
@@ -1416,6 +1781,13 @@ static int check_read_status_unconnected(ab_tag_p tag)
             }
         } else {
             /* done! */
+            if (tag->first_read || tag->type_info_changed) {
+                /* remember what we learned for the next restart. */
+                meta_cache_update(tag);
+            }
+
+            tag->type_info_changed = 0;
+
             tag->first_read = 0;
 
             tag->read_in_progress = 0;
@@ -1423,6 +1795,10 @@ static int check_read_status_unconnected(ab_tag_p tag)
             /* have the IO thread take care of the request buffers */
             ab_tag_abort(tag);
 
+            if (tag->read_plan != READ_PLAN_NONE) {
+                finish_planned_read(tag);
+            }
+
             /* if this is a pre-read for a write, then pass off the the write routine */
             if (tag->pre_write_read) {
                 pdebug(DEBUG_INFO, "Restarting write call now.");
@@ -1454,6 +1830,7 @@ static int check_write_status_connected(ab_tag_p tag)
 {
     eip_cip_co_resp* cip_resp;
     int rc = PLCTAG_STATUS_OK;
+    int type_mismatch = 0;
     int i;
     ab_request_p req;
 
@@ -1508,7 +1885,7 @@ static int check_write_status_connected(ab_tag_p tag)
         }
 
         /* if we have fragmented the request, we need to look for a different return code */
-        reply_service = ((tag->num_write_requests > 1) ? (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK) :
+        reply_service = ((tag->num_write_requests > 1 || tag->write_partial) ? (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK) :
                          (AB_EIP_CMD_CIP_WRITE | AB_EIP_CMD_CIP_OK));
 
         if (cip_resp->reply_service != reply_service) {
@@ -1520,6 +1897,13 @@ static int check_write_status_connected(ab_tag_p tag)
         if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
             pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_SHORT));
             pdebug(DEBUG_INFO, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_LONG));
+            type_mismatch = is_type_mismatch((uint8_t *)&cip_resp->status);
+
+            /* the symbols may have moved under a tag addressed by instance. */
+            if (cip_resp->status == AB_CIP_STATUS_PATH_SEGMENT_ERR || cip_resp->status == AB_CIP_STATUS_PATH_UNKNOWN) {
+                symbol_instance_error(tag);
+            }
+
             rc = PLCTAG_ERR_REMOTE_ERR;
             break;
         }
@@ -1530,6 +1914,12 @@ static int check_write_status_connected(ab_tag_p tag)
 
     tag->write_in_progress = 0;
 
+    /* the cached type is wrong, get it from the PLC before the next write. */
+    if (type_mismatch) {
+        pdebug(DEBUG_WARN, "Write used the wrong data type, dropping the cached type and read plan.");
+        forget_read_plan(tag);
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
@@ -1540,6 +1930,7 @@ int check_write_status_unconnected(ab_tag_p tag)
 {
     eip_cip_uc_resp* cip_resp;
     int rc = PLCTAG_STATUS_OK;
+    int type_mismatch = 0;
     int i;
     ab_request_p req;
 
@@ -1589,7 +1980,7 @@ int check_write_status_unconnected(ab_tag_p tag)
         }
 
         /* if we have fragmented the request, we need to look for a different return code */
-        reply_service = ((tag->num_write_requests > 1) ? (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK) :
+        reply_service = ((tag->num_write_requests > 1 || tag->write_partial) ? (AB_EIP_CMD_CIP_WRITE_FRAG | AB_EIP_CMD_CIP_OK) :
                          (AB_EIP_CMD_CIP_WRITE | AB_EIP_CMD_CIP_OK));
 
         if (cip_resp->reply_service != reply_service) {
@@ -1601,6 +1992,13 @@ int check_write_status_unconnected(ab_tag_p tag)
         if (cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
             pdebug(DEBUG_WARN, "CIP read failed with status: 0x%x %s", cip_resp->status, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_SHORT));
             pdebug(DEBUG_INFO, decode_cip_error((uint8_t *)&cip_resp->status, AB_ERROR_STR_LONG));
+            type_mismatch = is_type_mismatch((uint8_t *)&cip_resp->status);
+
+            /* the symbols may have moved under a tag addressed by instance. */
+            if (cip_resp->status == AB_CIP_STATUS_PATH_SEGMENT_ERR || cip_resp->status == AB_CIP_STATUS_PATH_UNKNOWN) {
+                symbol_instance_error(tag);
+            }
+
             rc = PLCTAG_ERR_REMOTE_ERR;
             break;
         }
@@ -1611,6 +2009,12 @@ int check_write_status_unconnected(ab_tag_p tag)
 
     tag->write_in_progress = 0;
 
+    /* the cached type is wrong, get it from the PLC before the next write. */
+    if (type_mismatch) {
+        pdebug(DEBUG_WARN, "Write used the wrong data type, dropping the cached type and read plan.");
+        forget_read_plan(tag);
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
@@ -1620,7 +2024,6 @@ int check_write_status_unconnected(ab_tag_p tag)
 
 int calculate_write_sizes(ab_tag_p tag)
 {
-    int overhead;
     int data_per_packet;
     int num_reqs;
     int rc = PLCTAG_STATUS_OK;
@@ -1634,7 +2037,56 @@ int calculate_write_sizes(ab_tag_p tag)
         return rc;
     }
 
-    /* if we are here, then we have all the type data etc. */
+    data_per_packet = write_data_per_packet(tag);
+
+    if (data_per_packet <= 0) {
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    num_reqs = (tag->size + (data_per_packet - 1)) / data_per_packet;
+
+    pdebug(DEBUG_DETAIL, "We need %d requests.", num_reqs);
+
+    byte_offset = 0;
+
+    for (i = 0; i < num_reqs && rc == PLCTAG_STATUS_OK; i++) {
+        /* allocate a new slot */
+        rc = allocate_write_request_slot(tag);
+
+        if (rc == PLCTAG_STATUS_OK) {
+            /* how much data are we going to write in this packet? */
+            if ((tag->size - byte_offset) > data_per_packet) {
+                tag->write_req_sizes[i] = data_per_packet;
+            } else {
+                tag->write_req_sizes[i] = (tag->size - byte_offset);
+            }
+
+            pdebug(DEBUG_DETAIL, "Request %d is of size %d.", i, tag->write_req_sizes[i]);
+
+            /* update the byte offset for the next packet */
+            byte_offset += tag->write_req_sizes[i];
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * write_data_per_packet
+ *
+ * How much tag data fits in one write request.  Zero or less if the
+ * request overhead alone is too big.
+ */
+
+int write_data_per_packet(ab_tag_p tag)
+{
+    int overhead;
+    int data_per_packet;
+
     if(tag->connection) {
         overhead = sizeof(eip_cip_co_req);
     } else {
@@ -1662,39 +2114,529 @@ int calculate_write_sizes(ab_tag_p tag)
                "Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!",
                overhead,
                MAX_EIP_PACKET_SIZE);
-        return PLCTAG_ERR_TOO_LONG;
     }
 
-    num_reqs = (tag->size + (data_per_packet - 1)) / data_per_packet;
+    return data_per_packet;
+}
 
-    pdebug(DEBUG_DETAIL, "We need %d requests.", num_reqs);
 
-    byte_offset = 0;
 
-    for (i = 0; i < num_reqs && rc == PLCTAG_STATUS_OK; i++) {
-        /* allocate a new slot */
-        rc = allocate_write_request_slot(tag);
+/*
+ * next_dirty_run
+ *
+ * Find the next run of changed bytes at or after byte_offset.  The
+ * setters mark 32-bit words, so runs are word aligned, clipped to the
+ * tag size.  Changed words separated by no more than max_gap unchanged
+ * bytes are joined into one run.
+ *
+ * Returns 1 if a run was found, 0 if not.
+ */
 
-        if (rc == PLCTAG_STATUS_OK) {
-            /* how much data are we going to write in this packet? */
-            if ((tag->size - byte_offset) > data_per_packet) {
-                tag->write_req_sizes[i] = data_per_packet;
+int next_dirty_run(ab_tag_p tag, int byte_offset, int max_gap, int *run_start, int *run_end)
+{
+    int num_words = (tag->size + 3) / 4;
+    int word = byte_offset / 4;
+    int last_dirty;
+
+    /* find the first changed word. */
+    while(word < num_words && !(tag->dirty_words[word / 8] & (1 << (word % 8)))) {
+        word++;
+    }
+
+    if(word >= num_words) {
+        return 0;
+    }
+
+    *run_start = word * 4;
+
+    /* extend the run while the next changed word is close enough. */
+    last_dirty = word;
+
+    for(word = last_dirty + 1; word < num_words && (word - last_dirty - 1) * 4 <= max_gap; word++) {
+        if(tag->dirty_words[word / 8] & (1 << (word % 8))) {
+            last_dirty = word;
+        }
+    }
+
+    *run_end = (last_dirty + 1) * 4;
+
+    if(*run_end > tag->size) {
+        *run_end = tag->size;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * start_dirty_write
+ *
+ * The setters mark the words they change.  Once the tag has been read,
+ * the rest of the buffer holds what the PLC sent, so for a tag that
+ * takes more than one request to write, only the changed runs need to
+ * go out, each as Write Tag Fragmented at its own offset.  Unchanged
+ * gaps smaller than a request's overhead are sent rather than split.
+ *
+ * Returns PLCTAG_STATUS_PENDING if the write was started and
+ * PLCTAG_STATUS_OK if the whole tag should be written instead.
+ */
+
+int start_dirty_write(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int data_per_packet;
+    int max_gap;
+    int byte_offset;
+    int run_start;
+    int run_end;
+    int total = 0;
+    int size;
+    int slot;
+
+    if(!tag->dirty_words || tag->first_read) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    data_per_packet = write_data_per_packet(tag);
+
+    if(data_per_packet <= 0 || tag->size <= data_per_packet) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    max_gap = MAX_EIP_PACKET_SIZE - data_per_packet;
+
+    for(byte_offset = 0; next_dirty_run(tag, byte_offset, max_gap, &run_start, &run_end); byte_offset = run_end) {
+        total += run_end - run_start;
+    }
+
+    if(total == 0 || total >= tag->size) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    tag->num_write_requests = 0;
+    tag->write_partial = 1;
+
+    for(byte_offset = 0; rc == PLCTAG_STATUS_OK && next_dirty_run(tag, byte_offset, max_gap, &run_start, &run_end); byte_offset = run_end) {
+        for(; rc == PLCTAG_STATUS_OK && run_start < run_end; run_start += size) {
+            size = run_end - run_start;
+
+            if(size > data_per_packet) {
+                size = data_per_packet;
+            }
+
+            rc = allocate_write_request_slot(tag);
+
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            slot = tag->num_write_requests - 1;
+            tag->write_req_sizes[slot] = size;
+
+            if(tag->connection) {
+                rc = build_write_request_connected(tag, slot, run_start);
             } else {
-                tag->write_req_sizes[i] = (tag->size - byte_offset);
+                rc = build_write_request_unconnected(tag, slot, run_start);
             }
+        }
+    }
 
-            pdebug(DEBUG_DETAIL, "Request %d is of size %d.", i, tag->write_req_sizes[i]);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to build partial write request!");
+        ab_tag_abort(tag);
+        return rc;
+    }
 
-            /* update the byte offset for the next packet */
-            byte_offset += tag->write_req_sizes[i];
+    pdebug(DEBUG_DETAIL, "Writing %d of %d bytes in %d requests.", total, tag->size, tag->num_write_requests);
+
+    /* the write is now pending */
+    tag->write_in_progress = 1;
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+
+/*
+ * start_bit_writes
+ *
+ * Send one Read-Modify-Write request for each element with bit changes
+ * waiting.  The request holds the element's path, the mask size, the OR
+ * mask and then the AND mask.  The PLC applies them in one step, so
+ * other bits in the element are left as the PLC has them.
+ */
+
+int start_bit_writes(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    uint8_t service[1 + MAX_TAG_NAME + 6 + 2 + 16];
+    uint8_t *data;
+    int path_size = 0;
+    ab_request_p req = NULL;
+    int elem;
+    int slot;
+    int i;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    /* look the instance up again if the symbols moved. */
+    symbol_check_tag_instance(tag);
+
+    /* these requests replace any write plan. */
+    tag->num_write_requests = 0;
+    tag->write_partial = 1;
+
+    for(elem=0; elem < tag->elem_count && rc == PLCTAG_STATUS_OK; elem++) {
+        if(!tag->bit_or_masks[elem] && tag->bit_and_masks[elem] == ~(uint64_t)0) {
+            continue;
+        }
+
+        data = service;
+
+        *data = AB_EIP_CMD_CIP_RMW;
+        data++;
+
+        rc = cip_encode_element_path(tag, elem, data, &path_size);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        data += path_size;
+
+        *((uint16_t*)data) = h2le16((uint16_t)tag->elem_size);
+        data += 2;
+
+        for(i=0; i < tag->elem_size; i++) {
+            *data = (uint8_t)(tag->bit_or_masks[elem] >> (8 * i));
+            data++;
+        }
+
+        for(i=0; i < tag->elem_size; i++) {
+            *data = (uint8_t)(tag->bit_and_masks[elem] >> (8 * i));
+            data++;
+        }
+
+        rc = allocate_write_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        slot = tag->num_write_requests - 1;
+
+        rc = build_service_request(tag, service, (int)(data - service), &req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        req->priority = tag->op_priority;
+        req->deadline = tag->op_deadline;
+
+        rc = session_add_request(tag->session, req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add request to session! rc=%d", rc);
+            request_release(req);
+            break;
+        }
+
+        tag->reqs[slot] = req;
+
+        tag->bit_or_masks[elem] = 0;
+        tag->bit_and_masks[elem] = ~(uint64_t)0;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to start bit writes!");
+
+        /* drop the changes that did not go out. */
+        for(elem=0; elem < tag->elem_count; elem++) {
+            tag->bit_or_masks[elem] = 0;
+            tag->bit_and_masks[elem] = ~(uint64_t)0;
+        }
+
+        tag->bit_writes_pending = 0;
+        ab_tag_abort(tag);
+
+        return rc;
+    }
+
+    tag->bit_writes_pending = 0;
+
+    if(!tag->num_write_requests) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    pdebug(DEBUG_DETAIL, "Sent %d bit write requests.", tag->num_write_requests);
+
+    tag->bit_write_in_progress = 1;
+    tag->write_in_progress = 1;
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+/*
+ * check_bit_write_status
+ *
+ * Wait for all the Read-Modify-Write replies and check them.
+ */
+
+int check_bit_write_status(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    uint8_t *reply = NULL;
+    uint8_t *reply_end = NULL;
+    int i;
+
+    for(i=0; i < tag->num_write_requests; i++) {
+        if(tag->reqs[i] && !tag->reqs[i]->resp_received) {
+            return PLCTAG_STATUS_PENDING;
+        }
+    }
+
+    for(i=0; i < tag->num_write_requests && rc == PLCTAG_STATUS_OK; i++) {
+        if(!tag->reqs[i]) {
+            rc = PLCTAG_ERR_NULL_PTR;
+            break;
+        }
+
+        rc = check_service_reply(tag, tag->reqs[i], AB_EIP_CMD_CIP_RMW, &reply, &reply_end);
+
+        if(rc == PLCTAG_STATUS_PENDING) {
+            rc = PLCTAG_ERR_BAD_DATA;
+        }
+    }
+
+    /* have the IO thread take care of the request buffers */
+    ab_tag_abort(tag);
+
+    return rc;
+}
+
+
+
+/*
+ * build_service_request
+ *
+ * Wrap one CIP service request, service code, path and data, for the
+ * tag's PLC.  This goes over the tag's connection if it has one and as
+ * an unconnected send otherwise.  The caller adds the request to the
+ * session.
+ */
+
+int build_service_request(ab_tag_p tag, uint8_t *service, int service_size, ab_request_p *result)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p req = NULL;
+    uint8_t *data = NULL;
+
+    *result = NULL;
+
+    rc = request_create(&req);
+
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
+        return rc;
+    }
+
+    req->num_retries_left = tag->num_retries;
+    req->retry_interval = tag->default_retry_interval;
+
+    if(tag->connection) {
+        eip_cip_co_req *cip = (eip_cip_co_req*)(req->data);
+
+        data = (req->data) + sizeof(eip_cip_co_req);
+
+        mem_copy(data, service, service_size);
+        data += service_size;
+
+        cip->encap_command = h2le16(AB_EIP_CONNECTED_SEND);
+        cip->router_timeout = h2le16(1);
+        cip->cpf_item_count = h2le16(2);
+        cip->cpf_cai_item_type = h2le16(AB_EIP_ITEM_CAI);
+        cip->cpf_cai_item_length = h2le16(4);
+        cip->cpf_cdi_item_type = h2le16(AB_EIP_ITEM_CDI);
+        cip->cpf_cdi_item_length = h2le16(data - (uint8_t*)(&cip->cpf_conn_seq_num));
+
+        req->connection = tag->connection;
+        req->connected_request = 1;
+    } else {
+        eip_cip_uc_req *cip = (eip_cip_uc_req*)(req->data);
+        uint8_t *embed_start = NULL;
+
+        data = (req->data) + sizeof(eip_cip_uc_req);
+        embed_start = data;
+
+        mem_copy(data, service, service_size);
+        data += service_size;
+
+        cip->uc_cmd_length = h2le16(data - embed_start);
+
+        /* routing information for the embedded message */
+        if(tag->conn_path_size > 0) {
+            *data = (tag->conn_path_size) / 2; /* in 16-bit words */
+            data++;
+            *data = 0; /* reserved/pad */
+            data++;
+            mem_copy(data, tag->conn_path, tag->conn_path_size);
+            data += tag->conn_path_size;
         }
+
+        cip->encap_command = h2le16(AB_EIP_READ_RR_DATA);
+        cip->router_timeout = h2le16(1);
+        cip->cpf_item_count = h2le16(2);
+        cip->cpf_nai_item_type = h2le16(AB_EIP_ITEM_NAI);
+        cip->cpf_nai_item_length = h2le16(0);
+        cip->cpf_udi_item_type = h2le16(AB_EIP_ITEM_UDI);
+        cip->cpf_udi_item_length = h2le16(data - (uint8_t*)(&cip->cm_service_code));
+        cip->cm_service_code = AB_EIP_CMD_UNCONNECTED_SEND;
+        cip->cm_req_path_size = 2;
+        cip->cm_req_path[0] = 0x20;
+        cip->cm_req_path[1] = 0x06;
+        cip->cm_req_path[2] = 0x24;
+        cip->cm_req_path[3] = 0x01;
+        cip->secs_per_tick = AB_EIP_SECS_PER_TICK;
+        cip->timeout_ticks = AB_EIP_TIMEOUT_TICKS;
+    }
+
+    req->request_size = data - (req->data);
+    req->send_request = 1;
+
+    *result = req;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_service_reply
+ *
+ * Check the reply to a request made by build_service_request().  On
+ * success, *reply and *reply_end bracket the reply data after the
+ * status.  Returns PLCTAG_STATUS_PENDING if the PLC only sent part of
+ * the reply.
+ */
+
+int check_service_reply(ab_tag_p tag, ab_request_p req, uint8_t service_code, uint8_t **reply, uint8_t **reply_end)
+{
+    uint8_t *data = NULL;
+    uint8_t reply_service = 0;
+    uint8_t status = 0;
+    uint8_t num_status_words = 0;
+
+    if(le2h32(((eip_encap_t*)(req->data))->encap_status) != AB_EIP_OK) {
+        pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(((eip_encap_t*)(req->data))->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
     }
 
+    if(tag->connection) {
+        eip_cip_co_resp *resp = (eip_cip_co_resp*)(req->data);
+
+        reply_service = resp->reply_service;
+        status = resp->status;
+        num_status_words = resp->num_status_words;
+        data = (req->data) + sizeof(eip_cip_co_resp);
+    } else {
+        eip_cip_uc_resp *resp = (eip_cip_uc_resp*)(req->data);
+
+        reply_service = resp->reply_service;
+        status = resp->status;
+        num_status_words = resp->num_status_words;
+        data = (req->data) + sizeof(eip_cip_uc_resp);
+    }
+
+    if(reply_service != (service_code | AB_EIP_CMD_CIP_OK)) {
+        pdebug(DEBUG_WARN, "CIP response reply service unexpected: %d", reply_service);
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if(status != AB_CIP_STATUS_OK && status != AB_CIP_STATUS_FRAG) {
+        pdebug(DEBUG_WARN, "CIP request failed with status: 0x%x %s", status, decode_cip_error(&status, AB_ERROR_STR_SHORT));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    *reply = data + (num_status_words * 2);
+    *reply_end = (req->data) + le2h16(((eip_encap_t*)(req->data))->encap_length) + sizeof(eip_encap_t);
+
+    return (status == AB_CIP_STATUS_FRAG ? PLCTAG_STATUS_PENDING : PLCTAG_STATUS_OK);
+}
+
+
+
+/*
+ * eip_cip_send_sync
+ *
+ * Send one CIP service request to the tag's PLC and wait for the reply.
+ * It blocks, so it must not be called from the IO thread or with the
+ * session mutex held.
+ *
+ * On success, *result is the request, which the caller must release,
+ * and *reply and *reply_end bracket the reply data after the status.
+ * Returns PLCTAG_STATUS_PENDING if the PLC only sent part of the reply.
+ */
+
+int eip_cip_send_sync(ab_tag_p tag, uint8_t *service, int service_size, ab_request_p *result, uint8_t **reply, uint8_t **reply_end)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p req = NULL;
+    int64_t timeout_time = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    *result = NULL;
+
+    rc = build_service_request(tag, service, service_size, &req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    rc = session_add_request(tag->session, req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to add request to session! rc=%d", rc);
+        request_release(req);
+        return rc;
+    }
+
+    /* wait for the reply */
+    timeout_time = time_ms() + AB_EIP_DEFAULT_TIMEOUT;
+
+    while(!req->resp_received && req->status == PLCTAG_STATUS_OK && timeout_time > time_ms()) {
+        sleep_ms(1);
+    }
+
+    if(!req->resp_received) {
+        pdebug(DEBUG_WARN, "No reply to CIP request!");
+        rc = (req->status != PLCTAG_STATUS_OK ? req->status : PLCTAG_ERR_TIMEOUT);
+        req->abort_request = 1;
+        request_release(req);
+        return rc;
+    }
+
+    rc = check_service_reply(tag, req, service[0], reply, reply_end);
+
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        request_release(req);
+        return rc;
+    }
+
+    *result = req;
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
 }
 
+
+
 /*#ifdef __cplusplus
 }
 #endif
@@ -33,5 +33,9 @@
 int eip_cip_tag_status(ab_tag_p tag);
 int eip_cip_tag_read_start(ab_tag_p tag);
 int eip_cip_tag_write_start(ab_tag_p tag);
+int eip_cip_tag_write_bit(ab_tag_p tag, int offset_bit, int val);
+int eip_cip_tag_plan_read(ab_tag_p tag);
+int eip_cip_tag_set_read_plan(ab_tag_p tag, int *read_req_sizes, int num_read_requests, uint8_t *type_info, int type_info_size);
+int eip_cip_send_sync(ab_tag_p tag, uint8_t *service, int service_size, ab_request_p *result, uint8_t **reply, uint8_t **reply_end);
 
 #endif
@@ -40,8 +40,12 @@
 #include <util/debug.h>
 
 
+static int build_read_request(ab_tag_p tag, int slot, int first_elem, int elem_count);
+static int build_write_request(ab_tag_p tag, int slot, int first_elem, int elem_count);
 static int check_read_status(ab_tag_p tag);
+static int check_read_response(ab_tag_p tag, ab_request_p req, int byte_offset, int expected_size);
 static int check_write_status(ab_tag_p tag);
+static int check_write_response(ab_request_p req);
 
 /*
  * eip_dhp_pccc_tag_status
@@ -55,6 +59,13 @@ int eip_dhp_pccc_tag_status(ab_tag_p tag)
     int session_rc = PLCTAG_STATUS_OK;
     int connection_rc = PLCTAG_STATUS_OK;
 
+    /* did the IO thread give up on any of our requests? */
+    rc = ab_tag_check_request_errors(tag);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
     if(tag->read_in_progress) {
         rc = check_read_status(tag);
 
@@ -105,46 +116,75 @@ int eip_dhp_pccc_tag_status(ab_tag_p tag)
 /*
  * eip_dhp_pccc_tag_read_start
  *
- * This does not support multiple request fragments.
+ * A tag that does not fit in one packet is read as several element
+ * ranges, all queued at once.
  */
 int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
 {
-    pccc_dhp_co_req *pccc;
-    uint8_t *data;
-    int data_per_packet;
-    int overhead;
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req;
+    int elems_per_request = 0;
+    int first_elem = 0;
+    int elem_count = 0;
+    int slot = 0;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    /* how many packets will we need? How much overhead? */
-    overhead = sizeof(pccc_resp) + 4 + tag->encoded_name_size; /* MAGIC 4 = fudge */
-
-    data_per_packet = MAX_PCCC_PACKET_SIZE - overhead;
+    rc = pccc_plan_requests(tag->encoded_name_size, tag->elem_count, tag->elem_size, 0, &elems_per_request);
 
-    if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
-        return PLCTAG_ERR_TOO_LONG;
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
     }
 
-    if(data_per_packet < tag->size) {
-        pdebug(DEBUG_WARN,"PCCC requests cannot be fragmented.  Too much data requested.");
-        return PLCTAG_ERR_TOO_LONG;
-    }
+    tag->num_read_requests = 0;
 
-    if(!tag->reqs) {
-        tag->reqs = (ab_request_p*)mem_alloc(1 * sizeof(ab_request_p));
-        tag->max_requests = 1;
-        tag->num_read_requests = 1;
-        tag->num_write_requests = 1;
+    for(first_elem = 0; first_elem < tag->elem_count; first_elem += elems_per_request) {
+        elem_count = tag->elem_count - first_elem;
 
-        if(!tag->reqs) {
-            pdebug(DEBUG_ERROR,"Unable to get memory for request array!");
-            return PLCTAG_ERR_NO_MEM;
+        if(elem_count > elems_per_request) {
+            elem_count = elems_per_request;
         }
+
+        rc = allocate_read_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        tag->read_req_sizes[slot] = elem_count * tag->elem_size;
+
+        rc = build_read_request(tag, slot, first_elem, elem_count);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        slot++;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        ab_tag_abort(tag);
+        return rc;
     }
 
+    tag->read_in_progress = 1;
+
+    /* the read is now pending */
+    pdebug(DEBUG_INFO,"Done.");
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+int build_read_request(ab_tag_p tag, int slot, int first_elem, int elem_count)
+{
+    pccc_dhp_co_req *pccc;
+    uint8_t *data;
+    int name_size = 0;
+    uint16_t tns = connection_get_new_pccc_tns(tag->connection);
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p req;
+
     /* get a request buffer */
     rc = request_create(&req);
 
@@ -161,12 +201,17 @@ int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
     /* point to the end of the struct */
     data = (req->data) + sizeof(pccc_dhp_co_req);
 
-    /* copy encoded into the request */
-    mem_copy(data,tag->encoded_name,tag->encoded_name_size);
-    data += tag->encoded_name_size;
+    /* copy encoded into the request, moved to the first element. */
+    if(!pccc_encode_element_offset(data, &name_size, tag->encoded_name, tag->encoded_name_size, first_elem)) {
+        pdebug(DEBUG_WARN,"PCCC requests for this address cannot be fragmented.  Too much data requested.");
+        request_release(req);
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    data += name_size;
 
     /* we need the count twice? */
-    *((uint16_t*)data) = h2le16(tag->elem_count); /* FIXME - bytes or INTs? */
+    *((uint16_t*)data) = h2le16(elem_count); /* FIXME - bytes or INTs? */
     data += sizeof(uint16_t);
 
     /* encap fields */
@@ -191,9 +236,9 @@ int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
     /* PCCC Command */
     pccc->pccc_command = AB_EIP_PCCC_TYPED_CMD;
     pccc->pccc_status = 0;  /* STS 0 in request */
-    pccc->pccc_seq_num = /*h2le16(conn_seq_id)*/ h2le16((uint16_t)(intptr_t)(tag->connection));
+    pccc->pccc_seq_num = h2le16(tns);
     pccc->pccc_function = AB_EIP_PCCC_TYPED_READ_FUNC;
-    pccc->pccc_transfer_size = h2le16(tag->elem_count); /* This is not in the docs, but it is in the data. */
+    pccc->pccc_transfer_size = h2le16(elem_count); /* This is not in the docs, but it is in the data. */
 
     /* get ready to add the request to the queue for this session */
     req->request_size = data - (req->data);
@@ -201,77 +246,127 @@ int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
     /* store the connection */
     req->connection = tag->connection;
 
+    /* the response is matched on the PCCC transaction number too. */
+    req->pccc_tns = tns;
+    req->pccc_tns_offset = offsetof(pccc_dhp_co_resp, pccc_seq_num);
+
     /* this request is connected, so it needs the session exclusively */
     req->connected_request = 1;
 
     /* mark the request ready for sending */
     req->send_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
         request_release(req);
-        tag->reqs[0] = NULL;
         return rc;
     }
 
     /* save the request for later */
-    tag->reqs[0] = req;
-    tag->read_in_progress = 1;
-
-    /* the read is now pending */
-    pdebug(DEBUG_INFO,"Done.");
+    tag->reqs[slot] = req;
 
-    return PLCTAG_STATUS_PENDING;
+    return PLCTAG_STATUS_OK;
 }
 
 
 
+/*
+ * eip_dhp_pccc_tag_write_start
+ *
+ * A tag that does not fit in one packet is written as several element
+ * ranges, all queued at once.
+ */
 int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
 {
-    pccc_dhp_co_req *pccc;
-    uint8_t *data;
-    uint8_t element_def[16];
-    int element_def_size;
-    uint8_t array_def[16];
-    int array_def_size;
-    int pccc_data_type;
-    int data_per_packet = 0;
-    int overhead = 0;
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req;
+    int elems_per_request = 0;
+    int first_elem = 0;
+    int elem_count = 0;
+    int slot = 0;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    /* how many packets will we need? How much overhead? */
-    overhead = sizeof(pccc_resp) + 4 + tag->encoded_name_size; /* MAGIC 4 = fudge */
-
-    data_per_packet = MAX_PCCC_PACKET_SIZE - overhead;
+    /* a streaming tag without a buffer has nothing to write. */
+    if(!tag->data) {
+        pdebug(DEBUG_WARN,"Tag has no data buffer to write!");
+        return PLCTAG_ERR_NO_DATA;
+    }
 
-    if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
-        return PLCTAG_ERR_TOO_LONG;
+    /* What type and size do we have? */
+    if(tag->elem_size != 2 && tag->elem_size != 4) {
+        pdebug(DEBUG_ERROR,"Unsupported data type size: %d",tag->elem_size);
+        return PLCTAG_ERR_NOT_ALLOWED;
     }
 
-    if(data_per_packet < tag->size) {
-        pdebug(DEBUG_WARN,"PCCC requests cannot be fragmented.  Too much data requested.");
-        return PLCTAG_ERR_TOO_LONG;
+    rc = pccc_plan_requests(tag->encoded_name_size, tag->elem_count, tag->elem_size, PCCC_WRITE_TYPE_SIZE, &elems_per_request);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
     }
 
-    if(!tag->reqs) {
-        tag->reqs = (ab_request_p*)mem_alloc(1 * sizeof(ab_request_p));
-        tag->max_requests = 1;
-        tag->num_read_requests = 1;
-        tag->num_write_requests = 1;
+    tag->num_write_requests = 0;
+
+    for(first_elem = 0; first_elem < tag->elem_count; first_elem += elems_per_request) {
+        elem_count = tag->elem_count - first_elem;
+
+        if(elem_count > elems_per_request) {
+            elem_count = elems_per_request;
+        }
+
+        rc = allocate_write_request_slot(tag);
 
-        if(!tag->reqs) {
-            pdebug(DEBUG_ERROR,"Unable to get memory for request array!");
-            return PLCTAG_ERR_NO_MEM;
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
         }
+
+        tag->write_req_sizes[slot] = elem_count * tag->elem_size;
+
+        rc = build_write_request(tag, slot, first_elem, elem_count);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        slot++;
     }
 
+    if(rc != PLCTAG_STATUS_OK) {
+        ab_tag_abort(tag);
+        return rc;
+    }
+
+    tag->write_in_progress = 1;
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+int build_write_request(ab_tag_p tag, int slot, int first_elem, int elem_count)
+{
+    pccc_dhp_co_req *pccc;
+    uint8_t *data;
+    uint8_t element_def[16];
+    int element_def_size;
+    uint8_t array_def[16];
+    int array_def_size;
+    int pccc_data_type;
+    int name_size = 0;
+    int byte_offset = first_elem * tag->elem_size;
+    int byte_count = elem_count * tag->elem_size;
+    uint16_t tns = connection_get_new_pccc_tns(tag->connection);
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p req;
+
     /* get a request buffer */
     rc = request_create(&req);
 
@@ -288,18 +383,15 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
     /* point to the end of the struct */
     data = (req->data) + sizeof(pccc_dhp_co_req);
 
-    /* copy laa into the request */
-    mem_copy(data,tag->encoded_name,tag->encoded_name_size);
-    data += tag->encoded_name_size;
-
-    /* What type and size do we have? */
-    if(tag->elem_size != 2 && tag->elem_size != 4) {
-        pdebug(DEBUG_ERROR,"Unsupported data type size: %d",tag->elem_size);
-        //~ request_destroy(&req);
+    /* copy laa into the request, moved to the first element. */
+    if(!pccc_encode_element_offset(data, &name_size, tag->encoded_name, tag->encoded_name_size, first_elem)) {
+        pdebug(DEBUG_WARN,"PCCC requests for this address cannot be fragmented.  Too much data requested.");
         request_release(req);
-        return PLCTAG_ERR_NOT_ALLOWED;
+        return PLCTAG_ERR_TOO_LONG;
     }
 
+    data += name_size;
+
     /* FIXME - base this on the data type. N7:0 -> INT F8:0 -> Float etc. */
     if(tag->elem_size == 4) {
         pccc_data_type = AB_PCCC_DATA_REAL;
@@ -318,7 +410,7 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
         return PLCTAG_ERR_ENCODE;
     }
 
-    if(!(array_def_size = pccc_encode_dt_byte(array_def,sizeof(array_def),AB_PCCC_DATA_ARRAY,element_def_size + tag->size))) {
+    if(!(array_def_size = pccc_encode_dt_byte(array_def,sizeof(array_def),AB_PCCC_DATA_ARRAY,element_def_size + byte_count))) {
         pdebug(DEBUG_WARN,"Unable to encode PCCC request data type and size fields!");
         //~ request_destroy(&req);
         request_release(req);
@@ -334,8 +426,8 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
     data += element_def_size;
 
     /* now copy the data to write */
-    mem_copy(data,tag->data, tag->size);
-    data += tag->size;
+    mem_copy(data,tag->data + byte_offset, byte_count);
+    data += byte_count;
 
 
     /* now fill in the rest of the structure. */
@@ -362,9 +454,9 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
     /* PCCC Command */
     pccc->pccc_command = AB_EIP_PCCC_TYPED_CMD;
     pccc->pccc_status = 0;  /* STS 0 in request */
-    pccc->pccc_seq_num = h2le16((uint16_t)(intptr_t)(tag->connection));
+    pccc->pccc_seq_num = h2le16(tns);
     pccc->pccc_function = AB_EIP_PCCC_TYPED_WRITE_FUNC;
-    pccc->pccc_transfer_size = h2le16(tag->elem_count); /* This is not in the docs, but it is in the data. */
+    pccc->pccc_transfer_size = h2le16(elem_count); /* This is not in the docs, but it is in the data. */
 
     /* get ready to add the request to the queue for this session */
     req->request_size = data - (req->data);
@@ -372,46 +464,47 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
     /* store the connection */
     req->connection = tag->connection;
 
+    /* the response is matched on the PCCC transaction number too. */
+    req->pccc_tns = tns;
+    req->pccc_tns_offset = offsetof(pccc_dhp_co_resp, pccc_seq_num);
+
     /* ready the request for sending */
     req->send_request = 1;
 
     /* this request is connected, so it needs the session exclusively */
     req->connected_request = 1;
 
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
         request_release(req);
-        tag->reqs[0] = NULL;
         return rc;
     }
 
     /* save the request for later */
-    tag->reqs[0] = req;
-    tag->write_in_progress = 1;
-
-    pdebug(DEBUG_INFO,"Done.");
+    tag->reqs[slot] = req;
 
-    return PLCTAG_STATUS_PENDING;
+    return PLCTAG_STATUS_OK;
 }
 
 
 /*
  * check_read_status
  *
- * PCCC does not support request fragments.
+ * Hand over the data of each request in order as the responses come in.
  */
 static int check_read_status(ab_tag_p tag)
 {
-    pccc_dhp_co_resp *resp;
-    uint8_t *data;
-    uint8_t *data_end;
-    int pccc_res_type;
-    int pccc_res_length;
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
+    int byte_offset = 0;
+    int i;
 
     pdebug(DEBUG_DETAIL,"Starting");
 
@@ -423,13 +516,51 @@ static int check_read_status(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    req = tag->reqs[0];
+    for(i = 0; i < tag->num_read_requests; i++) {
+        req = tag->reqs[i];
+
+        if(!req) {
+            rc = PLCTAG_ERR_NULL_PTR;
+            break;
+        }
+
+        if(!req->processed) {
+            if(!req->resp_received) {
+                /* still waiting */
+                return PLCTAG_STATUS_PENDING;
+            }
+
+            req->processed = 1;
+
+            rc = check_read_response(tag, req, byte_offset, tag->read_req_sizes[i]);
+
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
 
-    if(!req->resp_received) {
-        /* still waiting */
-        return PLCTAG_STATUS_PENDING;
+        byte_offset += tag->read_req_sizes[i];
     }
 
+    /* clean up request */
+    ab_tag_abort(tag);
+
+    pdebug(DEBUG_DETAIL,"Done.");
+
+    return rc;
+}
+
+
+
+int check_read_response(ab_tag_p tag, ab_request_p req, int byte_offset, int expected_size)
+{
+    pccc_dhp_co_resp *resp;
+    uint8_t *data;
+    uint8_t *data_end;
+    int pccc_res_type;
+    int pccc_res_length;
+    int rc = PLCTAG_STATUS_OK;
+
     /* fake exception */
     do {
         resp = (pccc_dhp_co_resp*)(req->data);
@@ -452,6 +583,12 @@ static int check_read_status(ab_tag_p tag)
             break;
         }
 
+        if(le2h16(resp->pccc_seq_num) != req->pccc_tns) {
+            pdebug(DEBUG_WARN,"PCCC transaction number %u does not match request %u!", le2h16(resp->pccc_seq_num), req->pccc_tns);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
         if(resp->pccc_status != AB_EIP_OK) {
             /* data points to the byte following the header */
             pdebug(DEBUG_WARN,"PCCC error: %d - %s", *data, pccc_decode_error(*data));
@@ -480,35 +617,34 @@ static int check_read_status(ab_tag_p tag)
             }
         }
 
-        /* copy data into the tag. */
-        if((data_end - data) > tag->size) {
+        /* each request covers an exact element range, anything else is an error. */
+        if((data_end - data) > expected_size) {
+            pdebug(DEBUG_WARN,"Response has %d bytes, expected %d!", (int)(data_end - data), expected_size);
             rc = PLCTAG_ERR_TOO_LONG;
             break;
         }
 
+        if((data_end - data) < expected_size) {
+            pdebug(DEBUG_WARN,"Response has %d bytes, expected %d!", (int)(data_end - data), expected_size);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
         /* all OK, copy the data. */
-        mem_copy(tag->data, data, data_end - data);
+        tag_store_read_data((plc_tag_p)tag, byte_offset, data, (int)(data_end - data));
 
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    /* clean up request */
-    ab_tag_abort(tag);
-
-    tag->read_in_progress = 0;
-
-    pdebug(DEBUG_DETAIL,"Done.");
-
     return rc;
 }
 
 
 static int check_write_status(ab_tag_p tag)
 {
-    pccc_dhp_co_resp *pccc_resp;
-    uint8_t *data = NULL;
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
+    int i;
 
     pdebug(DEBUG_DETAIL,"Starting.");
 
@@ -519,20 +655,50 @@ static int check_write_status(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    req = tag->reqs[0];
+    for(i = 0; i < tag->num_write_requests; i++) {
+        req = tag->reqs[i];
 
-    /* is there an outstanding request? */
-    if(!req) {
-        tag->write_in_progress = 0;
-        pdebug(DEBUG_WARN,"Write was in progress, but no requests are outstanding!");
-        return PLCTAG_ERR_NULL_PTR;
-    }
+        /* is there an outstanding request? */
+        if(!req) {
+            pdebug(DEBUG_WARN,"Write was in progress, but no requests are outstanding!");
+            rc = PLCTAG_ERR_NULL_PTR;
+            break;
+        }
 
-    if(!req->resp_received) {
-        /* still waiting */
-        return PLCTAG_STATUS_PENDING;
+        if(req->processed) {
+            continue;
+        }
+
+        if(!req->resp_received) {
+            /* still waiting */
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        req->processed = 1;
+
+        rc = check_write_response(req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
     }
 
+    /* clean up any outstanding requests. */
+    ab_tag_abort(tag);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return rc;
+}
+
+
+
+int check_write_response(ab_request_p req)
+{
+    pccc_dhp_co_resp *pccc_resp;
+    uint8_t *data = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
     /* fake exception */
     do {
         pccc_resp = (pccc_dhp_co_resp*)(req->data);
@@ -553,6 +719,12 @@ static int check_write_status(ab_tag_p tag)
             break;
         }
 
+        if(le2h16(pccc_resp->pccc_seq_num) != req->pccc_tns) {
+            pdebug(DEBUG_WARN,"PCCC transaction number %u does not match request %u!", le2h16(pccc_resp->pccc_seq_num), req->pccc_tns);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
         if(pccc_resp->pccc_status != AB_EIP_OK) {
             pdebug(DEBUG_WARN,"PCCC error: %d - %s", *data, pccc_decode_error(*data));
             rc = PLCTAG_ERR_REMOTE_ERR;
@@ -568,12 +740,5 @@ static int check_write_status(ab_tag_p tag)
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    tag->write_in_progress = 0;
-
-    /* clean up any outstanding requests. */
-    ab_tag_abort(tag);
-
-    pdebug(DEBUG_INFO,"Done.");
-
     return rc;
 }
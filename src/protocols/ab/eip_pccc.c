@@ -34,6 +34,7 @@ extern "C"
 #include <lib/libplctag.h>
 #include <ab/ab_common.h>
 #include <ab/pccc.h>
+#include <ab/pccc_file.h>
 #include <ab/eip_pccc.h>
 #include <ab/tag.h>
 #include <ab/connection.h>
@@ -42,8 +43,16 @@ extern "C"
 #include <util/debug.h>
 
 
+static int start_block_read(ab_tag_p tag);
+static int start_tag_read(ab_tag_p tag, const uint8_t *name, int name_size, int total_elems);
+static int build_read_request(ab_tag_p tag, const uint8_t *name, int name_size, int first_elem, int elem_count, ab_request_p *result);
+static int build_write_request(ab_tag_p tag, int slot, int first_elem, int elem_count);
 static int check_read_status(ab_tag_p tag);
+static int check_read_response(ab_tag_p tag, ab_request_p req, int byte_offset, int expected_size);
+static int decode_read_response(ab_request_p req, int expected_size, uint8_t **payload);
+static int decode_block_response(ab_request_p req, uint8_t *data, int size);
 static int check_write_status(ab_tag_p tag);
+static int check_write_response(ab_request_p req);
 
 /*
  * ab_tag_status_pccc
@@ -57,6 +66,24 @@ int eip_pccc_tag_status(ab_tag_p tag)
     int session_rc = PLCTAG_STATUS_OK;
     int connection_rc = PLCTAG_STATUS_OK;
 
+    /* did the IO thread give up on any of our requests? */
+    rc = ab_tag_check_request_errors(tag);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    if(tag->pccc_file_wait) {
+        rc = pccc_file_check_wait(tag, decode_block_response);
+
+        /* the block read stopped without our data, read our own elements. */
+        if(rc == PLCTAG_ERR_NO_DATA) {
+            rc = start_tag_read(tag, tag->encoded_name, tag->encoded_name_size, tag->elem_count);
+        }
+
+        return rc;
+    }
+
     if(tag->read_in_progress) {
         return check_read_status(tag);
     }
@@ -105,49 +132,203 @@ int eip_pccc_tag_status(ab_tag_p tag)
 /*
  * eip_pccc_tag_read_start
  *
- * Start a PCCC tag read (PLC5, SLC).
+ * Start a PCCC tag read (PLC5, SLC).  A tag sharing a data file read
+ * gets the block data or waits for the block read.
  */
 
 int eip_pccc_tag_read_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req;
-    uint16_t conn_seq_id = (uint16_t)(session_get_new_seq_id(tag->session));;
-    int overhead;
-    int data_per_packet;
-    pccc_req *pccc;
-    uint8_t *data;
-    uint8_t *embed_start;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    /* how many packets will we need? How much overhead? */
-    overhead = sizeof(pccc_resp) + 4 + tag->encoded_name_size; /* MAGIC 4 = fudge */
+    if(tag->pccc_file) {
+        int read_block = 0;
 
-    data_per_packet = MAX_PCCC_PACKET_SIZE - overhead;
+        rc = pccc_file_read_start(tag, &read_block);
 
-    if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
-        return PLCTAG_ERR_TOO_LONG;
+        if(read_block) {
+            rc = start_block_read(tag);
+        }
+
+        /* no block data for us, read our own elements. */
+        if(rc != PLCTAG_ERR_NO_DATA) {
+            return rc;
+        }
     }
 
-    if(data_per_packet < tag->size) {
-        pdebug(DEBUG_WARN,"PCCC requests cannot be fragmented.  Too much data requested.");
-        return PLCTAG_ERR_TOO_LONG;
+    rc = start_tag_read(tag, tag->encoded_name, tag->encoded_name_size, tag->elem_count);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * start_block_read
+ *
+ * Send the requests of a block read.  The block owns them, the tag
+ * waits for the block like any other.
+ */
+
+int start_block_read(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+    uint8_t block_name[8];
+    int name_size = 0;
+    ab_request_p *reqs = NULL;
+    int *req_sizes = NULL;
+    int num_reqs = 0;
+    int elems_per_request = 0;
+    int first_elem = 0;
+    int elem_count = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    do {
+        if(!pccc_encode_file_element(block_name, &name_size, file->file_num, file->data_first_elem)) {
+            rc = PLCTAG_ERR_ENCODE;
+            break;
+        }
+
+        rc = pccc_plan_requests(name_size, file->data_elem_count, file->elem_size, 0, &elems_per_request);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        num_reqs = (file->data_elem_count + elems_per_request - 1) / elems_per_request;
+
+        reqs = (ab_request_p*)mem_alloc(num_reqs * (int)sizeof(ab_request_p));
+        req_sizes = (int*)mem_alloc(num_reqs * (int)sizeof(int));
+
+        if(!reqs || !req_sizes) {
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        for(i = 0; i < num_reqs && rc == PLCTAG_STATUS_OK; i++) {
+            first_elem = i * elems_per_request;
+            elem_count = file->data_elem_count - first_elem;
+
+            if(elem_count > elems_per_request) {
+                elem_count = elems_per_request;
+            }
+
+            req_sizes[i] = elem_count * file->elem_size;
+
+            rc = build_read_request(tag, block_name, name_size, first_elem, elem_count, &reqs[i]);
+        }
+    } while(0);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to send the block read, reading the tag on its own. rc=%d", rc);
+
+        for(i = 0; reqs && i < num_reqs; i++) {
+            if(reqs[i]) {
+                reqs[i]->abort_request = 1;
+                request_release(reqs[i]);
+            }
+        }
+
+        if(reqs) {
+            mem_free(reqs);
+        }
+
+        if(req_sizes) {
+            mem_free(req_sizes);
+        }
+
+        pccc_file_read_failed(tag);
+
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    pccc_file_read_sent(tag, reqs, req_sizes, num_reqs);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+
+/*
+ * start_tag_read
+ *
+ * Read elements of the tag on its own.  A tag that does not fit in one
+ * packet is read as several element ranges, all sent at once.
+ */
+
+int start_tag_read(ab_tag_p tag, const uint8_t *name, int name_size, int total_elems)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int elems_per_request = 0;
+    int first_elem = 0;
+    int elem_count = 0;
+    int slot = 0;
+
+    rc = pccc_plan_requests(name_size, total_elems, tag->elem_size, 0, &elems_per_request);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
     }
 
-    if(!tag->reqs) {
-        tag->reqs = (ab_request_p*)mem_alloc(1 * sizeof(ab_request_p));
-        tag->max_requests = 1;
-        tag->num_read_requests = 1;
-        tag->num_write_requests = 1;
+    tag->num_read_requests = 0;
+
+    for(first_elem = 0; first_elem < total_elems; first_elem += elems_per_request) {
+        elem_count = total_elems - first_elem;
 
-        if(!tag->reqs) {
-            pdebug(DEBUG_WARN,"Unable to get memory for request array!");
-            return PLCTAG_ERR_NO_MEM;
+        if(elem_count > elems_per_request) {
+            elem_count = elems_per_request;
         }
+
+        rc = allocate_read_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        tag->read_req_sizes[slot] = elem_count * tag->elem_size;
+
+        rc = build_read_request(tag, name, name_size, first_elem, elem_count, &tag->reqs[slot]);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        slot++;
     }
 
+    if(rc != PLCTAG_STATUS_OK) {
+        ab_tag_abort(tag);
+        return rc;
+    }
+
+    tag->read_in_progress = 1;
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+
+int build_read_request(ab_tag_p tag, const uint8_t *name, int name_size, int first_elem, int elem_count, ab_request_p *result)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p req;
+    uint16_t tns = session_get_new_pccc_tns(tag->session);
+    pccc_req *pccc;
+    uint8_t *data;
+    uint8_t *embed_start;
+    int offset_name_size = 0;
+
     /* get a request buffer */
     rc = request_create(&req);
 
@@ -181,19 +362,24 @@ int eip_pccc_tag_read_start(ab_tag_p tag)
     /* fill in the PCCC command */
     pccc->pccc_command = AB_EIP_PCCC_TYPED_CMD;
     pccc->pccc_status = 0;  /* STS 0 in request */
-    pccc->pccc_seq_num = h2le16(conn_seq_id); /* FIXME - get sequence ID from session? */
+    pccc->pccc_seq_num = h2le16(tns);
     pccc->pccc_function = AB_EIP_PCCC_TYPED_READ_FUNC;
-    pccc->pccc_transfer_size = h2le16(tag->elem_count); /* This is not in the docs, but it is in the data. */
+    pccc->pccc_transfer_size = h2le16(elem_count); /* This is not in the docs, but it is in the data. */
 
     /* point to the end of the struct */
     data = ((uint8_t *)pccc) + sizeof(pccc_req);
 
-    /* copy encoded tag name into the request */
-    mem_copy(data,tag->encoded_name,tag->encoded_name_size);
-    data += tag->encoded_name_size;
+    /* copy encoded tag name into the request, moved to the first element. */
+    if(!pccc_encode_element_offset(data, &offset_name_size, name, name_size, first_elem)) {
+        pdebug(DEBUG_WARN,"PCCC requests for this address cannot be fragmented.  Too much data requested.");
+        request_release(req);
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    data += offset_name_size;
 
     /* we need the count twice? */
-    *((uint16_t*)data) = h2le16(tag->elem_count); /* FIXME - bytes or INTs? */
+    *((uint16_t*)data) = h2le16(elem_count); /* FIXME - bytes or INTs? */
     data += sizeof(uint16_t);
 
     /*
@@ -220,25 +406,27 @@ int eip_pccc_tag_read_start(ab_tag_p tag)
     /* mark it as ready to send */
     req->send_request = 1;
 
+    /* the response is matched on the PCCC transaction number too. */
+    req->pccc_tns = tns;
+    req->pccc_tns_offset = offsetof(pccc_resp, pccc_seq_num);
+
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
         request_release(req);
-        tag->reqs[0] = NULL;
         return rc;
     }
 
     /* save the request for later */
-    tag->reqs[0] = req;
-    req = NULL;
-
-    tag->read_in_progress = 1;
-
-    pdebug(DEBUG_INFO, "Done.");
+    *result = req;
 
-    return PLCTAG_STATUS_PENDING;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -248,24 +436,19 @@ int eip_pccc_tag_read_start(ab_tag_p tag)
 /*
  * check_read_status
  *
- * NOTE that we can have only one outstanding request because PCCC
- * does not support fragments.
+ * Hand over the data of each request in order as the responses come in.
  */
 
 
 static int check_read_status(ab_tag_p tag)
 {
-    pccc_resp *pccc;
-    uint8_t *data;
-    uint8_t *data_end;
-    int pccc_res_type;
-    int pccc_res_length;
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
+    int byte_offset = 0;
+    int i;
 
     pdebug(DEBUG_DETAIL,"Starting");
 
-    /* PCCC only can have one request outstanding */
     /* is there an outstanding request? */
     if(!tag->reqs || !(tag->reqs[0])) {
         tag->read_in_progress = 0;
@@ -273,12 +456,85 @@ static int check_read_status(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    req = tag->reqs[0];
+    for(i = 0; i < tag->num_read_requests; i++) {
+        req = tag->reqs[i];
 
-    if(!req->resp_received) {
-        return PLCTAG_STATUS_PENDING;
+        if(!req) {
+            rc = PLCTAG_ERR_NULL_PTR;
+            break;
+        }
+
+        if(!req->processed) {
+            if(!req->resp_received) {
+                return PLCTAG_STATUS_PENDING;
+            }
+
+            req->processed = 1;
+
+            rc = check_read_response(tag, req, byte_offset, tag->read_req_sizes[i]);
+
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
+
+        byte_offset += tag->read_req_sizes[i];
     }
 
+    /* clean up the requests */
+    ab_tag_abort(tag);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return rc;
+}
+
+
+
+int check_read_response(ab_tag_p tag, ab_request_p req, int byte_offset, int expected_size)
+{
+    uint8_t *payload = NULL;
+    int rc = decode_read_response(req, expected_size, &payload);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        tag_store_read_data((plc_tag_p)tag, byte_offset, payload, expected_size);
+    }
+
+    return rc;
+}
+
+
+
+int decode_block_response(ab_request_p req, uint8_t *data, int size)
+{
+    uint8_t *payload = NULL;
+    int rc = decode_read_response(req, size, &payload);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        mem_copy(data, payload, size);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * decode_read_response
+ *
+ * Check a read response and find its data, which must be exactly
+ * expected_size bytes.
+ */
+
+int decode_read_response(ab_request_p req, int expected_size, uint8_t **payload)
+{
+    pccc_resp *pccc;
+    uint8_t *data;
+    uint8_t *data_end;
+    int pccc_res_type;
+    int pccc_res_length;
+    int rc = PLCTAG_STATUS_OK;
+
     /* fake exceptions */
     do {
         pccc = (pccc_resp*)(req->data);
@@ -306,6 +562,12 @@ static int check_read_status(ab_tag_p tag)
             break;
         }
 
+        if(le2h16(pccc->pccc_seq_num) != req->pccc_tns) {
+            pdebug(DEBUG_WARN,"PCCC transaction number %u does not match request %u!", le2h16(pccc->pccc_seq_num), req->pccc_tns);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
         if(pccc->pccc_status != AB_EIP_OK) {
             pdebug(DEBUG_WARN, "PCCC command failed, response code: %d - %s", *data, pccc_decode_error(*data));
             rc = PLCTAG_ERR_REMOTE_ERR;
@@ -332,26 +594,24 @@ static int check_read_status(ab_tag_p tag)
             }
         }
 
-        /* copy data into the tag. */
-        if((data_end - data) > tag->size) {
+        /* each request covers an exact element range, anything else is an error. */
+        if((data_end - data) > expected_size) {
+            pdebug(DEBUG_WARN,"Response has %d bytes, expected %d!", (int)(data_end - data), expected_size);
             rc = PLCTAG_ERR_TOO_LONG;
             break;
         }
 
-        mem_copy(tag->data, data, data_end - data);
+        if((data_end - data) < expected_size) {
+            pdebug(DEBUG_WARN,"Response has %d bytes, expected %d!", (int)(data_end - data), expected_size);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
+        *payload = data;
 
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    /* clean up the request */
-    //session_remove_request(tag->session, req);
-    request_release(req);
-    tag->reqs[0] = NULL;
-
-    tag->read_in_progress = 0;
-
-    pdebug(DEBUG_INFO,"Done.");
-
     return rc;
 }
 
@@ -359,54 +619,104 @@ static int check_read_status(ab_tag_p tag)
 
 
 
-/* FIXME  convert to unconnected messages. */
+/*
+ * eip_pccc_tag_write_start
+ *
+ * A tag that does not fit in one packet is written as several element
+ * ranges, all sent at once.
+ */
 
 int eip_pccc_tag_write_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
-    pccc_req *pccc;
-    uint8_t *data;
-    uint8_t element_def[16];
-    int element_def_size;
-    uint8_t array_def[16];
-    int array_def_size;
-    int pccc_data_type;
-    uint16_t conn_seq_id = (uint16_t)(session_get_new_seq_id(tag->session));;
-    ab_request_p req = NULL;
-    uint8_t *embed_start;
-    int overhead, data_per_packet;
+    int elems_per_request = 0;
+    int first_elem = 0;
+    int elem_count = 0;
+    int slot = 0;
 
     pdebug(DEBUG_INFO,"Starting.");
 
-    /* how many packets will we need? How much overhead? */
-    overhead = sizeof(pccc_resp) + 4 + tag->encoded_name_size; /* MAGIC 4 = fudge */
-
-    data_per_packet = MAX_PCCC_PACKET_SIZE - overhead;
+    /* a streaming tag without a buffer has nothing to write. */
+    if(!tag->data) {
+        pdebug(DEBUG_WARN,"Tag has no data buffer to write!");
+        return PLCTAG_ERR_NO_DATA;
+    }
 
-    if(data_per_packet <= 0) {
-        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
-        return PLCTAG_ERR_TOO_LONG;
+    /* What type and size do we have? */
+    if(tag->elem_size != 2 && tag->elem_size != 4) {
+        pdebug(DEBUG_WARN,"Unsupported data type size: %d",tag->elem_size);
+        return PLCTAG_ERR_NOT_ALLOWED;
     }
 
-    if(data_per_packet < tag->size) {
-        pdebug(DEBUG_WARN,"PCCC requests cannot be fragmented.  Too much data requested.");
-        return PLCTAG_ERR_TOO_LONG;
+    rc = pccc_plan_requests(tag->encoded_name_size, tag->elem_count, tag->elem_size, PCCC_WRITE_TYPE_SIZE, &elems_per_request);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
     }
 
+    /* other tags must not get the old values from a shared file read. */
+    pccc_file_invalidate(tag);
 
-    /* set up the requests */
-    if(!tag->reqs) {
-        tag->reqs = (ab_request_p*)mem_alloc(1 * sizeof(ab_request_p));
-        tag->max_requests = 1;
-        tag->num_read_requests = 1;
-        tag->num_write_requests = 1;
+    tag->num_write_requests = 0;
 
-        if(!tag->reqs) {
-            pdebug(DEBUG_WARN,"Unable to get memory for request array!");
-            return PLCTAG_ERR_NO_MEM;
+    for(first_elem = 0; first_elem < tag->elem_count; first_elem += elems_per_request) {
+        elem_count = tag->elem_count - first_elem;
+
+        if(elem_count > elems_per_request) {
+            elem_count = elems_per_request;
+        }
+
+        rc = allocate_write_request_slot(tag);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
         }
+
+        tag->write_req_sizes[slot] = elem_count * tag->elem_size;
+
+        rc = build_write_request(tag, slot, first_elem, elem_count);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        slot++;
     }
 
+    if(rc != PLCTAG_STATUS_OK) {
+        ab_tag_abort(tag);
+        return rc;
+    }
+
+    /* the write is now pending */
+    tag->write_in_progress = 1;
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+/* FIXME  convert to unconnected messages. */
+
+int build_write_request(ab_tag_p tag, int slot, int first_elem, int elem_count)
+{
+    int rc = PLCTAG_STATUS_OK;
+    pccc_req *pccc;
+    uint8_t *data;
+    uint8_t element_def[16];
+    int element_def_size;
+    uint8_t array_def[16];
+    int array_def_size;
+    int pccc_data_type;
+    uint16_t tns = session_get_new_pccc_tns(tag->session);
+    ab_request_p req = NULL;
+    uint8_t *embed_start;
+    int name_size = 0;
+    int byte_offset = first_elem * tag->elem_size;
+    int byte_count = elem_count * tag->elem_size;
+
     /* get a request buffer */
     rc = request_create(&req);
 
@@ -426,18 +736,15 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     /* point to the end of the struct */
     data = (req->data) + sizeof(pccc_req);
 
-    /* copy laa into the request */
-    mem_copy(data,tag->encoded_name,tag->encoded_name_size);
-    data += tag->encoded_name_size;
-
-    /* What type and size do we have? */
-    if(tag->elem_size != 2 && tag->elem_size != 4) {
-        pdebug(DEBUG_WARN,"Unsupported data type size: %d",tag->elem_size);
-        //~ request_destroy(&req);
+    /* copy laa into the request, moved to the first element. */
+    if(!pccc_encode_element_offset(data, &name_size, tag->encoded_name, tag->encoded_name_size, first_elem)) {
+        pdebug(DEBUG_WARN,"PCCC requests for this address cannot be fragmented.  Too much data requested.");
         request_release(req);
-        return PLCTAG_ERR_NOT_ALLOWED;
+        return PLCTAG_ERR_TOO_LONG;
     }
 
+    data += name_size;
+
     if(tag->elem_size == 4)
         pccc_data_type = AB_PCCC_DATA_REAL;
     else
@@ -453,7 +760,7 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
         return PLCTAG_ERR_ENCODE;
     }
 
-    if(!(array_def_size = pccc_encode_dt_byte(array_def,sizeof(array_def),AB_PCCC_DATA_ARRAY,element_def_size + tag->size))) {
+    if(!(array_def_size = pccc_encode_dt_byte(array_def,sizeof(array_def),AB_PCCC_DATA_ARRAY,element_def_size + byte_count))) {
         pdebug(DEBUG_WARN,"Unable to encode PCCC request data type and size fields!");
         //~ request_destroy(&req);
         request_release(req);
@@ -469,8 +776,8 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     data += element_def_size;
 
     /* now copy the data to write */
-    mem_copy(data,tag->data,tag->size);
-    data += tag->size;
+    mem_copy(data,tag->data + byte_offset,byte_count);
+    data += byte_count;
 
     /* now fill in the rest of the structure. */
 
@@ -503,20 +810,27 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     /* PCCC Command */
     pccc->pccc_command = AB_EIP_PCCC_TYPED_CMD;
     pccc->pccc_status = 0;  /* STS 0 in request */
-    //pccc->pccc_seq_num = h2le16(tag->connection->conn_seq_num);
+    pccc->pccc_seq_num = h2le16(tns);
     pccc->pccc_function = AB_EIP_PCCC_TYPED_WRITE_FUNC;
     /* FIXME - what should be the count here?  It is bytes, 16-bit
      * words or something else?
      *
      * Seems to be the number of elements??
      */
-    pccc->pccc_transfer_size = h2le16(tag->elem_count); /* This is not in the docs, but it is in the data. */
+    pccc->pccc_transfer_size = h2le16(elem_count); /* This is not in the docs, but it is in the data. */
 
 
     /* get ready to add the request to the queue for this session */
     req->request_size = data - (req->data);
     req->send_request = 1;
-    req->conn_seq = conn_seq_id;
+
+    /* the response is matched on the PCCC transaction number too. */
+    req->pccc_tns = tns;
+    req->pccc_tns_offset = offsetof(pccc_resp, pccc_seq_num);
+
+    /* use the priority and deadline of the operation. */
+    req->priority = tag->op_priority;
+    req->deadline = tag->op_deadline;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -524,19 +838,13 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
         request_release(req);
-        tag->reqs[0] = NULL;
         return rc;
    }
 
     /* save the request for later */
-    tag->reqs[0] = req;
+    tag->reqs[slot] = req;
 
-    /* the write is now pending */
-    tag->write_in_progress = 1;
-
-    pdebug(DEBUG_INFO, "Done.");
-
-    return PLCTAG_STATUS_PENDING;
+    return PLCTAG_STATUS_OK;
 }
 
 
@@ -544,14 +852,13 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
 /*
  * check_write_status
  *
- * Fragments are not supported.
+ * Check the responses in order.  The write is done when all are in.
  */
 static int check_write_status(ab_tag_p tag)
 {
-    pccc_resp *pccc;
-    uint8_t *data = NULL;
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
+    int i;
 
     pdebug(DEBUG_DETAIL,"Starting.");
 
@@ -562,12 +869,51 @@ static int check_write_status(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    req = tag->reqs[0];
+    for(i = 0; i < tag->num_write_requests; i++) {
+        req = tag->reqs[i];
+
+        if(!req) {
+            rc = PLCTAG_ERR_NULL_PTR;
+            break;
+        }
 
-    if(!req->resp_received) {
-        return PLCTAG_STATUS_PENDING;
+        if(req->processed) {
+            continue;
+        }
+
+        if(!req->resp_received) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        req->processed = 1;
+
+        rc = check_write_response(req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
     }
 
+    /* a block read sent while we wrote may have been ahead of us. */
+    pccc_file_invalidate(tag);
+
+    /* clean up the requests */
+    ab_tag_abort(tag);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    /* Success! */
+    return rc;
+}
+
+
+
+int check_write_response(ab_request_p req)
+{
+    pccc_resp *pccc;
+    uint8_t *data = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
     /* fake exception */
     do {
         pccc = (pccc_resp*)(req->data);
@@ -594,6 +940,12 @@ static int check_write_status(ab_tag_p tag)
             break;
         }
 
+        if(le2h16(pccc->pccc_seq_num) != req->pccc_tns) {
+            pdebug(DEBUG_WARN,"PCCC transaction number %u does not match request %u!", le2h16(pccc->pccc_seq_num), req->pccc_tns);
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
         if(pccc->pccc_status != AB_EIP_OK) {
             pdebug(DEBUG_WARN, "PCCC command failed, response code: %d - %s",pccc->pccc_status, pccc_decode_error(*data));
             rc = PLCTAG_ERR_REMOTE_ERR;
@@ -603,15 +955,5 @@ static int check_write_status(ab_tag_p tag)
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    /* clean up the request */
-    //session_remove_request(tag->session, req);
-    request_release(req);
-    tag->reqs[0] = NULL;
-
-    tag->write_in_progress = 0;
-
-    pdebug(DEBUG_WARN,"Done.");
-
-    /* Success! */
     return rc;
 }
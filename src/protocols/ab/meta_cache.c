@@ -0,0 +1,599 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <platform.h>
+#include <lib/libplctag.h>
+#include <ab/ab_common.h>
+#include <ab/eip_cip.h>
+#include <ab/meta_cache.h>
+#include <ab/tag.h>
+#include <util/attr.h>
+#include <util/debug.h>
+
+
+#define META_CACHE_HEADER "libplctag-metadata"
+#define MAX_META_CACHE_LINE (2048)
+
+typedef struct meta_cache_t *meta_cache_p;
+
+struct meta_cache_t {
+    meta_cache_p next;
+
+    char file_name[MAX_META_CACHE_FILE_NAME];
+    int dirty;
+
+    meta_cache_entry_p entries;
+};
+
+
+/* all protected by the cache mutex */
+static meta_cache_p meta_caches = NULL;
+static mutex_p meta_cache_mut = NULL;
+
+/* only used by the reconnect thread */
+static int64_t next_flush_time = 0;
+
+
+static meta_cache_p find_or_load_cache_unsafe(const char *file_name);
+static int load_cache_file(meta_cache_p cache);
+static int parse_entry(meta_cache_entry_p entry, char *line);
+static int write_cache_file(const char *file_name, meta_cache_entry_p entries, int num_entries);
+static meta_cache_entry_p find_cache_entry(meta_cache_p cache, const char *key);
+
+
+
+int meta_cache_init(void)
+{
+    return mutex_create(&meta_cache_mut);
+}
+
+
+
+/* the IO and reconnect threads must be stopped before this is called. */
+void meta_cache_teardown(void)
+{
+    if(!meta_cache_mut) {
+        return;
+    }
+
+    meta_cache_flush(1);
+
+    critical_block(meta_cache_mut) {
+        while(meta_caches) {
+            meta_cache_p cache = meta_caches;
+
+            meta_caches = cache->next;
+
+            while(cache->entries) {
+                meta_cache_entry_p entry = cache->entries;
+
+                cache->entries = entry->next;
+                mem_free(entry);
+            }
+
+            mem_free(cache);
+        }
+    }
+
+    mutex_destroy(&meta_cache_mut);
+}
+
+
+
+/*
+ * meta_cache_attach
+ *
+ * If the tag has the metadata_cache attribute, find its entry in the
+ * cache file, creating the entry if needed.  If the entry is usable,
+ * the tag skips its discovery read.
+ *
+ * The cache is an optimization.  Problems with it are logged and the
+ * tag carries on without it.
+ */
+
+int meta_cache_attach(ab_tag_p tag, attr attribs)
+{
+    const char *file_name = attr_get_str(attribs, "metadata_cache", NULL);
+    const char *path = attr_get_str(attribs, "path", "");
+    char key[MAX_META_CACHE_KEY];
+    meta_cache_p cache = NULL;
+    meta_cache_entry_p entry = NULL;
+    int read_req_sizes[MAX_META_CACHE_READ_REQUESTS];
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int num_read_requests = 0;
+    int type_info_size = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    if(!file_name || !meta_cache_mut) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(str_length(file_name) >= MAX_META_CACHE_FILE_NAME) {
+        pdebug(DEBUG_WARN, "Metadata cache file name is too long!");
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = snprintf_platform(key, sizeof(key), "%s/%s/%s/%d", attr_get_str(attribs, "gateway", ""), path, attr_get_str(attribs, "name", ""), tag->elem_count);
+
+    if(rc < 0 || rc >= (int)sizeof(key)) {
+        pdebug(DEBUG_WARN, "Metadata cache key is too long!");
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* the key is the rest of a line in the file. */
+    for(i=0; key[i]; i++) {
+        if(key[i] == '\n' || key[i] == '\r') {
+            pdebug(DEBUG_WARN, "Tag attributes cannot be used as a metadata cache key.");
+            return PLCTAG_STATUS_OK;
+        }
+    }
+
+    critical_block(meta_cache_mut) {
+        cache = find_or_load_cache_unsafe(file_name);
+
+        if(!cache) {
+            break;
+        }
+
+        entry = find_cache_entry(cache, key);
+
+        if(!entry) {
+            entry = (meta_cache_entry_p)mem_alloc(sizeof(struct meta_cache_entry_t));
+
+            if(!entry) {
+                break;
+            }
+
+            mem_copy(entry->key, key, str_length(key) + 1);
+            entry->cache = cache;
+            entry->next = cache->entries;
+            cache->entries = entry;
+        }
+
+        tag->meta_cache_entry = entry;
+
+        if(entry->size == tag->size && entry->num_read_requests > 0) {
+            num_read_requests = entry->num_read_requests;
+            mem_copy(read_req_sizes, entry->read_req_sizes, num_read_requests * (int)sizeof(int));
+            type_info_size = entry->type_info_size;
+            mem_copy(type_info, entry->type_info, type_info_size);
+        }
+    }
+
+    if(!num_read_requests) {
+        pdebug(DEBUG_DETAIL, "No usable metadata cached for %s.", key);
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = eip_cip_tag_set_read_plan(tag, read_req_sizes, num_read_requests, type_info, type_info_size);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to use cached metadata for %s, rc=%d.", key, rc);
+        return PLCTAG_STATUS_OK;
+    }
+
+    tag->read_plan = READ_PLAN_KNOWN;
+
+    pdebug(DEBUG_INFO, "Using cached metadata for %s.", key);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * meta_cache_update
+ *
+ * Called when a tag has learned its read plan and type.  The entry is
+ * only marked for writing if something changed.
+ */
+
+void meta_cache_update(ab_tag_p tag)
+{
+    meta_cache_entry_p entry = tag->meta_cache_entry;
+    int num_read_requests = tag->num_read_requests;
+
+    if(!entry) {
+        return;
+    }
+
+    /* plans that do not fit are not cached. */
+    if(num_read_requests > MAX_META_CACHE_READ_REQUESTS) {
+        num_read_requests = 0;
+    }
+
+    critical_block(meta_cache_mut) {
+        if(entry->size == tag->size
+           && entry->num_read_requests == num_read_requests
+           && entry->type_info_size == tag->encoded_type_info_size
+           && mem_cmp(entry->read_req_sizes, tag->read_req_sizes, num_read_requests * (int)sizeof(int)) == 0
+           && mem_cmp(entry->type_info, tag->encoded_type_info, entry->type_info_size) == 0) {
+            break;
+        }
+
+        entry->size = tag->size;
+        entry->num_read_requests = num_read_requests;
+        mem_copy(entry->read_req_sizes, tag->read_req_sizes, num_read_requests * (int)sizeof(int));
+        entry->type_info_size = tag->encoded_type_info_size;
+        mem_copy(entry->type_info, tag->encoded_type_info, entry->type_info_size);
+
+        entry->cache->dirty = 1;
+    }
+}
+
+
+
+/*
+ * meta_cache_flush
+ *
+ * Write out the cache files that changed.  The reconnect thread calls
+ * this often, but it only does anything every META_CACHE_FLUSH_INTERVAL_MS
+ * unless forced.
+ *
+ * The entries of each changed file are copied with the mutex held and
+ * the file is written without it, so tags are not held up by the disk.
+ * Caches are only freed by meta_cache_teardown() after the reconnect
+ * thread has stopped, so the list can be walked between locks.
+ */
+
+void meta_cache_flush(int force)
+{
+    meta_cache_p cache = NULL;
+    meta_cache_p next_cache = NULL;
+    meta_cache_entry_p entries = NULL;
+    meta_cache_entry_p entry = NULL;
+    int num_entries = 0;
+    int snapshot = 0;
+
+    if(!meta_cache_mut || (!force && time_ms() < next_flush_time)) {
+        return;
+    }
+
+    next_flush_time = time_ms() + META_CACHE_FLUSH_INTERVAL_MS;
+
+    critical_block(meta_cache_mut) {
+        cache = meta_caches;
+    }
+
+    for(; cache; cache = next_cache) {
+        snapshot = 0;
+        num_entries = 0;
+
+        critical_block(meta_cache_mut) {
+            next_cache = cache->next;
+
+            if(!cache->dirty) {
+                break;
+            }
+
+            for(entry = cache->entries; entry; entry = entry->next) {
+                num_entries++;
+            }
+
+            entries = (meta_cache_entry_p)mem_alloc((num_entries + 1) * (int)sizeof(struct meta_cache_entry_t));
+
+            if(!entries) {
+                pdebug(DEBUG_WARN, "Unable to allocate memory to write metadata cache file %s!", cache->file_name);
+                break;
+            }
+
+            num_entries = 0;
+
+            for(entry = cache->entries; entry; entry = entry->next) {
+                entries[num_entries] = *entry;
+                num_entries++;
+            }
+
+            cache->dirty = 0;
+            snapshot = 1;
+        }
+
+        if(!snapshot) {
+            continue;
+        }
+
+        /* try again on the next flush if the write failed. */
+        if(write_cache_file(cache->file_name, entries, num_entries) != PLCTAG_STATUS_OK) {
+            critical_block(meta_cache_mut) {
+                cache->dirty = 1;
+            }
+        }
+
+        mem_free(entries);
+        entries = NULL;
+    }
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+meta_cache_p find_or_load_cache_unsafe(const char *file_name)
+{
+    meta_cache_p cache = meta_caches;
+
+    while(cache && str_cmp(cache->file_name, file_name) != 0) {
+        cache = cache->next;
+    }
+
+    if(cache) {
+        return cache;
+    }
+
+    cache = (meta_cache_p)mem_alloc(sizeof(struct meta_cache_t));
+
+    if(!cache) {
+        pdebug(DEBUG_ERROR, "Unable to allocate metadata cache!");
+        return NULL;
+    }
+
+    mem_copy(cache->file_name, (void *)file_name, str_length(file_name) + 1);
+
+    load_cache_file(cache);
+
+    cache->next = meta_caches;
+    meta_caches = cache;
+
+    return cache;
+}
+
+
+
+/*
+ * load_cache_file
+ *
+ * The file is text.  The first line is the header and version.  Each
+ * following line is one entry:
+ *
+ *     size type_info_hex num_requests request_size... key
+ *
+ * The type info is "-" if empty.  A file with another version or a bad
+ * line is ignored from that point on and rewritten on the next flush.
+ */
+
+int load_cache_file(meta_cache_p cache)
+{
+    FILE *f = NULL;
+    char line[MAX_META_CACHE_LINE];
+    int version = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    f = fopen(cache->file_name, "r");
+
+    if(!f) {
+        pdebug(DEBUG_INFO, "No metadata cache file %s yet.", cache->file_name);
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(!fgets(line, sizeof(line), f)
+       || str_cmp_i_n(line, META_CACHE_HEADER, str_length(META_CACHE_HEADER)) != 0
+       || (version = (int)strtol(line + str_length(META_CACHE_HEADER), NULL, 10)) != META_CACHE_VERSION) {
+        pdebug(DEBUG_WARN, "Metadata cache file %s is not version %d, ignoring it.", cache->file_name, META_CACHE_VERSION);
+        fclose(f);
+        cache->dirty = 1;
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        meta_cache_entry_p entry = (meta_cache_entry_p)mem_alloc(sizeof(struct meta_cache_entry_t));
+
+        if(!entry) {
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        rc = parse_entry(entry, line);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Bad line in metadata cache file %s.", cache->file_name);
+            mem_free(entry);
+            cache->dirty = 1;
+            break;
+        }
+
+        entry->cache = cache;
+        entry->next = cache->entries;
+        cache->entries = entry;
+    }
+
+    fclose(f);
+
+    return rc;
+}
+
+
+
+int parse_entry(meta_cache_entry_p entry, char *line)
+{
+    char *p = line;
+    char *np = NULL;
+    int key_len = 0;
+    int i;
+
+    entry->size = (int)strtol(p, &np, 10);
+
+    if(np == p || entry->size <= 0) {
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    p = np;
+
+    while(*p == ' ') {
+        p++;
+    }
+
+    /* type info in hex */
+    if(*p == '-') {
+        p++;
+    } else {
+        while(*p && *p != ' ') {
+            char hex[3] = { 0, 0, 0 };
+
+            if(!p[1] || entry->type_info_size >= MAX_TAG_TYPE_INFO) {
+                return PLCTAG_ERR_BAD_DATA;
+            }
+
+            hex[0] = p[0];
+            hex[1] = p[1];
+            entry->type_info[entry->type_info_size] = (uint8_t)strtol(hex, &np, 16);
+
+            if(np != hex + 2) {
+                return PLCTAG_ERR_BAD_DATA;
+            }
+
+            entry->type_info_size++;
+            p += 2;
+        }
+    }
+
+    entry->num_read_requests = (int)strtol(p, &np, 10);
+
+    if(np == p || entry->num_read_requests <= 0 || entry->num_read_requests > MAX_META_CACHE_READ_REQUESTS) {
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    p = np;
+
+    for(i=0; i < entry->num_read_requests; i++) {
+        entry->read_req_sizes[i] = (int)strtol(p, &np, 10);
+
+        if(np == p || entry->read_req_sizes[i] <= 0) {
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        p = np;
+    }
+
+    /* the rest of the line is the key */
+    while(*p == ' ') {
+        p++;
+    }
+
+    while(p[key_len] && p[key_len] != '\n' && p[key_len] != '\r') {
+        key_len++;
+    }
+
+    if(!key_len || key_len >= MAX_META_CACHE_KEY) {
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    mem_copy(entry->key, p, key_len);
+    entry->key[key_len] = 0;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * write_cache_file
+ *
+ * Write a copy of the entries to a temporary file and rename it over the
+ * old one so that a crash does not leave a half written cache.
+ */
+
+int write_cache_file(const char *file_name, meta_cache_entry_p entries, int num_entries)
+{
+    char tmp_name[MAX_META_CACHE_FILE_NAME + 8];
+    meta_cache_entry_p entry = NULL;
+    FILE *f = NULL;
+    int ok = 1;
+    int i;
+
+    snprintf_platform(tmp_name, sizeof(tmp_name), "%s.tmp", file_name);
+
+    f = fopen(tmp_name, "w");
+
+    if(!f) {
+        pdebug(DEBUG_WARN, "Unable to write metadata cache file %s!", tmp_name);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    ok = (fprintf(f, "%s %d\n", META_CACHE_HEADER, META_CACHE_VERSION) > 0);
+
+    for(entry = entries; entry < entries + num_entries && ok; entry++) {
+        if(!entry->num_read_requests) {
+            continue;
+        }
+
+        ok = (fprintf(f, "%d ", entry->size) > 0);
+
+        if(!entry->type_info_size) {
+            ok = ok && (fprintf(f, "-") > 0);
+        }
+
+        for(i=0; i < entry->type_info_size && ok; i++) {
+            ok = (fprintf(f, "%02x", entry->type_info[i]) > 0);
+        }
+
+        ok = ok && (fprintf(f, " %d", entry->num_read_requests) > 0);
+
+        for(i=0; i < entry->num_read_requests && ok; i++) {
+            ok = (fprintf(f, " %d", entry->read_req_sizes[i]) > 0);
+        }
+
+        ok = ok && (fprintf(f, " %s\n", entry->key) > 0);
+    }
+
+    if(fclose(f) != 0) {
+        ok = 0;
+    }
+
+    if(!ok) {
+        pdebug(DEBUG_WARN, "Error writing metadata cache file %s!", tmp_name);
+        remove(tmp_name);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    /* Windows will not rename over an existing file. */
+    if(rename(tmp_name, file_name) != 0) {
+        remove(file_name);
+
+        if(rename(tmp_name, file_name) != 0) {
+            pdebug(DEBUG_WARN, "Unable to replace metadata cache file %s!", file_name);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Wrote metadata cache file %s.", file_name);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+meta_cache_entry_p find_cache_entry(meta_cache_p cache, const char *key)
+{
+    meta_cache_entry_p entry = cache->entries;
+
+    while(entry && str_cmp(entry->key, key) != 0) {
+        entry = entry->next;
+    }
+
+    return entry;
+}
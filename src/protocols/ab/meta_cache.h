@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PLCTAG_AB_META_CACHE_H__
+#define __PLCTAG_AB_META_CACHE_H__ 1
+
+#include <ab/ab_common.h>
+#include <ab/tag.h>
+#include <util/attr.h>
+
+/*
+ * The first read of a CIP tag single-steps through the fragments to
+ * learn how much data the PLC sends in each reply and what the type of
+ * the tag is.  With thousands of tags that takes a long time after each
+ * restart.
+ *
+ * The metadata cache keeps what was learned in a file named by the
+ * "metadata_cache" tag attribute, keyed by gateway, path, name and
+ * element count.  Tags found in the file start with pipelined reads and
+ * can write without reading first.  An entry that no longer matches the
+ * PLC makes the tag fall back to discovery and is then updated.
+ *
+ * The reconnect thread writes changed files every
+ * META_CACHE_FLUSH_INTERVAL_MS so the IO thread never waits on the disk.
+ * They are also written when the library shuts down.
+ */
+
+#define META_CACHE_VERSION (1)
+#define META_CACHE_FLUSH_INTERVAL_MS (5000)
+
+#define MAX_META_CACHE_FILE_NAME (256)
+#define MAX_META_CACHE_KEY (512)
+#define MAX_META_CACHE_READ_REQUESTS (64)
+
+typedef struct meta_cache_entry_t *meta_cache_entry_p;
+
+struct meta_cache_entry_t {
+    meta_cache_entry_p next;
+    struct meta_cache_t *cache;
+
+    char key[MAX_META_CACHE_KEY];
+
+    int size;
+    uint8_t type_info[MAX_TAG_TYPE_INFO];
+    int type_info_size;
+    int num_read_requests;
+    int read_req_sizes[MAX_META_CACHE_READ_REQUESTS];
+};
+
+extern int meta_cache_init(void);
+extern void meta_cache_teardown(void);
+extern int meta_cache_attach(ab_tag_p tag, attr attribs);
+extern void meta_cache_update(ab_tag_p tag);
+extern void meta_cache_flush(int force);
+
+#endif
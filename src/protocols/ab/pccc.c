@@ -31,6 +31,8 @@
 #include <platform.h>
 #include <ab/ab_common.h>
 #include <ab/pccc.h>
+#include <ab/tag.h>
+#include <ab/eip.h>
 #include <util/debug.h>
 
 
@@ -177,6 +179,175 @@ int pccc_encode_tag_name(uint8_t *data, int *size, const char *name, int max_tag
 
 
 
+/*
+ * pccc_plan_requests
+ *
+ * Work out how many elements go in each request.  If all the elements
+ * fit, that is all of them.  Otherwise leave room for the element
+ * number to grow when the later requests address further into the file.
+ */
+
+int pccc_plan_requests(int name_size, int elem_count, int elem_size, int extra_overhead, int *elems_per_request)
+{
+    int data_per_packet;
+    int overhead;
+
+    /* how many packets will we need? How much overhead? */
+    overhead = sizeof(pccc_resp) + 4 + name_size + extra_overhead; /* MAGIC 4 = fudge */
+
+    data_per_packet = MAX_PCCC_PACKET_SIZE - overhead;
+
+    if(data_per_packet <= 0) {
+        pdebug(DEBUG_WARN,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    if(data_per_packet >= elem_count * elem_size) {
+        *elems_per_request = elem_count;
+        return PLCTAG_STATUS_OK;
+    }
+
+    *elems_per_request = (data_per_packet - 2) / elem_size; /* MAGIC 2 = longer element number */
+
+    if(*elems_per_request <= 0) {
+        pdebug(DEBUG_WARN,"Elements of %d bytes are too large for a packet.", elem_size);
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    pdebug(DEBUG_DETAIL,"Splitting into requests of %d elements.", *elems_per_request);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/*
+ * pccc_decode_file_element
+ *
+ * Get the file and element numbers out of a name encoded by
+ * pccc_encode_tag_name.  Returns zero if the name is not a plain
+ * file and element, for instance if it has a sub-element.
+ */
+
+int pccc_decode_file_element(const uint8_t *encoded_name, int encoded_name_size, int *file_num, int *elem_num)
+{
+    int index = 1;
+    int level;
+
+    if(!encoded_name || encoded_name_size < 3) {
+        return 0;
+    }
+
+    /* there must be a file and an element and no sub-element. */
+    if((encoded_name[0] & 0x0E) != 0x06) {
+        return 0;
+    }
+
+    for(level = 0; level < 2; level++) {
+        int num;
+
+        if(index >= encoded_name_size) {
+            return 0;
+        }
+
+        if(encoded_name[index] == 0xff) {
+            if(index + 3 > encoded_name_size) {
+                return 0;
+            }
+
+            num = (int)encoded_name[index + 1] + ((int)encoded_name[index + 2] << 8);
+            index += 3;
+        } else {
+            num = encoded_name[index];
+            index++;
+        }
+
+        if(level == 0) {
+            *file_num = num;
+        } else {
+            *elem_num = num;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * pccc_encode_file_element
+ *
+ * Encode a plain file and element address the same way that
+ * pccc_encode_tag_name does.  The buffer needs room for seven bytes.
+ */
+
+int pccc_encode_file_element(uint8_t *data, int *size, int file_num, int elem_num)
+{
+    int nums[2];
+    int i;
+
+    if(!data || !size || file_num < 0 || file_num > 65535 || elem_num < 0 || elem_num > 65535) {
+        return 0;
+    }
+
+    nums[0] = file_num;
+    nums[1] = elem_num;
+
+    data[0] = 0x06;
+    *size = 1;
+
+    for(i = 0; i < 2; i++) {
+        if(nums[i] <= 254) {
+            data[*size] = (uint8_t)nums[i];
+            *size = *size + 1;
+        } else {
+            data[*size] = (uint8_t)0xff;
+            data[*size + 1] = (uint8_t)(nums[i] & 0xff);
+            data[*size + 2] = (uint8_t)((nums[i] >> 8) & 0xff);
+            *size = *size + 3;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * pccc_encode_element_offset
+ *
+ * Copy a name encoded by pccc_encode_tag_name, moving the element number
+ * up by elem_offset.  This addresses a later part of the same data file.
+ * The buffer must have room for the name plus two bytes as the element
+ * number can grow from one byte to three.  Names with a sub-element
+ * cannot be moved.  An offset of zero copies any name unchanged.
+ */
+
+int pccc_encode_element_offset(uint8_t *data, int *size, const uint8_t *encoded_name, int encoded_name_size, int elem_offset)
+{
+    int file_num = 0;
+    int elem_num = 0;
+
+    if(!data || !size || !encoded_name || encoded_name_size < 3) {
+        return 0;
+    }
+
+    if(!elem_offset) {
+        mem_copy(data, (void*)encoded_name, encoded_name_size);
+        *size = encoded_name_size;
+        return 1;
+    }
+
+    if(!pccc_decode_file_element(encoded_name, encoded_name_size, &file_num, &elem_num)) {
+        return 0;
+    }
+
+    return pccc_encode_file_element(data, size, file_num, elem_num + elem_offset);
+}
+
+
+
 
 
 uint8_t pccc_calculate_bcc(uint8_t *data,int size)
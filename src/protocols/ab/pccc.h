@@ -32,11 +32,19 @@
 #include <lib/libplctag.h>
 #include <lib/libplctag_tag.h>
 #include <platform.h>
+#include <ab/ab_common.h>
 
 
 #define AB_PCCC_
 
+/* room for the data type fields of a write. */
+#define PCCC_WRITE_TYPE_SIZE (8)
+
 int pccc_encode_tag_name(uint8_t *data, int *size, const char *name, int max_tag_name_size);
+int pccc_plan_requests(int name_size, int elem_count, int elem_size, int extra_overhead, int *elems_per_request);
+int pccc_decode_file_element(const uint8_t *encoded_name, int encoded_name_size, int *file_num, int *elem_num);
+int pccc_encode_file_element(uint8_t *data, int *size, int file_num, int elem_num);
+int pccc_encode_element_offset(uint8_t *data, int *size, const uint8_t *encoded_name, int encoded_name_size, int elem_offset);
 uint8_t pccc_calculate_bcc(uint8_t *data,int size);
 uint16_t pccc_calculate_crc16(uint8_t *data, int size);
 const char *pccc_decode_error(int error);
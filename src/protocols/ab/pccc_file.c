@@ -0,0 +1,591 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <platform.h>
+#include <lib/libplctag.h>
+#include <ab/ab_common.h>
+#include <ab/pccc.h>
+#include <ab/pccc_file.h>
+#include <ab/request.h>
+#include <ab/session.h>
+#include <ab/tag.h>
+#include <util/debug.h>
+
+
+static ab_pccc_file_p find_file_unsafe(ab_session_p session, ab_tag_p tag, int file_num);
+static void update_range_unsafe(ab_pccc_file_p file);
+static int responses_in_unsafe(ab_pccc_file_p file);
+static void finish_read_unsafe(ab_pccc_file_p file, pccc_file_decode_func decode);
+static void release_requests_unsafe(ab_pccc_file_p file);
+static void destroy_file_unsafe(ab_pccc_file_p file);
+static int copy_if_fresh_unsafe(ab_tag_p tag);
+static void copy_to_tag_unsafe(ab_tag_p tag);
+
+
+
+/*
+ * pccc_file_attach
+ *
+ * Find or create the block for the tag's data file and add the tag's
+ * elements to it.  A tag that cannot share a block is left alone and
+ * reads on its own.
+ */
+
+int pccc_file_attach(ab_tag_p tag)
+{
+    ab_session_p session = tag->session;
+    ab_pccc_file_p file = NULL;
+    int file_num = 0;
+    int elem_num = 0;
+    int last_elem;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!session || !tag->data) {
+        pdebug(DEBUG_WARN, "Only tags with a session and a data buffer can share a data file read.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(!pccc_decode_file_element(tag->encoded_name, tag->encoded_name_size, &file_num, &elem_num)) {
+        pdebug(DEBUG_INFO, "Tag address is not a plain file and element, reading it on its own.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    last_elem = elem_num + tag->elem_count - 1;
+
+    if(last_elem > 65535) {
+        pdebug(DEBUG_WARN, "Tag runs past the end of the largest data file!");
+        return PLCTAG_STATUS_OK;
+    }
+
+    critical_block(global_session_mut) {
+        file = find_file_unsafe(session, tag, file_num);
+
+        if(!file) {
+            file = (ab_pccc_file_p)mem_alloc(sizeof(struct ab_pccc_file_t));
+
+            if(!file) {
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            mem_copy(file->conn_path, tag->conn_path, tag->conn_path_size);
+            file->conn_path_size = tag->conn_path_size;
+            file->file_num = file_num;
+            file->elem_size = tag->elem_size;
+
+            file->next = session->pccc_files;
+            session->pccc_files = file;
+        }
+
+        tag->pccc_file = file;
+        tag->pccc_file_elem = elem_num;
+
+        tag->pccc_file_next = file->tags;
+        file->tags = tag;
+        file->ref_count++;
+
+        update_range_unsafe(file);
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_INFO, "Tag shares reads of file %d, elements %d to %d.", file_num, file->first_elem, file->last_elem);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * pccc_file_detach
+ *
+ * Remove the tag from its block.  The block shrinks to the elements of
+ * the remaining tags and is freed with its last tag.
+ */
+
+void pccc_file_detach(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+
+    if(!file) {
+        return;
+    }
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    critical_block(global_session_mut) {
+        ab_tag_p *tag_walker = &(file->tags);
+
+        while(*tag_walker && *tag_walker != tag) {
+            tag_walker = &((*tag_walker)->pccc_file_next);
+        }
+
+        if(*tag_walker) {
+            *tag_walker = tag->pccc_file_next;
+        }
+
+        file->ref_count--;
+
+        if(file->ref_count > 0) {
+            update_range_unsafe(file);
+            break;
+        }
+
+        if(tag->session) {
+            ab_pccc_file_p *walker = &(tag->session->pccc_files);
+
+            while(*walker && *walker != file) {
+                walker = &((*walker)->next);
+            }
+
+            if(*walker) {
+                *walker = file->next;
+            }
+        }
+
+        destroy_file_unsafe(file);
+    }
+
+    tag->pccc_file = NULL;
+    tag->pccc_file_next = NULL;
+    tag->pccc_file_wait = 0;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+}
+
+
+
+/*
+ * pccc_file_read_start
+ *
+ * Start a read of a tag that shares a block.  If the block data is new
+ * to this tag, the tag gets it now and this returns OK.  If the block is
+ * being read, the tag waits for it, see pccc_file_check_wait().  Shortly
+ * after a failed block read this returns PLCTAG_ERR_NO_DATA and the tag
+ * must read its own elements.
+ *
+ * Otherwise this starts a block read and sets *read_block.  The caller
+ * sends requests for data_elem_count elements from data_first_elem and
+ * hands them to pccc_file_read_sent(), or calls pccc_file_read_failed().
+ */
+
+int pccc_file_read_start(ab_tag_p tag, int *read_block)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    *read_block = 0;
+
+    critical_block(global_session_mut) {
+        int elem_count;
+
+        if(file->read_in_flight) {
+            pdebug(DEBUG_DETAIL, "Waiting for the block read in flight.");
+            tag->pccc_file_wait = 1;
+            rc = PLCTAG_STATUS_PENDING;
+            break;
+        }
+
+        if(copy_if_fresh_unsafe(tag)) {
+            pdebug(DEBUG_DETAIL, "Using the block data.");
+            rc = PLCTAG_STATUS_OK;
+            break;
+        }
+
+        if(time_ms() < file->retry_time) {
+            pdebug(DEBUG_DETAIL, "Block reads failed recently, reading the tag on its own.");
+            rc = PLCTAG_ERR_NO_DATA;
+            break;
+        }
+
+        /* make the buffer match the elements the tags use now. */
+        elem_count = file->last_elem - file->first_elem + 1;
+
+        if(!file->data || file->data_first_elem != file->first_elem || file->data_elem_count != elem_count) {
+            uint8_t *data = (uint8_t*)mem_alloc(elem_count * file->elem_size);
+
+            if(!data) {
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            if(file->data) {
+                mem_free(file->data);
+            }
+
+            file->data = data;
+            file->data_first_elem = file->first_elem;
+            file->data_elem_count = elem_count;
+        }
+
+        file->data_valid = 0;
+        file->discard = 0;
+        file->read_in_flight = 1;
+
+        tag->pccc_file_wait = 1;
+        *read_block = 1;
+        rc = PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * pccc_file_read_sent
+ *
+ * Hand the requests of a block read to the block.  The block owns the
+ * arrays and the requests from now on.
+ */
+
+void pccc_file_read_sent(ab_tag_p tag, ab_request_p *reqs, int *req_sizes, int num_reqs)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+
+    critical_block(global_session_mut) {
+        file->reqs = reqs;
+        file->req_sizes = req_sizes;
+        file->num_reqs = num_reqs;
+    }
+}
+
+
+
+/*
+ * pccc_file_read_failed
+ *
+ * The block read could not be sent.  The tags read on their own for a
+ * while.
+ */
+
+void pccc_file_read_failed(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+
+    critical_block(global_session_mut) {
+        file->read_in_flight = 0;
+        file->data_valid = 0;
+        file->retry_time = time_ms() + PCCC_FILE_RETRY_MS;
+    }
+
+    tag->pccc_file_wait = 0;
+}
+
+
+
+/*
+ * pccc_file_check_wait
+ *
+ * Check on a tag waiting for the block read.  If all the responses are
+ * in, this tag finishes the block read, whichever tag started it.
+ * Returns PLCTAG_ERR_NO_DATA if the read finished without data for this
+ * tag, for instance because it failed.  The tag must then read its own
+ * elements.
+ */
+
+int pccc_file_check_wait(ab_tag_p tag, pccc_file_decode_func decode)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+    int rc = PLCTAG_ERR_NO_DATA;
+
+    critical_block(global_session_mut) {
+        if(file->read_in_flight) {
+            if(!responses_in_unsafe(file)) {
+                rc = PLCTAG_STATUS_PENDING;
+                break;
+            }
+
+            finish_read_unsafe(file, decode);
+        }
+
+        tag->pccc_file_wait = 0;
+
+        if(copy_if_fresh_unsafe(tag)) {
+            rc = PLCTAG_STATUS_OK;
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * pccc_file_abort
+ *
+ * Stop waiting for the block.  The block read goes on for the other tags.
+ */
+
+void pccc_file_abort(ab_tag_p tag)
+{
+    tag->pccc_file_wait = 0;
+}
+
+
+
+/*
+ * pccc_file_invalidate
+ *
+ * The tag wrote to the file, so the block data is old.
+ */
+
+void pccc_file_invalidate(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+
+    if(!file) {
+        return;
+    }
+
+    critical_block(global_session_mut) {
+        file->data_valid = 0;
+
+        if(file->read_in_flight) {
+            file->discard = 1;
+        }
+    }
+}
+
+
+
+void pccc_file_destroy_all(ab_pccc_file_p files)
+{
+    while(files) {
+        ab_pccc_file_p next = files->next;
+
+        destroy_file_unsafe(files);
+
+        files = next;
+    }
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+ab_pccc_file_p find_file_unsafe(ab_session_p session, ab_tag_p tag, int file_num)
+{
+    ab_pccc_file_p file = session->pccc_files;
+
+    while(file && (file->file_num != file_num ||
+                   file->elem_size != tag->elem_size ||
+                   file->conn_path_size != tag->conn_path_size ||
+                   mem_cmp(file->conn_path, tag->conn_path, tag->conn_path_size) != 0)) {
+        file = file->next;
+    }
+
+    return file;
+}
+
+
+
+/*
+ * cover exactly the elements of the tags using the block.  The data
+ * buffer follows at the next block read.
+ */
+
+void update_range_unsafe(ab_pccc_file_p file)
+{
+    ab_tag_p tag = file->tags;
+
+    if(!tag) {
+        return;
+    }
+
+    file->first_elem = tag->pccc_file_elem;
+    file->last_elem = tag->pccc_file_elem + tag->elem_count - 1;
+
+    for(tag = tag->pccc_file_next; tag; tag = tag->pccc_file_next) {
+        if(tag->pccc_file_elem < file->first_elem) {
+            file->first_elem = tag->pccc_file_elem;
+        }
+
+        if(tag->pccc_file_elem + tag->elem_count - 1 > file->last_elem) {
+            file->last_elem = tag->pccc_file_elem + tag->elem_count - 1;
+        }
+    }
+}
+
+
+
+/*
+ * the block read is over when every response is in or the IO thread
+ * gave up on any request.
+ */
+
+int responses_in_unsafe(ab_pccc_file_p file)
+{
+    int i;
+
+    /* still being sent. */
+    if(!file->reqs) {
+        return 0;
+    }
+
+    for(i = 0; i < file->num_reqs; i++) {
+        if(file->reqs[i]->status != PLCTAG_STATUS_OK) {
+            return 1;
+        }
+    }
+
+    for(i = 0; i < file->num_reqs; i++) {
+        if(!file->reqs[i]->resp_received) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+void finish_read_unsafe(ab_pccc_file_p file, pccc_file_decode_func decode)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int byte_offset = 0;
+    int i;
+
+    for(i = 0; i < file->num_reqs && rc == PLCTAG_STATUS_OK; i++) {
+        rc = file->reqs[i]->status;
+
+        if(rc == PLCTAG_STATUS_OK && byte_offset + file->req_sizes[i] > file->data_elem_count * file->elem_size) {
+            pdebug(DEBUG_WARN, "Block data does not fit!");
+            rc = PLCTAG_ERR_TOO_LONG;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = decode(file->reqs[i], file->data + byte_offset, file->req_sizes[i]);
+        }
+
+        byte_offset += file->req_sizes[i];
+    }
+
+    release_requests_unsafe(file);
+
+    file->read_in_flight = 0;
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Block read of file %d failed, tags read on their own for a while. rc=%d", file->file_num, rc);
+        file->data_valid = 0;
+        file->retry_time = time_ms() + PCCC_FILE_RETRY_MS;
+        return;
+    }
+
+    file->generation++;
+    file->data_time = time_ms();
+
+    /* a write while reading may have made the data old already. */
+    file->data_valid = !file->discard;
+}
+
+
+
+void release_requests_unsafe(ab_pccc_file_p file)
+{
+    int i;
+
+    if(file->reqs) {
+        for(i = 0; i < file->num_reqs; i++) {
+            /* if any activity is still happening, signal the IO thread to kill the request */
+            file->reqs[i]->abort_request = 1;
+            request_release(file->reqs[i]);
+        }
+
+        mem_free(file->reqs);
+        file->reqs = NULL;
+    }
+
+    if(file->req_sizes) {
+        mem_free(file->req_sizes);
+        file->req_sizes = NULL;
+    }
+
+    file->num_reqs = 0;
+}
+
+
+
+void destroy_file_unsafe(ab_pccc_file_p file)
+{
+    release_requests_unsafe(file);
+
+    if(file->data) {
+        mem_free(file->data);
+    }
+
+    mem_free(file);
+}
+
+
+
+/*
+ * copy the tag's part of the block if the block has data the tag has
+ * not used yet and that is recent enough.
+ */
+
+int copy_if_fresh_unsafe(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+
+    if(!file->data_valid || file->generation == tag->pccc_file_gen) {
+        return 0;
+    }
+
+    if(time_ms() - file->data_time > PCCC_FILE_MAX_AGE_MS) {
+        return 0;
+    }
+
+    if(tag->pccc_file_elem < file->data_first_elem ||
+       tag->pccc_file_elem + tag->elem_count > file->data_first_elem + file->data_elem_count) {
+        return 0;
+    }
+
+    copy_to_tag_unsafe(tag);
+
+    return 1;
+}
+
+
+
+void copy_to_tag_unsafe(ab_tag_p tag)
+{
+    ab_pccc_file_p file = tag->pccc_file;
+    int byte_offset = (tag->pccc_file_elem - file->data_first_elem) * file->elem_size;
+
+    if(tag->data && byte_offset >= 0 && byte_offset + tag->size <= file->data_elem_count * file->elem_size) {
+        mem_copy(tag->data, file->data + byte_offset, tag->size);
+    }
+
+    tag->pccc_file_gen = file->generation;
+}
@@ -0,0 +1,107 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PLCTAG_AB_PCCC_FILE_H__
+#define __PLCTAG_AB_PCCC_FILE_H__ 1
+
+#include <ab/ab_common.h>
+#include <ab/tag.h>
+
+/*
+ * PLC-5 and SLC programs often have one tag per element, N7:0, N7:1 and
+ * so on.  Tags created with file_cache=1 that address the same data file
+ * on the same PLC share one block read of the file.  The block covers
+ * every element used by its tags and is read again once per cycle: a tag
+ * that already used the current block data triggers a new block read,
+ * the other tags are served from the copy.  Tags that read while the
+ * block is being read wait for it.
+ *
+ * The block read belongs to the block, not to the tag that started it.
+ * Any waiting tag that finds all the responses in finishes it.  If the
+ * block read fails, each tag reads its own elements instead and the
+ * block is not read again for PCCC_FILE_RETRY_MS.
+ *
+ * Addresses with a sub-element, such as T4:0.ACC, and tags that only
+ * stream their data are not shared.
+ */
+
+/* block data older than this is read again.  In milliseconds. */
+#define PCCC_FILE_MAX_AGE_MS (1000)
+
+/* tags read on their own this long after a failed block read.  In milliseconds. */
+#define PCCC_FILE_RETRY_MS (5000)
+
+typedef struct ab_pccc_file_t *ab_pccc_file_p;
+
+struct ab_pccc_file_t {
+    ab_pccc_file_p next;
+
+    /* the PLC and data file of the block */
+    uint8_t conn_path[MAX_CONN_PATH];
+    int conn_path_size;
+    int file_num;
+    int elem_size;
+
+    /* the tags using the block, linked through pccc_file_next. */
+    ab_tag_p tags;
+    int ref_count;
+
+    /* the elements wanted by the tags. */
+    int first_elem;
+    int last_elem;
+
+    /* the elements in the data buffer, or being read into it. */
+    uint8_t *data;
+    int data_first_elem;
+    int data_elem_count;
+    int data_valid;
+    int64_t data_time;
+
+    /* bumped every time a block read finishes. */
+    uint32_t generation;
+
+    /*
+     * the block read in flight.  The requests are NULL while the tag
+     * that started the read is still building them.
+     */
+    int read_in_flight;
+    ab_request_p *reqs;
+    int *req_sizes;
+    int num_reqs;
+    int discard;
+
+    /* no block reads before this time after a failure. */
+    int64_t retry_time;
+};
+
+/* copy the data of a block read response, exactly size bytes, to data. */
+typedef int (*pccc_file_decode_func)(ab_request_p req, uint8_t *data, int size);
+
+extern int pccc_file_attach(ab_tag_p tag);
+extern void pccc_file_detach(ab_tag_p tag);
+extern int pccc_file_read_start(ab_tag_p tag, int *read_block);
+extern void pccc_file_read_sent(ab_tag_p tag, ab_request_p *reqs, int *req_sizes, int num_reqs);
+extern void pccc_file_read_failed(ab_tag_p tag);
+extern int pccc_file_check_wait(ab_tag_p tag, pccc_file_decode_func decode);
+extern void pccc_file_abort(ab_tag_p tag);
+extern void pccc_file_invalidate(ab_tag_p tag);
+extern void pccc_file_destroy_all(ab_pccc_file_p files);
+
+#endif
@@ -58,6 +58,7 @@ int request_create(ab_request_p* req)
 
         res->num_retries_left = 5; /* MAGIC */
         res->retry_interval = 900; /* MAGIC */
+        res->priority = PLCTAG_PRIORITY_NORMAL;
 
         *req = res;
     }
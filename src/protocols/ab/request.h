@@ -54,9 +54,21 @@ struct ab_request_t {
     int abort_after_send; /* for one shot packets */
     int no_resend; /* do not resend if this is set. */
     int connected_request; /* serialize this packet with respect to other serialized packets. */
+    int keepalive; /* does not count as activity on the session or connection. */
 
     int status;
 
+    /* scheduling, one of the PLCTAG_PRIORITY_* values */
+    int priority;
+    int64_t time_queued;
+
+    /* absolute time after which nobody wants the response, zero for none. */
+    int64_t deadline;
+
+    /* when the request was first held back by a rate limit and by which ones. */
+    int64_t time_rate_limited;
+    int rate_limited_by;
+
     /* used when processing a response */
     int processed;
 
@@ -70,6 +82,10 @@ struct ab_request_t {
     uint32_t conn_id;
     uint16_t conn_seq;
 
+    /* PCCC transaction number and where it is in the response, zero if not PCCC. */
+    uint16_t pccc_tns;
+    int pccc_tns_offset;
+
     /* time stamps for rate calculations */
     int64_t time_sent;
     int send_count;
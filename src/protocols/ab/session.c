@@ -32,6 +32,8 @@
 #include <ab/connection.h>
 #include <ab/request.h>
 #include <ab/eip.h>
+#include <ab/symbol.h>
+#include <ab/pccc_file.h>
 #include <util/debug.h>
 #include <stdlib.h>
 #include <time.h>
@@ -43,7 +45,7 @@ static int add_session_unsafe(ab_session_p n);
 //~ static int add_session(ab_session_p s);
 static int remove_session_unsafe(ab_session_p n);
 //~ static int remove_session(ab_session_p s);
-static ab_session_p find_session_by_host_unsafe(const char  *t);
+static ab_session_p find_session_by_host_unsafe(const char  *t, int num_sessions);
 //~ static int session_add_tag_unsafe(ab_session_p session, ab_tag_p tag);
 //~ static int session_add_tag(ab_session_p session, ab_tag_p tag);
 //~ static int session_remove_tag_unsafe(ab_session_p session, ab_tag_p tag);
@@ -91,6 +93,25 @@ uint64_t session_get_new_seq_id(ab_session_p sess)
 }
 
 
+/*
+ * session_get_new_pccc_tns
+ *
+ * Get the PCCC transaction number for a new unconnected PCCC request.
+ * The PLC sends it back in the response, see match_request_and_response().
+ */
+
+uint16_t session_get_new_pccc_tns(ab_session_p sess)
+{
+    uint16_t res = 0;
+
+    critical_block(global_session_mut) {
+        res = ++(sess->pccc_tns);
+    }
+
+    return res;
+}
+
+
 static int connection_is_usable(ab_connection_p connection)
 {
     if(!connection) {
@@ -110,11 +131,20 @@ static int connection_is_usable(ab_connection_p connection)
 
 
 
-ab_connection_p session_find_connection_by_path_unsafe(ab_session_p session,const char *path)
+/*
+ * session_find_connection_by_path_unsafe
+ *
+ * The usable connections with the same path form a pool of up to
+ * pool_size members.  If the pool is not full yet, return NULL so that
+ * the caller creates another member.  Otherwise return the member used
+ * by the fewest tags.
+ */
+
+ab_connection_p session_find_connection_by_path_unsafe(ab_session_p session,const char *path, int pool_size)
 {
     ab_connection_p connection;
-
-    connection = session->connections;
+    ab_connection_p best_connection = NULL;
+    int pool_count = 0;
 
     /*
      * there are a lot of conditions.
@@ -122,16 +152,29 @@ ab_connection_p session_find_connection_by_path_unsafe(ab_session_p session,cons
      * We do not want to use connections that are used exclusively by one tag.
      * We want to use connections that have the same path as the tag.
      */
-    while (connection && !connection_is_usable(connection) && str_cmp_i(connection->path, path) != 0) {
-        connection = connection->next;
+    for(connection = session->connections; connection; connection = connection->next) {
+        if(!connection_is_usable(connection) || str_cmp_i(connection->path, path) != 0) {
+            continue;
+        }
+
+        pool_count++;
+
+        if(!best_connection || refcount_get_count(&connection->rc) < refcount_get_count(&best_connection->rc)) {
+            best_connection = connection;
+        }
+    }
+
+    if(pool_count < pool_size) {
+        pdebug(DEBUG_DETAIL, "Connection pool has %d of %d members, adding one.", pool_count, pool_size);
+        return NULL;
     }
 
     /* add to the ref count since we found an existing one. */
-    if(connection) {
-        connection_acquire(connection);
+    if(best_connection) {
+        connection_acquire(best_connection);
     }
 
-    return connection;
+    return best_connection;
 }
 
 
@@ -232,6 +275,7 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
     ab_session_p session = AB_SESSION_NULL;
     int new_session = 0;
     int shared_session = attr_get_int(attribs, "share_session", 1); /* share the session by default. */
+    int num_sessions = attr_get_int(attribs, "sessions_per_gateway", 1);
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_DETAIL, "Starting");
@@ -239,7 +283,7 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
     critical_block(global_session_mut) {
         /* if we are to share sessions, then look for an existing one. */
         if (shared_session) {
-            session = find_session_by_host_unsafe(session_gw);
+            session = find_session_by_host_unsafe(session_gw, num_sessions);
         } else {
             /* no sharing, create a new one */
             session = AB_SESSION_NULL;
@@ -254,6 +298,18 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
                 rc = PLCTAG_ERR_BAD_GATEWAY;
             } else {
                 new_session = 1;
+
+                /* nobody else can use a session that is not shared. */
+                session->exclusive = !shared_session;
+
+                session->auto_reconnect = attr_get_int(attribs, "auto_reconnect", 1);
+                session->keepalive_ms = attr_get_int(attribs, "keepalive_ms", 0);
+                session->last_activity = time_ms();
+
+                /* the first tag to use the session sets its rate limit. */
+                rate_limit_init(&session->rate_limit,
+                                attr_get_int(attribs, "session_packet_rate", 0),
+                                attr_get_int(attribs, "session_byte_rate", 0));
             }
         } else {
             pdebug(DEBUG_DETAIL,"Reusing existing session.");
@@ -388,6 +444,10 @@ static int session_match_valid(const char *host, ab_session_p session)
         return 0;
     }
 
+    if(session->exclusive) {
+        return 0;
+    }
+
     if(str_cmp_i(host,session->host)) {
         return 0;
     }
@@ -396,26 +456,41 @@ static int session_match_valid(const char *host, ab_session_p session)
 }
 
 
-ab_session_p find_session_by_host_unsafe(const char* t)
+/*
+ * find_session_by_host_unsafe
+ *
+ * Tags to the same gateway are striped across up to num_sessions TCP
+ * sessions.  If there are fewer than that, return NULL so that the
+ * caller creates another one.  Otherwise return the session used by
+ * the fewest tags.
+ */
+
+ab_session_p find_session_by_host_unsafe(const char* t, int num_sessions)
 {
     ab_session_p tmp;
+    ab_session_p best = NULL;
+    int count = 0;
 
-    tmp = sessions;
+    for(tmp = sessions; tmp; tmp = tmp->next) {
+        if(!session_match_valid(t, tmp)) {
+            continue;
+        }
 
-    while (tmp && !session_match_valid(t, tmp)) {
-        tmp = tmp->next;
+        count++;
+
+        if(!best || refcount_get_count(&tmp->rc) < refcount_get_count(&best->rc)) {
+            best = tmp;
+        }
     }
 
-    if (!tmp) {
+    if (!best || count < num_sessions) {
         return (ab_session_p)NULL;
     }
 
-    if(tmp) {
-        /* found the session, so increase the ref count. */
-        refcount_acquire(&tmp->rc);
-    }
+    /* found the session, so increase the ref count. */
+    refcount_acquire(&best->rc);
 
-    return tmp;
+    return best;
 }
 
 
@@ -452,6 +527,7 @@ ab_session_p session_create_unsafe(const char* host, int gw_port)
     }
 
     session->session_seq_id =  rand();
+    session->pccc_tns = (uint16_t)rand();
 
     /*
      * Why is connection_id global?  Because it looks like the PLC might
@@ -616,6 +692,9 @@ void session_destroy(void *session_arg)
             req = session->requests;
         }
 
+        symbol_destroy_tables(session->symbols);
+        pccc_file_destroy_all(session->pccc_files);
+
         mem_free(session);
     }
 
@@ -809,6 +888,9 @@ int session_add_request_unsafe(ab_session_p sess, ab_request_p req)
     /* make sure the request points to the session */
     req->session = sess;
 
+    /* start the clock for priority aging. */
+    req->time_queued = time_ms();
+
     /* we add the request to the end of the list. */
     cur = sess->requests;
     prev = NULL;
@@ -951,3 +1033,358 @@ int session_release(ab_session_p session)
 
     return refcount_release(&session->rc);
 }
+
+
+
+
+/*
+ * session_reconnect_delay
+ *
+ * Exponential back off with jitter.
+ */
+
+int64_t session_reconnect_delay(int attempts)
+{
+    int64_t delay = SESSION_RECONNECT_MIN_DELAY_MS;
+
+    while(attempts > 0 && delay < SESSION_RECONNECT_MAX_DELAY_MS) {
+        delay *= 2;
+        attempts--;
+    }
+
+    if(delay > SESSION_RECONNECT_MAX_DELAY_MS) {
+        delay = SESSION_RECONNECT_MAX_DELAY_MS;
+    }
+
+    return (delay / 2) + (rand() % ((delay / 2) + 1));
+}
+
+
+
+/*
+ * session_fail_requests_unsafe
+ *
+ * Give up on all the queued requests.  The tags see the status the next
+ * time they check.
+ */
+
+void session_fail_requests_unsafe(ab_session_p session, int status)
+{
+    ab_request_p request = session->requests;
+
+    if(session->current_request) {
+        request_release(session->current_request);
+        session->current_request = NULL;
+    }
+
+    while(request) {
+        ab_request_p next_request = request->next;
+
+        request->status = status;
+        request->send_request = 0;
+        request->send_in_progress = 0;
+        request->recv_in_progress = 0;
+
+        session_remove_request_unsafe(session, request);
+
+        request = next_request;
+    }
+}
+
+
+
+/*
+ * session_disconnect_unsafe
+ *
+ * Called by the IO thread when the socket fails.  If the session
+ * reconnects automatically, put the requests that were sent back in the
+ * queue so that they are sent again once the session and its connections
+ * are back.  Otherwise fail them all.
+ *
+ * Writes that reached the PLC before the failure will be done again.
+ */
+
+void session_disconnect_unsafe(ab_session_p session, int reason)
+{
+    ab_request_p request = NULL;
+    ab_connection_p connection = NULL;
+
+    pdebug(DEBUG_WARN, "Lost session to %s, rc=%d.", session->host, reason);
+
+    if(time_ms() - session->reconnect_time > SESSION_RECONNECT_MAX_DELAY_MS) {
+        session->reconnect_attempts = 0;
+    }
+
+    session_unregister_unsafe(session);
+
+    /* throw away any partial packet. */
+    session->recv_offset = 0;
+    session->resp_seq_id = 0;
+    session->has_response = 0;
+
+    /* the connections went with the socket. */
+    for(connection = session->connections; connection; connection = connection->next) {
+        connection->is_connected = 0;
+
+        if(connection->reopen_request) {
+            request_release(connection->reopen_request);
+            connection->reopen_request = NULL;
+        }
+
+        if(session->auto_reconnect) {
+            connection->reopen_needed = 1;
+            connection->reopen_attempts = 0;
+            connection->next_reopen_time = 0;
+            connection->status = PLCTAG_STATUS_PENDING;
+        } else {
+            connection->status = PLCTAG_ERR_BAD_GATEWAY;
+        }
+    }
+
+    if(!session->auto_reconnect) {
+        session_fail_requests_unsafe(session, PLCTAG_ERR_BAD_GATEWAY);
+        session->status = PLCTAG_ERR_BAD_GATEWAY;
+        return;
+    }
+
+    if(session->current_request) {
+        request_release(session->current_request);
+        session->current_request = NULL;
+    }
+
+    /* replay what can be replayed, drop the rest. */
+    request = session->requests;
+
+    while(request) {
+        ab_request_p next_request = request->next;
+
+        if(request->no_resend || request->abort_request) {
+            request->status = PLCTAG_ERR_BAD_GATEWAY;
+            request->send_request = 0;
+            request->send_in_progress = 0;
+            request->recv_in_progress = 0;
+
+            session_remove_request_unsafe(session, request);
+        } else {
+            request->status = PLCTAG_STATUS_OK;
+            request->send_request = 1;
+            request->send_in_progress = 0;
+            request->recv_in_progress = 0;
+            request->current_offset = 0;
+        }
+
+        request = next_request;
+    }
+
+    session->status = PLCTAG_STATUS_PENDING;
+    session->reconnect_pending = 1;
+    session->next_reconnect_time = time_ms() + session_reconnect_delay(session->reconnect_attempts);
+}
+
+
+
+/*
+ * session_reconnect
+ *
+ * Open a new socket and register the session again.  This blocks, so the
+ * reconnect thread calls it without holding the session mutex.  The IO
+ * thread skips the session while this runs, so nothing else touches its
+ * socket.
+ */
+
+int session_reconnect(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Reconnecting session to %s, attempt %d.", session->host, session->reconnect_attempts + 1);
+
+    rc = session_init(session);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to reconnect session, rc=%d.", rc);
+
+        /* clean up any half open socket. */
+        if(session->sock) {
+            socket_close(session->sock);
+            socket_destroy(&(session->sock));
+            session->sock = NULL;
+        }
+
+        session->is_connected = 0;
+        session->registered = 0;
+
+        /* keep pending, we will try again. */
+        session->status = PLCTAG_STATUS_PENDING;
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * session_check_idle_unsafe
+ *
+ * Called by the IO thread for registered sessions.  Check the
+ * connections first.  Then, if nothing has gone out on the session for
+ * keepalive_ms, send an encapsulation NOP so that the gateway does not
+ * time the TCP session out.  NOP has no reply.
+ */
+
+void session_check_idle_unsafe(ab_session_p session)
+{
+    ab_connection_p connection = NULL;
+    ab_request_p req = NULL;
+    eip_encap_t *encap = NULL;
+    int64_t now = time_ms();
+    int64_t last_traffic = 0;
+
+    for(connection = session->connections; connection; connection = connection->next) {
+        connection_check_idle_unsafe(connection);
+    }
+
+    /* anything queued will keep the session alive. */
+    if(!session->keepalive_ms || session->requests) {
+        return;
+    }
+
+    last_traffic = (session->last_activity > session->last_keepalive ? session->last_activity : session->last_keepalive);
+
+    if(now - last_traffic < session->keepalive_ms) {
+        return;
+    }
+
+    if(request_create(&req) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get new request for keep alive.");
+        return;
+    }
+
+    pdebug(DEBUG_DETAIL, "Session idle, sending NOP.");
+
+    encap = (eip_encap_t*)(req->data);
+    encap->encap_command = h2le16(AB_EIP_NOP);
+
+    req->request_size = sizeof(eip_encap_t);
+    req->send_request = 1;
+    req->abort_after_send = 1;
+    req->no_resend = 1;
+    req->keepalive = 1;
+    req->priority = PLCTAG_PRIORITY_LOW;
+
+    session_add_request_unsafe(session, req);
+
+    /* the session holds the only reference now. */
+    request_release(req);
+
+    session->last_keepalive = now;
+}
+
+
+
+/*
+ * Rate limiting.
+ *
+ * These are called by the IO thread with the session mutex held.
+ */
+
+void rate_limit_init(ab_rate_limit_p limit, int packets_per_sec, int bytes_per_sec)
+{
+    mem_set(limit, 0, sizeof(*limit));
+
+    limit->packets_per_sec = (packets_per_sec > 0 ? packets_per_sec : 0);
+    limit->bytes_per_sec = (bytes_per_sec > 0 ? bytes_per_sec : 0);
+
+    /* start full. */
+    limit->packet_tokens = (int64_t)limit->packets_per_sec * 1000;
+    limit->byte_tokens = (int64_t)(limit->bytes_per_sec > MAX_REQ_RESP_SIZE ? limit->bytes_per_sec : MAX_REQ_RESP_SIZE) * 1000;
+    limit->last_refill = time_ms();
+}
+
+
+
+int rate_limit_ok_unsafe(ab_rate_limit_p limit, int num_bytes, int64_t now)
+{
+    int64_t elapsed = now - limit->last_refill;
+    int64_t max_packet_tokens = (int64_t)(limit->packets_per_sec > 1 ? limit->packets_per_sec : 1) * 1000;
+    int64_t max_byte_tokens = (int64_t)(limit->bytes_per_sec > MAX_REQ_RESP_SIZE ? limit->bytes_per_sec : MAX_REQ_RESP_SIZE) * 1000;
+
+    if(!limit->packets_per_sec && !limit->bytes_per_sec) {
+        return 1;
+    }
+
+    if(elapsed > 0) {
+        /* rate per second times milliseconds is thousandths of a token. */
+        limit->packet_tokens += elapsed * limit->packets_per_sec;
+        limit->byte_tokens += elapsed * limit->bytes_per_sec;
+        limit->last_refill = now;
+
+        if(limit->packet_tokens > max_packet_tokens) {
+            limit->packet_tokens = max_packet_tokens;
+        }
+
+        if(limit->byte_tokens > max_byte_tokens) {
+            limit->byte_tokens = max_byte_tokens;
+        }
+    }
+
+    if(limit->packets_per_sec && limit->packet_tokens < 1000) {
+        return 0;
+    }
+
+    if(limit->bytes_per_sec && limit->byte_tokens < (int64_t)num_bytes * 1000) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
+void rate_limit_consume_unsafe(ab_rate_limit_p limit, int num_bytes)
+{
+    if(limit->packets_per_sec) {
+        limit->packet_tokens -= 1000;
+    }
+
+    if(limit->bytes_per_sec) {
+        limit->byte_tokens -= (int64_t)num_bytes * 1000;
+    }
+}
+
+
+
+void rate_limit_record_wait_unsafe(ab_rate_limit_p limit, int64_t wait_ms)
+{
+    limit->wait_count++;
+    limit->total_wait_ms += wait_ms;
+
+    if(wait_ms > limit->max_wait_ms) {
+        limit->max_wait_ms = wait_ms;
+    }
+}
+
+
+
+/*
+ * rate_limit_get_int_attrib_unsafe
+ *
+ * The attribute name has already had its "session_" or "connection_"
+ * prefix removed.
+ */
+
+int rate_limit_get_int_attrib_unsafe(ab_rate_limit_p limit, const char *attrib_name, int default_value)
+{
+    if(str_cmp_i(attrib_name, "packets_per_sec") == 0) {
+        return limit->packets_per_sec;
+    } else if(str_cmp_i(attrib_name, "bytes_per_sec") == 0) {
+        return limit->bytes_per_sec;
+    } else if(str_cmp_i(attrib_name, "rate_limit_waits") == 0) {
+        return (int)limit->wait_count;
+    } else if(str_cmp_i(attrib_name, "rate_limit_wait_ms") == 0) {
+        return (int)limit->total_wait_ms;
+    } else if(str_cmp_i(attrib_name, "rate_limit_max_wait_ms") == 0) {
+        return (int)limit->max_wait_ms;
+    }
+
+    return default_value;
+}
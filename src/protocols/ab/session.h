@@ -52,12 +52,66 @@
 #define SESSION_REGISTRATION_TIMEOUT (1500)
 
 /* 
- * the queue depth depends on the type of the request.
+ * the queue depth depends on the type of the request.  Connected requests
+ * are limited per connection.  Connection set up and tear down requests
+ * share the connected limit at the session level.
  */
 
 #define SESSION_MAX_CONNECTED_REQUESTS_IN_FLIGHT (2)
 #define SESSION_MAX_UNCONNECTED_REQUESTS_IN_FLIGHT (8)
 
+/*
+ * Requests are sent in priority order.  A waiting request gains one
+ * priority level for every SESSION_PRIORITY_AGING_MS it has been queued
+ * so that low priority requests are not starved.  Some in-flight slots
+ * can only be used by high priority requests.  The connected windows are
+ * only a few requests deep, so there the reserved slots are extra slots
+ * on top of the window instead of coming out of it.
+ */
+
+#define SESSION_PRIORITY_AGING_MS (500)
+#define SESSION_RESERVED_CONNECTED_SLOTS (1)
+#define SESSION_RESERVED_UNCONNECTED_SLOTS (2)
+
+/*
+ * When the socket fails, the reconnect thread tries again with exponential
+ * back off.  The delay is randomized between half and all of the current
+ * interval so that many clients do not hit a recovering PLC at once.
+ * The back off only resets once a reconnected session has stayed up for
+ * the maximum delay, so a flapping link does not cause a storm.
+ * In milliseconds.
+ */
+
+#define SESSION_RECONNECT_MIN_DELAY_MS (500)
+#define SESSION_RECONNECT_MAX_DELAY_MS (30000)
+
+/*
+ * Token bucket used to limit the packets and bytes per second sent to a
+ * PLC so that we do not eat all of its communication time slice.  A rate
+ * of zero is no limit.  Tokens are kept in thousandths so that slow rates
+ * still refill every millisecond.  A bucket holds at most one second of
+ * tokens, and always enough for one full packet.
+ */
+
+typedef struct ab_rate_limit_t *ab_rate_limit_p;
+
+struct ab_rate_limit_t {
+    int packets_per_sec;
+    int bytes_per_sec;
+
+    int64_t packet_tokens;
+    int64_t byte_tokens;
+    int64_t last_refill;
+
+    /* statistics */
+    int64_t wait_count;
+    int64_t total_wait_ms;
+    int64_t max_wait_ms;
+};
+
+#define RATE_LIMIT_SESSION (1)
+#define RATE_LIMIT_CONNECTION (2)
+
 struct ab_session_t {
     ab_session_p next;
     ab_session_p prev;
@@ -68,6 +122,7 @@ struct ab_session_t {
     sock_p sock;
     int is_connected;
     int status;
+    int exclusive;
 
     /* registration info */
     uint32_t session_handle;
@@ -76,6 +131,9 @@ struct ab_session_t {
     /* Sequence ID for requests. */
     uint64_t session_seq_id;
 
+    /* PCCC transaction number for unconnected PCCC requests to the gateway PLC. */
+    uint16_t pccc_tns;
+
     /* current request being sent, only one at a time */
     ab_request_p current_request;
 
@@ -114,13 +172,36 @@ struct ab_session_t {
     /* connections for this session */
     ab_connection_p connections;
     uint32_t conn_serial_number; /* id for the next connection */
+
+    /* limit on the traffic to the gateway */
+    struct ab_rate_limit_t rate_limit;
+
+    /* recovery from socket failure */
+    int auto_reconnect;
+    int reconnect_pending;
+    int reconnect_attempts;
+    int64_t next_reconnect_time;
+    int64_t reconnect_time;
+    int reconnect_count;
+
+    /* idle tracking, times in milliseconds */
+    int keepalive_ms;
+    int64_t last_activity;
+    int64_t last_keepalive;
+
+    /* Logix symbol tables, one per PLC path. See symbol.h */
+    struct ab_symbol_table_t *symbols;
+
+    /* shared PCCC data file reads.  See pccc_file.h */
+    struct ab_pccc_file_t *pccc_files;
 };
 
 uint64_t session_get_new_seq_id_unsafe(ab_session_p sess);
 uint64_t session_get_new_seq_id(ab_session_p sess);
+uint16_t session_get_new_pccc_tns(ab_session_p sess);
 
 extern int session_find_or_create(ab_session_p *session, attr attribs);
-ab_connection_p session_find_connection_by_path_unsafe(ab_session_p session,const char *path);
+ab_connection_p session_find_connection_by_path_unsafe(ab_session_p session,const char *path, int pool_size);
 extern int session_add_connection_unsafe(ab_session_p session, ab_connection_p connection);
 extern int session_add_connection(ab_session_p session, ab_connection_p connection);
 extern int session_remove_connection_unsafe(ab_session_p session, ab_connection_p connection);
@@ -132,5 +213,17 @@ extern int session_remove_request(ab_session_p sess, ab_request_p req);
 extern int session_acquire(ab_session_p session);
 extern int session_release(ab_session_p session);
 
+extern void session_disconnect_unsafe(ab_session_p session, int reason);
+extern int session_reconnect(ab_session_p session);
+extern int64_t session_reconnect_delay(int attempts);
+extern void session_fail_requests_unsafe(ab_session_p session, int status);
+extern void session_check_idle_unsafe(ab_session_p session);
+
+extern void rate_limit_init(ab_rate_limit_p limit, int packets_per_sec, int bytes_per_sec);
+extern int rate_limit_ok_unsafe(ab_rate_limit_p limit, int num_bytes, int64_t now);
+extern void rate_limit_consume_unsafe(ab_rate_limit_p limit, int num_bytes);
+extern void rate_limit_record_wait_unsafe(ab_rate_limit_p limit, int64_t wait_ms);
+extern int rate_limit_get_int_attrib_unsafe(ab_rate_limit_p limit, const char *attrib_name, int default_value);
+
 
 #endif
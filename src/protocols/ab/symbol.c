@@ -0,0 +1,1078 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <ctype.h>
+#include <stdio.h>
+#include <platform.h>
+#include <lib/libplctag.h>
+#include <ab/ab_common.h>
+#include <ab/cip.h>
+#include <ab/eip.h>
+#include <ab/eip_cip.h>
+#include <ab/session.h>
+#include <ab/symbol.h>
+#include <ab/tag.h>
+#include <ab/template.h>
+#include <util/debug.h>
+
+
+#define SYMBOL_CLASS (0x6B)
+
+/*
+ * the controller object keeps counters that change when tags are added,
+ * removed or moved.  We do not decode them, any difference means the
+ * symbols must be read again.
+ */
+#define CONTROLLER_CLASS (0xAC)
+
+/* attributes of each symbol instance that we ask for */
+#define SYMBOL_ATTR_NAME (1)
+#define SYMBOL_ATTR_TYPE (2)
+#define SYMBOL_ATTR_DIMS (8)
+
+
+static ab_symbol_table_p find_table_unsafe(ab_session_p session, uint8_t *conn_path, int conn_path_size);
+static void drop_table_unsafe(ab_session_p session, ab_symbol_table_p table);
+static void free_table(ab_symbol_table_p table);
+static int read_change_info(ab_tag_p tag, uint8_t *info, int *info_size);
+static int table_changed(ab_tag_p tag, ab_symbol_table_p table);
+static int load_table(ab_tag_p tag, ab_symbol_table_p table);
+static int load_table_pages(ab_tag_p tag, ab_symbol_table_p table, const char *program, int64_t timeout_time);
+static int load_table_page(ab_tag_p tag, ab_symbol_table_p table, const char *program, uint32_t *start_instance);
+static int add_symbol(ab_symbol_table_p table, ab_symbol_p symbol);
+static int build_hash(ab_symbol_table_p table);
+static unsigned int hash_name(const char *name, int name_len);
+
+
+/* protected by the session mutex */
+static uint32_t last_table_id = 0;
+
+
+
+/*
+ * symbol_get_table
+ *
+ * Find the symbol table for the tag's PLC, enumerating the symbols
+ * if this is the first time.  Only one thread loads or checks a table;
+ * any other threads wanting the same table wait for it.  A table that
+ * failed to load is loaded again by the next caller.  A table older
+ * than SYMBOL_TABLE_CHECK_MS is checked against the controller's change
+ * counters first, and dropped if they moved.
+ *
+ * The caller must hand the table back with symbol_release_table().
+ *
+ * This blocks and must not be called with the session mutex held.
+ */
+
+int symbol_get_table(ab_tag_p tag, ab_symbol_table_p *result)
+{
+    ab_session_p session = tag->session;
+    ab_symbol_table_p table = NULL;
+    int rc = PLCTAG_STATUS_PENDING;
+    int load = 0;
+    int check = 0;
+    int64_t timeout_time = time_ms() + SYMBOL_TABLE_LOAD_TIMEOUT;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    *result = NULL;
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Tag has no session!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    do {
+        load = 0;
+        check = 0;
+
+        critical_block(global_session_mut) {
+            table = find_table_unsafe(session, tag->conn_path, tag->conn_path_size);
+
+            if(!table) {
+                table = (ab_symbol_table_p)mem_alloc(sizeof(struct ab_symbol_table_t));
+
+                if(!table) {
+                    rc = PLCTAG_ERR_NO_MEM;
+                    break;
+                }
+
+                mem_copy(table->conn_path, tag->conn_path, tag->conn_path_size);
+                table->conn_path_size = tag->conn_path_size;
+                table->status = PLCTAG_ERR_NO_DATA;
+                table->id = ++last_table_id;
+
+                table->next = session->symbols;
+                session->symbols = table;
+            }
+
+            if(table->status == PLCTAG_STATUS_PENDING) {
+                /* someone else is loading or checking it. */
+                rc = PLCTAG_STATUS_PENDING;
+                break;
+            }
+
+            /* we hold the table from here on. */
+            table->users++;
+
+            if(table->status == PLCTAG_STATUS_OK && time_ms() < table->check_time) {
+                rc = PLCTAG_STATUS_OK;
+                break;
+            }
+
+            /* not loaded yet, the last try failed or it is time to check it. */
+            check = (table->status == PLCTAG_STATUS_OK);
+            load = !check;
+            table->status = PLCTAG_STATUS_PENDING;
+        }
+
+        if(load) {
+            rc = load_table(tag, table);
+
+            critical_block(global_session_mut) {
+                table->status = rc;
+                table->check_time = time_ms() + SYMBOL_TABLE_CHECK_MS;
+            }
+        } else if(check) {
+            int changed = table_changed(tag, table);
+
+            critical_block(global_session_mut) {
+                table->status = PLCTAG_STATUS_OK;
+                table->check_time = time_ms() + SYMBOL_TABLE_CHECK_MS;
+
+                if(changed) {
+                    drop_table_unsafe(session, table);
+                }
+            }
+
+            if(changed) {
+                /* load a new table on the next pass. */
+                symbol_release_table(table);
+                rc = PLCTAG_STATUS_PENDING;
+            } else {
+                rc = PLCTAG_STATUS_OK;
+            }
+        } else if(rc == PLCTAG_STATUS_PENDING) {
+            if(time_ms() > timeout_time) {
+                pdebug(DEBUG_WARN, "Timed out waiting for symbols to load!");
+                rc = PLCTAG_ERR_TIMEOUT;
+            } else {
+                sleep_ms(1);
+            }
+        }
+    } while(rc == PLCTAG_STATUS_PENDING);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        *result = table;
+    } else if(load) {
+        symbol_release_table(table);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * symbol_release_table
+ *
+ * Hand back a table from symbol_get_table().  A dropped table is freed
+ * by its last user.
+ */
+
+void symbol_release_table(ab_symbol_table_p table)
+{
+    int free_it = 0;
+
+    if(!table) {
+        return;
+    }
+
+    critical_block(global_session_mut) {
+        table->users--;
+        free_it = (table->stale && table->users <= 0);
+    }
+
+    if(free_it) {
+        free_table(table);
+    }
+}
+
+
+
+/*
+ * symbol_drop_tables_unsafe
+ *
+ * Drop all the symbol tables of the session, for instance because it
+ * reconnected and the PLC may have been downloaded to.
+ */
+
+void symbol_drop_tables_unsafe(ab_session_p session)
+{
+    while(session->symbols) {
+        drop_table_unsafe(session, session->symbols);
+    }
+}
+
+
+
+
+/*
+ * symbol_find_by_name
+ *
+ * Look up a symbol by name.  Logix names are not case sensitive.
+ * The name does not need to be zero terminated.
+ */
+
+ab_symbol_p symbol_find_by_name(ab_symbol_table_p table, const char *name, int name_len)
+{
+    int index;
+
+    if(!table->hash_size) {
+        return NULL;
+    }
+
+    index = table->hash_buckets[hash_name(name, name_len) % (unsigned int)table->hash_size];
+
+    while(index) {
+        ab_symbol_p symbol = &table->symbols[index - 1];
+
+        if(str_length(symbol->name) == name_len && str_cmp_i_n(symbol->name, name, name_len) == 0) {
+            return symbol;
+        }
+
+        index = symbol->hash_next;
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * symbol_find_for_tag
+ *
+ * Find the symbol at the base of a tag's encoded name, using the name
+ * by symbol if the tag is addressed by instance.  This handles both
+ * controller and program scoped names.  *rest and *rest_end are set to
+ * the segments after the base name, such as array indexes and fields.
+ */
+
+ab_symbol_p symbol_find_for_tag(ab_symbol_table_p table, ab_tag_p tag, uint8_t **rest, uint8_t **rest_end)
+{
+    char name[MAX_SYMBOL_NAME];
+    int name_len = 0;
+    uint8_t *encoded_name = (tag->symbolic_name_size ? tag->symbolic_name : tag->encoded_name);
+    int encoded_name_size = (tag->symbolic_name_size ? tag->symbolic_name_size : tag->encoded_name_size);
+    uint8_t *data = encoded_name + 1;
+    uint8_t *end = encoded_name + encoded_name_size;
+    int num_names = 1;
+    int seg;
+
+    *rest = end;
+    *rest_end = end;
+
+    /* the base name, and the tag name after it if this is a program. */
+    for(seg = 0; seg < num_names; seg++) {
+        int seg_len;
+
+        if(data + 2 > end || data[0] != 0x91) {
+            return NULL;
+        }
+
+        seg_len = data[1];
+
+        if(data + 2 + seg_len > end || name_len + seg_len + 2 > MAX_SYMBOL_NAME) {
+            return NULL;
+        }
+
+        if(seg > 0) {
+            name[name_len] = '.';
+            name_len++;
+        }
+
+        mem_copy(&name[name_len], data + 2, seg_len);
+        name_len += seg_len;
+        data += 2 + seg_len + (seg_len & 0x01);
+
+        /* program scoped tags are Program:<program>.<tag> */
+        if(seg == 0 && seg_len > 8 && str_cmp_i_n(name, "Program:", 8) == 0) {
+            num_names = 2;
+        }
+    }
+
+    name[name_len] = 0;
+
+    *rest = data;
+
+    return symbol_find_by_name(table, name, name_len);
+}
+
+
+
+
+/*
+ * symbol_get_tag_dims
+ *
+ * Set *num_dims to the number of array dimensions of the symbol if the
+ * tag name is the whole symbol.  Names that go on to an index or a field
+ * get zero.
+ *
+ * This blocks and must not be called with the session mutex held.
+ */
+
+int symbol_get_tag_dims(ab_tag_p tag, int *num_dims)
+{
+    ab_symbol_table_p table = NULL;
+    ab_symbol_p symbol = NULL;
+    uint8_t *rest = NULL;
+    uint8_t *rest_end = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    *num_dims = 0;
+
+    rc = symbol_get_table(tag, &table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get symbol table! rc=%d", rc);
+        return rc;
+    }
+
+    symbol = symbol_find_for_tag(table, tag, &rest, &rest_end);
+
+    if(!symbol) {
+        pdebug(DEBUG_WARN, "Tag not found in the symbol table.");
+        rc = PLCTAG_ERR_NOT_FOUND;
+    } else if(rest == rest_end) {
+        while(*num_dims < 3 && symbol->dims[*num_dims]) {
+            (*num_dims)++;
+        }
+    }
+
+    symbol_release_table(table);
+
+    return rc;
+}
+
+
+
+/*
+ * symbol_encode_tag_instance
+ *
+ * Replace the symbolic segment for the base of the tag name with a
+ * logical segment for its instance in the Symbol class.  Any array index
+ * and field segments after it are kept.  The name is left alone if it
+ * cannot be converted, the tag works the same, just less efficiently.
+ *
+ * Program scoped names are skipped as their instances are not in the
+ * controller symbol table.
+ *
+ * The name by symbol is kept on the tag so that the instance can be
+ * looked up again if the symbols move.
+ */
+
+int symbol_encode_tag_instance(ab_tag_p tag)
+{
+    ab_symbol_table_p table = NULL;
+    ab_symbol_p symbol = NULL;
+    uint8_t *name = tag->encoded_name + 1;
+    int name_len = 0;
+    int seg_size = 0;
+    uint8_t segment[8];
+    int new_seg_size = 0;
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    /* start over from the name by symbol if we looked the instance up before. */
+    if(tag->symbolic_name_size) {
+        mem_copy(tag->encoded_name, tag->symbolic_name, tag->symbolic_name_size);
+        tag->encoded_name_size = tag->symbolic_name_size;
+        tag->symbolic_name_size = 0;
+    }
+
+    if(tag->encoded_name_size < 3 || name[0] != 0x91) {
+        pdebug(DEBUG_DETAIL, "Tag name does not start with a symbolic segment.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    name_len = name[1];
+
+    /* symbolic segments are padded to a 16-bit boundary */
+    seg_size = 2 + name_len + (name_len & 0x01);
+
+    for(i=0; i < name_len; i++) {
+        if(name[2 + i] == ':') {
+            pdebug(DEBUG_DETAIL, "Program scoped tags are not in the controller symbol table.");
+            return PLCTAG_STATUS_OK;
+        }
+    }
+
+    rc = symbol_get_table(tag, &table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get symbol table, using the tag name.  rc=%d", rc);
+        return PLCTAG_STATUS_OK;
+    }
+
+    symbol = symbol_find_by_name(table, (const char *)(name + 2), name_len);
+
+    if(!symbol) {
+        pdebug(DEBUG_WARN, "Tag %.*s not found in the symbol table, using the tag name.", name_len, name + 2);
+        symbol_release_table(table);
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* build the class and instance segments */
+    segment[0] = 0x20;
+    segment[1] = SYMBOL_CLASS;
+
+    if(symbol->instance_id <= 0xFF) {
+        segment[2] = 0x24;
+        segment[3] = (uint8_t)symbol->instance_id;
+        new_seg_size = 4;
+    } else if(symbol->instance_id <= 0xFFFF) {
+        segment[2] = 0x25;
+        segment[3] = 0;
+        segment[4] = symbol->instance_id & 0xFF;
+        segment[5] = (symbol->instance_id >> 8) & 0xFF;
+        new_seg_size = 6;
+    } else {
+        segment[2] = 0x26;
+        segment[3] = 0;
+        *((uint32_t*)(&segment[4])) = h2le32(symbol->instance_id);
+        new_seg_size = 8;
+    }
+
+    pdebug(DEBUG_INFO, "Using instance %u for tag %s.", symbol->instance_id, symbol->name);
+
+    tag->symbol_table_id = table->id;
+
+    symbol_release_table(table);
+
+    /* the logical segment is never longer than the symbolic one it replaces */
+    if(new_seg_size > seg_size) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* keep the name by symbol in case the symbols move. */
+    mem_copy(tag->symbolic_name, tag->encoded_name, tag->encoded_name_size);
+    tag->symbolic_name_size = tag->encoded_name_size;
+
+    /* shift the rest of the name down, the areas overlap so copy forward. */
+    for(i=0; i < tag->encoded_name_size - 1 - seg_size; i++) {
+        name[new_seg_size + i] = name[seg_size + i];
+    }
+
+    mem_copy(name, segment, new_seg_size);
+
+    tag->encoded_name_size -= (seg_size - new_seg_size);
+    tag->encoded_name[0] = (uint8_t)((tag->encoded_name_size - 1)/2);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * symbol_instance_error
+ *
+ * The PLC did not find the path of a tag.  If the tag is addressed by
+ * instance, the symbols may have moved.  Drop the table the instance
+ * came from, unless a newer one was loaded already, go back to the name
+ * by symbol and look the instance up again before the next request.
+ */
+
+void symbol_instance_error(ab_tag_p tag)
+{
+    if(!tag->symbolic_name_size || !tag->session) {
+        return;
+    }
+
+    pdebug(DEBUG_WARN, "Path error on a tag addressed by instance, dropping the symbol table.");
+
+    critical_block(global_session_mut) {
+        ab_symbol_table_p table = find_table_unsafe(tag->session, tag->conn_path, tag->conn_path_size);
+
+        /* do not pull a table out from under a load in progress. */
+        if(table && table->id <= tag->symbol_table_id && table->status != PLCTAG_STATUS_PENDING) {
+            drop_table_unsafe(tag->session, table);
+        }
+    }
+
+    mem_copy(tag->encoded_name, tag->symbolic_name, tag->symbolic_name_size);
+    tag->encoded_name_size = tag->symbolic_name_size;
+    tag->resolve_instance = 1;
+}
+
+
+
+/*
+ * symbol_check_tag_instance
+ *
+ * Look the tag's instance up again after a path error.  Called before
+ * starting a request.  The tag uses its name by symbol until then.
+ */
+
+void symbol_check_tag_instance(ab_tag_p tag)
+{
+    if(!tag->resolve_instance) {
+        return;
+    }
+
+    tag->resolve_instance = 0;
+
+    symbol_encode_tag_instance(tag);
+}
+
+
+
+/*
+ * symbol_type_size
+ *
+ * The size in bytes of one element of an atomic type.  Returns zero
+ * for structures and types we do not know.
+ */
+
+int symbol_type_size(uint16_t type)
+{
+    if(type & SYMBOL_TYPE_STRUCT) {
+        return 0;
+    }
+
+    switch(type & 0xFF) {
+        case 0xC1: /* BOOL */
+        case 0xC2: /* SINT */
+        case 0xC6: /* USINT */
+            return 1;
+
+        case 0xC3: /* INT */
+        case 0xC7: /* UINT */
+            return 2;
+
+        case 0xC4: /* DINT */
+        case 0xC8: /* UDINT */
+        case 0xCA: /* REAL */
+        case 0xD3: /* DWORD */
+            return 4;
+
+        case 0xC5: /* LINT */
+        case 0xC9: /* ULINT */
+        case 0xCB: /* LREAL */
+            return 8;
+
+        default:
+            return 0;
+    }
+}
+
+
+
+void symbol_destroy_tables(ab_symbol_table_p tables)
+{
+    while(tables) {
+        ab_symbol_table_p next = tables->next;
+
+        free_table(tables);
+
+        tables = next;
+    }
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+ab_symbol_table_p find_table_unsafe(ab_session_p session, uint8_t *conn_path, int conn_path_size)
+{
+    ab_symbol_table_p table = session->symbols;
+
+    while(table && (table->conn_path_size != conn_path_size || mem_cmp(table->conn_path, conn_path, conn_path_size) != 0)) {
+        table = table->next;
+    }
+
+    return table;
+}
+
+
+
+/*
+ * take the table out of the session so that the next caller loads a new
+ * one.  It is freed now if nobody holds it, otherwise by its last user.
+ */
+
+void drop_table_unsafe(ab_session_p session, ab_symbol_table_p table)
+{
+    ab_symbol_table_p *walker = &(session->symbols);
+
+    while(*walker && *walker != table) {
+        walker = &((*walker)->next);
+    }
+
+    if(*walker) {
+        *walker = table->next;
+    }
+
+    table->next = NULL;
+    table->stale = 1;
+
+    if(table->users <= 0) {
+        free_table(table);
+    }
+}
+
+
+
+void free_table(ab_symbol_table_p table)
+{
+    if(table->symbols) {
+        mem_free(table->symbols);
+    }
+
+    if(table->hash_buckets) {
+        mem_free(table->hash_buckets);
+    }
+
+    template_destroy_all(table->templates);
+
+    mem_free(table);
+}
+
+
+
+/*
+ * read the change counter attributes of the controller object.  PLCs
+ * without them leave *info_size at zero.
+ */
+
+int read_change_info(ab_tag_p tag, uint8_t *info, int *info_size)
+{
+    uint8_t service[16];
+    uint8_t *data = service;
+    ab_request_p req = NULL;
+    uint8_t *reply = NULL;
+    uint8_t *reply_end = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    *info_size = 0;
+
+    *data = AB_EIP_CMD_CIP_GET_ATTR_LIST;
+    data++;
+    *data = 2; /* path size in words */
+    data++;
+    *data = 0x20;
+    data++;
+    *data = CONTROLLER_CLASS;
+    data++;
+    *data = 0x24;
+    data++;
+    *data = 0x01;
+    data++;
+
+    /* attribute count and the attribute IDs */
+    *((uint16_t*)data) = h2le16(5);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(1);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(2);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(3);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(4);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(10);
+    data += sizeof(uint16_t);
+
+    rc = eip_cip_send_sync(tag, service, (int)(data - service), &req, &reply, &reply_end);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        if(rc == PLCTAG_STATUS_PENDING) {
+            request_release(req);
+        }
+
+        pdebug(DEBUG_DETAIL, "Unable to read the change counters. rc=%d", rc);
+        return rc;
+    }
+
+    if(reply_end - reply > SYMBOL_CHANGE_INFO_SIZE) {
+        reply_end = reply + SYMBOL_CHANGE_INFO_SIZE;
+    }
+
+    mem_copy(info, reply, (int)(reply_end - reply));
+    *info_size = (int)(reply_end - reply);
+
+    request_release(req);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * did the symbols change since the table was loaded?  If we cannot
+ * tell, trust the table.  Path errors will catch any change.
+ */
+
+int table_changed(ab_tag_p tag, ab_symbol_table_p table)
+{
+    uint8_t info[SYMBOL_CHANGE_INFO_SIZE];
+    int info_size = 0;
+
+    if(!table->change_info_size) {
+        return 0;
+    }
+
+    if(read_change_info(tag, info, &info_size) != PLCTAG_STATUS_OK) {
+        return 0;
+    }
+
+    if(info_size == table->change_info_size && mem_cmp(info, table->change_info, info_size) == 0) {
+        return 0;
+    }
+
+    pdebug(DEBUG_INFO, "Controller change counters moved, reading the symbols again.");
+
+    return 1;
+}
+
+
+
+int load_table(ab_tag_p tag, ab_symbol_table_p table)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int num_controller_symbols = 0;
+    int64_t timeout_time = time_ms() + SYMBOL_TABLE_LOAD_TIMEOUT;
+    int i;
+
+    pdebug(DEBUG_INFO, "Enumerating symbols.");
+
+    table->num_symbols = 0;
+
+    /* read the counters first, so that changes made while we enumerate show up at the next check. */
+    read_change_info(tag, table->change_info, &table->change_info_size);
+
+    rc = load_table_pages(tag, table, NULL, timeout_time);
+
+    /* each program has its own symbols. */
+    num_controller_symbols = table->num_symbols;
+
+    for(i=0; i < num_controller_symbols && rc == PLCTAG_STATUS_OK; i++) {
+        char program[MAX_SYMBOL_NAME];
+
+        if(str_cmp_i_n(table->symbols[i].name, "Program:", 8) != 0) {
+            continue;
+        }
+
+        /* adding symbols can move the table, so take a copy. */
+        mem_copy(program, table->symbols[i].name, MAX_SYMBOL_NAME);
+
+        rc = load_table_pages(tag, table, program, timeout_time);
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        rc = build_hash(table);
+    }
+
+    pdebug(DEBUG_INFO, "Found %d symbols, rc=%d.", table->num_symbols, rc);
+
+    return rc;
+}
+
+
+
+/*
+ * load_table_pages
+ *
+ * Get all the symbols of the controller or of one program.  The PLC
+ * sends back as many symbols as fit and a partial status if there are
+ * more.
+ */
+
+int load_table_pages(ab_tag_p tag, ab_symbol_table_p table, const char *program, int64_t timeout_time)
+{
+    int rc = PLCTAG_STATUS_OK;
+    uint32_t start_instance = 0;
+    uint32_t last_start_instance = 0;
+
+    do {
+        if(time_ms() > timeout_time) {
+            pdebug(DEBUG_WARN, "Timed out reading the symbols!");
+            return PLCTAG_ERR_TIMEOUT;
+        }
+
+        last_start_instance = start_instance;
+
+        rc = load_table_page(tag, table, program, &start_instance);
+
+        if(rc == PLCTAG_STATUS_PENDING && start_instance == last_start_instance) {
+            /* no progress, do not spin forever. */
+            pdebug(DEBUG_WARN, "Partial symbol reply without any whole symbol!");
+            return PLCTAG_ERR_BAD_DATA;
+        }
+    } while(rc == PLCTAG_STATUS_PENDING);
+
+    return rc;
+}
+
+
+
+/*
+ * load_table_page
+ *
+ * Get one reply worth of symbols with Get Instance Attribute List,
+ * starting at *start_instance.  Each symbol in the reply is the instance
+ * ID followed by the attributes in the order asked for.
+ *
+ * If program is not NULL, this gets the symbols scoped to that program
+ * and prefixes their names with the program name.
+ */
+
+int load_table_page(ab_tag_p tag, ab_symbol_table_p table, const char *program, uint32_t *start_instance)
+{
+    uint8_t service[MAX_SYMBOL_NAME + 32];
+    uint8_t *data = service;
+    uint8_t *path_size = NULL;
+    ab_request_p req = NULL;
+    uint8_t *reply = NULL;
+    uint8_t *reply_end = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int status = PLCTAG_STATUS_OK;
+
+    *data = AB_EIP_CMD_CIP_LIST_ATTRIBS;
+    data++;
+
+    /* path size in words, filled in below */
+    path_size = data;
+    data++;
+
+    if(program) {
+        int program_len = str_length(program);
+
+        *data = 0x91;
+        data++;
+        *data = (uint8_t)program_len;
+        data++;
+        mem_copy(data, (void *)program, program_len);
+        data += program_len;
+
+        if(program_len & 0x01) {
+            *data = 0;
+            data++;
+        }
+    }
+
+    if(*start_instance <= 0xFFFF) {
+        *data = 0x20;
+        data++;
+        *data = SYMBOL_CLASS;
+        data++;
+        *data = 0x25;
+        data++;
+        *data = 0;
+        data++;
+        *data = *start_instance & 0xFF;
+        data++;
+        *data = (*start_instance >> 8) & 0xFF;
+        data++;
+    } else {
+        *data = 0x20;
+        data++;
+        *data = SYMBOL_CLASS;
+        data++;
+        *data = 0x26;
+        data++;
+        *data = 0;
+        data++;
+        *((uint32_t*)data) = h2le32(*start_instance);
+        data += sizeof(uint32_t);
+    }
+
+    *path_size = (uint8_t)((data - (path_size + 1))/2);
+
+    /* attribute count and the attribute IDs */
+    *((uint16_t*)data) = h2le16(3);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(SYMBOL_ATTR_NAME);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(SYMBOL_ATTR_TYPE);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(SYMBOL_ATTR_DIMS);
+    data += sizeof(uint16_t);
+
+    status = eip_cip_send_sync(tag, service, (int)(data - service), &req, &reply, &reply_end);
+
+    if(status != PLCTAG_STATUS_OK && status != PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Unable to get symbol list! rc=%d", status);
+        return status;
+    }
+
+    data = reply;
+
+    while(data < reply_end) {
+        struct ab_symbol_t symbol;
+        int name_len;
+
+        mem_set(&symbol, 0, sizeof(symbol));
+
+        if(data + sizeof(uint32_t) + sizeof(uint16_t) > reply_end) {
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
+        symbol.instance_id = le2h32(*((uint32_t*)data));
+        data += sizeof(uint32_t);
+
+        name_len = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+
+        /* name, type and three dimensions */
+        if(data + name_len + sizeof(uint16_t) + 3*sizeof(uint32_t) > reply_end) {
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
+        if(program) {
+            snprintf_platform(symbol.name, MAX_SYMBOL_NAME, "%s.%.*s", program, name_len, (const char *)data);
+        } else {
+            mem_copy(symbol.name, data, (name_len < MAX_SYMBOL_NAME ? name_len : MAX_SYMBOL_NAME - 1));
+        }
+
+        data += name_len;
+
+        symbol.type = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+
+        symbol.dims[0] = le2h32(*((uint32_t*)data));
+        data += sizeof(uint32_t);
+        symbol.dims[1] = le2h32(*((uint32_t*)data));
+        data += sizeof(uint32_t);
+        symbol.dims[2] = le2h32(*((uint32_t*)data));
+        data += sizeof(uint32_t);
+
+        rc = add_symbol(table, &symbol);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        *start_instance = symbol.instance_id + 1;
+    }
+
+    request_release(req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to decode symbol list! rc=%d", rc);
+        return rc;
+    }
+
+    return status;
+}
+
+
+
+/*
+ * build_hash
+ *
+ * Index the symbols by name.  Buckets are chained through the symbols.
+ */
+
+int build_hash(ab_symbol_table_p table)
+{
+    int i;
+
+    if(table->hash_buckets) {
+        mem_free(table->hash_buckets);
+        table->hash_buckets = NULL;
+        table->hash_size = 0;
+    }
+
+    if(!table->num_symbols) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* MAGIC, keep the chains short. */
+    table->hash_buckets = (int*)mem_alloc((table->num_symbols * 2 + 1) * sizeof(int));
+
+    if(!table->hash_buckets) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    table->hash_size = table->num_symbols * 2 + 1;
+
+    for(i=0; i < table->num_symbols; i++) {
+        ab_symbol_p symbol = &table->symbols[i];
+        unsigned int bucket = hash_name(symbol->name, str_length(symbol->name)) % (unsigned int)table->hash_size;
+
+        symbol->hash_next = table->hash_buckets[bucket];
+        table->hash_buckets[bucket] = i + 1;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/* names are not case sensitive, so neither is the hash. */
+unsigned int hash_name(const char *name, int name_len)
+{
+    unsigned int hash = 5381;
+    int i;
+
+    for(i=0; i < name_len; i++) {
+        hash = (hash * 33) + (unsigned int)tolower((unsigned char)name[i]);
+    }
+
+    return hash;
+}
+
+
+
+int add_symbol(ab_symbol_table_p table, ab_symbol_p symbol)
+{
+    if(table->num_symbols >= table->max_symbols) {
+        int new_max = (table->max_symbols ? table->max_symbols * 2 : 64); /* MAGIC */
+        ab_symbol_p new_symbols = (ab_symbol_p)mem_alloc(new_max * sizeof(struct ab_symbol_t));
+
+        if(!new_symbols) {
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        if(table->symbols) {
+            mem_copy(new_symbols, table->symbols, table->num_symbols * sizeof(struct ab_symbol_t));
+            mem_free(table->symbols);
+        }
+
+        table->symbols = new_symbols;
+        table->max_symbols = new_max;
+    }
+
+    table->symbols[table->num_symbols] = *symbol;
+    table->num_symbols++;
+
+    return PLCTAG_STATUS_OK;
+}
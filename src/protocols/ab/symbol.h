@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PLCTAG_AB_SYMBOL_H__
+#define __PLCTAG_AB_SYMBOL_H__ 1
+
+#include <ab/ab_common.h>
+#include <ab/tag.h>
+
+/*
+ * Logix PLCs keep their controller tags as instances of the Symbol
+ * class (0x6B).  Addressing a tag by its instance ID instead of by its
+ * name makes every request smaller and saves the PLC a name lookup.
+ *
+ * The symbols are enumerated per session and PLC path and are then
+ * shared by all tags on that path.  Program scoped tags are included and
+ * are named "Program:<program>.<tag>".  A hash on the name makes lookups
+ * fast on PLCs with many tags.
+ *
+ * A download or online edit can move the symbols.  A table is dropped
+ * when its session reconnects, when a tag addressed by instance gets a
+ * path error and when the controller's change counters no longer match
+ * the ones read with the table.  The counters are checked at most every
+ * SYMBOL_TABLE_CHECK_MS.  A dropped table is freed once no caller holds
+ * it and the next caller loads a new one.
+ */
+
+#define MAX_SYMBOL_NAME (128)
+
+/* how long to wait for the symbols to be enumerated.  In milliseconds. */
+#define SYMBOL_TABLE_LOAD_TIMEOUT (10000)
+
+/* how long a table is used before the change counters are read again.  In milliseconds. */
+#define SYMBOL_TABLE_CHECK_MS (5000)
+
+/* room for the change counter attributes */
+#define SYMBOL_CHANGE_INFO_SIZE (64)
+
+/* type word bits */
+#define SYMBOL_TYPE_STRUCT (0x8000)
+#define SYMBOL_TYPE_TEMPLATE_MASK (0x0FFF)
+
+typedef struct ab_symbol_t *ab_symbol_p;
+
+struct ab_symbol_t {
+    char name[MAX_SYMBOL_NAME];
+    uint32_t instance_id;
+    uint16_t type;
+    uint32_t dims[3];
+
+    /* index+1 of the next symbol in the same hash bucket, 0 at the end. */
+    int hash_next;
+};
+
+typedef struct ab_symbol_table_t *ab_symbol_table_p;
+
+struct ab_symbol_table_t {
+    ab_symbol_table_p next;
+
+    /* the PLC these symbols belong to */
+    uint8_t conn_path[MAX_CONN_PATH];
+    int conn_path_size;
+
+    /* PLCTAG_STATUS_PENDING while loading or checking, OK once loaded. */
+    int status;
+
+    /* tables loaded later have higher IDs. */
+    uint32_t id;
+
+    /* callers holding the table, and set once it is dropped from the session. */
+    int users;
+    int stale;
+
+    /* the controller's change counters when the table was loaded, empty if not supported. */
+    uint8_t change_info[SYMBOL_CHANGE_INFO_SIZE];
+    int change_info_size;
+    int64_t check_time;
+
+    int num_symbols;
+    int max_symbols;
+    ab_symbol_p symbols;
+
+    /* each bucket is index+1 of the first symbol in it, 0 if empty. */
+    int hash_size;
+    int *hash_buckets;
+
+    /* structure definitions used by these symbols, see template.h */
+    struct ab_template_t *templates;
+};
+
+extern int symbol_get_table(ab_tag_p tag, ab_symbol_table_p *table);
+extern void symbol_release_table(ab_symbol_table_p table);
+extern void symbol_drop_tables_unsafe(ab_session_p session);
+extern ab_symbol_p symbol_find_by_name(ab_symbol_table_p table, const char *name, int name_len);
+extern ab_symbol_p symbol_find_for_tag(ab_symbol_table_p table, ab_tag_p tag, uint8_t **rest, uint8_t **rest_end);
+extern int symbol_get_tag_dims(ab_tag_p tag, int *num_dims);
+extern int symbol_type_size(uint16_t type);
+extern int symbol_encode_tag_instance(ab_tag_p tag);
+extern void symbol_instance_error(ab_tag_p tag);
+extern void symbol_check_tag_instance(ab_tag_p tag);
+extern void symbol_destroy_tables(ab_symbol_table_p tables);
+
+#endif
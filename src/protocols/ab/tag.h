@@ -33,6 +33,11 @@
 #define MAX_TAG_TYPE_INFO   (64)
 #define MAX_CONN_PATH       (200)
 
+/* where the read plan came from, see eip_cip_tag_plan_read() */
+#define READ_PLAN_NONE      (0) /* learned by stepping through the tag */
+#define READ_PLAN_KNOWN     (1) /* from the metadata cache or a planned read that worked */
+#define READ_PLAN_GUESSED   (2) /* from the tag size, not tried yet */
+
 /* they are used in some of these includes */
 #include <lib/libplctag.h>
 #include <lib/libplctag_tag.h>
@@ -64,6 +69,12 @@ struct ab_tag_t {
     uint8_t encoded_name[MAX_TAG_NAME];
     int encoded_name_size;
 
+    /* the name by symbol while the tag is addressed by instance, see symbol.h */
+    uint8_t symbolic_name[MAX_TAG_NAME];
+    int symbolic_name_size;
+    int resolve_instance; /* look the instance up again before the next request */
+    uint32_t symbol_table_id; /* the symbol table the instance came from */
+
     /* the connection IOI path */
     uint8_t conn_path[MAX_CONN_PATH];
     uint8_t conn_path_size;
@@ -75,6 +86,7 @@ struct ab_tag_t {
     /* storage for the encoded type. */
     uint8_t encoded_type_info[MAX_TAG_TYPE_INFO];
     int encoded_type_info_size;
+    int type_info_changed; /* a read got a different type, see store_type_info() */
 
     /* number of elements and size of each in the tag. */
     int elem_count;
@@ -85,12 +97,31 @@ struct ab_tag_t {
     int first_read;
     int num_read_requests; /* number of read requests */
     int num_write_requests; /* number of write requests */
+    int write_partial; /* the write requests only cover the changed parts of the tag */
+
+    /* bit changes waiting to go out, see eip_cip_tag_write_bit() */
+    uint64_t *bit_or_masks;
+    uint64_t *bit_and_masks;
+    int bit_writes_pending;
+    int bit_write_in_progress;
     int max_requests; /* how many can we have without reallocating? */
     int *read_req_sizes;
     int *write_req_sizes;
 
     ab_request_p *reqs;
 
+    /* learned metadata kept across restarts, see meta_cache.h */
+    struct meta_cache_entry_t *meta_cache_entry;
+    int read_plan;
+    int read_frag_size; /* largest fragment the PLC sent during a planned read */
+
+    /* shared read of the PCCC data file, see pccc_file.h */
+    struct ab_pccc_file_t *pccc_file;
+    int pccc_file_elem; /* first element of the tag in the file */
+    uint32_t pccc_file_gen; /* the block read the tag last used */
+    int pccc_file_wait; /* waiting for the block read */
+    ab_tag_p pccc_file_next; /* next tag using the block */
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
@@ -0,0 +1,773 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdlib.h>
+#include <platform.h>
+#include <lib/libplctag.h>
+#include <ab/ab_common.h>
+#include <ab/eip.h>
+#include <ab/eip_cip.h>
+#include <ab/session.h>
+#include <ab/symbol.h>
+#include <ab/tag.h>
+#include <ab/template.h>
+#include <util/debug.h>
+
+
+#define TEMPLATE_CLASS (0x6C)
+
+#define TEMPLATE_ATTR_HANDLE (1)
+#define TEMPLATE_ATTR_MEMBER_COUNT (2)
+#define TEMPLATE_ATTR_DEF_SIZE (4)
+#define TEMPLATE_ATTR_STRUCT_SIZE (5)
+
+/* the definition size in words includes a header that is not sent. */
+#define TEMPLATE_DEF_OVERHEAD (23) /* MAGIC */
+
+/* each member is described by info, type and offset. */
+#define TEMPLATE_MEMBER_DESC_SIZE (8)
+
+
+static ab_template_p find_template_unsafe(ab_symbol_table_p table, uint16_t template_id);
+static int load_template(ab_tag_p tag, uint16_t template_id, ab_template_p *result);
+static int read_template_attribs(ab_tag_p tag, ab_template_p tmpl, uint32_t *def_size);
+static int read_template_data(ab_tag_p tag, ab_template_p tmpl, uint8_t *buf, int buf_size);
+static int decode_template(ab_template_p tmpl, uint8_t *buf, int buf_size);
+static struct ab_template_member_t *find_member(ab_template_p tmpl, const char *name, int name_len);
+static int member_elem_count(struct ab_template_member_t *member);
+static int is_bool_type(uint16_t type);
+static int find_field_info(ab_tag_p tag, ab_symbol_table_p table, const char *field_name, plc_tag_field_info *info);
+static uint8_t *encode_template_path(uint8_t *data, uint16_t template_id);
+
+
+
+/*
+ * template_get
+ *
+ * Find the template in the table, reading it from the PLC if this is
+ * the first time.  Two threads may both read the same template, only
+ * one copy is kept.  Templates live as long as the table.
+ *
+ * This blocks and must not be called with the session mutex held.
+ */
+
+int template_get(ab_tag_p tag, ab_symbol_table_p table, uint16_t template_id, ab_template_p *result)
+{
+    ab_template_p tmpl = NULL;
+    ab_template_p existing = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    *result = NULL;
+
+    critical_block(global_session_mut) {
+        tmpl = find_template_unsafe(table, template_id);
+    }
+
+    if(tmpl) {
+        *result = tmpl;
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = load_template(tag, template_id, &tmpl);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to read template %x! rc=%d", template_id, rc);
+        return rc;
+    }
+
+    critical_block(global_session_mut) {
+        existing = find_template_unsafe(table, template_id);
+
+        if(!existing) {
+            tmpl->next = table->templates;
+            table->templates = tmpl;
+        }
+    }
+
+    if(existing) {
+        /* someone beat us to it. */
+        tmpl->next = NULL;
+        template_destroy_all(tmpl);
+        tmpl = existing;
+    }
+
+    *result = tmpl;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * template_get_type_size
+ *
+ * The size in bytes of one element of the type, atomic or structure.
+ */
+
+int template_get_type_size(ab_tag_p tag, ab_symbol_table_p table, uint16_t type, int *size)
+{
+    ab_template_p tmpl = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    *size = 0;
+
+    if(!(type & SYMBOL_TYPE_STRUCT)) {
+        *size = symbol_type_size(type);
+        return (*size ? PLCTAG_STATUS_OK : PLCTAG_ERR_UNSUPPORTED);
+    }
+
+    rc = template_get(tag, table, (uint16_t)(type & SYMBOL_TYPE_TEMPLATE_MASK), &tmpl);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        *size = (int)tmpl->struct_size;
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * template_find_tag_type
+ *
+ * Follow the tag's encoded name from its symbol through any array
+ * indexes and structure fields to find the type it refers to.
+ * elem_count is set to the array length if the name refers to a
+ * whole array and to one otherwise.
+ */
+
+int template_find_tag_type(ab_tag_p tag, ab_symbol_table_p table, uint16_t *type, int *elem_count)
+{
+    ab_symbol_p symbol = NULL;
+    ab_template_p tmpl = NULL;
+    struct ab_template_member_t *member = NULL;
+    uint8_t *data = NULL;
+    uint8_t *end = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int i;
+
+    symbol = symbol_find_for_tag(table, tag, &data, &end);
+
+    if(!symbol) {
+        pdebug(DEBUG_WARN, "Tag not found in the symbol table.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    *type = symbol->type;
+    *elem_count = 1;
+
+    for(i=0; i < 3 && symbol->dims[i]; i++) {
+        *elem_count *= (int)symbol->dims[i];
+    }
+
+    while(data < end) {
+        switch(data[0]) {
+            case 0x28:
+                data += 2;
+                *elem_count = 1;
+                break;
+
+            case 0x29:
+                data += 4;
+                *elem_count = 1;
+                break;
+
+            case 0x2A:
+                data += 6;
+                *elem_count = 1;
+                break;
+
+            case 0x91:
+                if(!(*type & SYMBOL_TYPE_STRUCT)) {
+                    pdebug(DEBUG_WARN, "Field of a tag that is not a structure!");
+                    return PLCTAG_ERR_BAD_PARAM;
+                }
+
+                rc = template_get(tag, table, (uint16_t)(*type & SYMBOL_TYPE_TEMPLATE_MASK), &tmpl);
+
+                if(rc != PLCTAG_STATUS_OK) {
+                    return rc;
+                }
+
+                member = find_member(tmpl, (const char *)(data + 2), data[1]);
+
+                if(!member) {
+                    pdebug(DEBUG_WARN, "Field %.*s not found in %s!", data[1], data + 2, tmpl->name);
+                    return PLCTAG_ERR_NOT_FOUND;
+                }
+
+                *type = member->type;
+                *elem_count = member_elem_count(member);
+
+                data += 2 + data[1] + (data[1] & 0x01);
+                break;
+
+            default:
+                pdebug(DEBUG_WARN, "Unsupported segment %x in tag name!", data[0]);
+                return PLCTAG_ERR_UNSUPPORTED;
+        }
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * template_get_field_info
+ *
+ * Find a field within the structure the tag refers to.  The field name
+ * uses the same syntax as tag names, "Motor.Speed" or "Axis[2].Pos".
+ * Offsets are from the start of the tag's first element.
+ */
+
+int template_get_field_info(ab_tag_p tag, const char *field_name, plc_tag_field_info *info)
+{
+    ab_symbol_table_p table = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    rc = symbol_get_table(tag, &table);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to get symbol table! rc=%d", rc);
+        return rc;
+    }
+
+    rc = find_field_info(tag, table, field_name, info);
+
+    symbol_release_table(table);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+void template_destroy_all(ab_template_p templates)
+{
+    while(templates) {
+        ab_template_p next = templates->next;
+
+        if(templates->members) {
+            mem_free(templates->members);
+        }
+
+        mem_free(templates);
+
+        templates = next;
+    }
+}
+
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+ab_template_p find_template_unsafe(ab_symbol_table_p table, uint16_t template_id)
+{
+    ab_template_p tmpl = table->templates;
+
+    while(tmpl && tmpl->id != template_id) {
+        tmpl = tmpl->next;
+    }
+
+    return tmpl;
+}
+
+
+
+/*
+ * walk the field name from the type of the tag.
+ */
+
+int find_field_info(ab_tag_p tag, ab_symbol_table_p table, const char *field_name, plc_tag_field_info *info)
+{
+    ab_template_p tmpl = NULL;
+    struct ab_template_member_t *member = NULL;
+    const char *p = field_name;
+    uint16_t type = 0;
+    int elem_count = 0;
+    int elem_size = 0;
+    int offset = 0;
+    int bit = -1;
+    int rc = PLCTAG_STATUS_OK;
+
+    rc = template_find_tag_type(tag, table, &type, &elem_count);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    while(*p) {
+        const char *name = p;
+
+        while(*p && *p != '.' && *p != '[') {
+            p++;
+        }
+
+        if(p == name || !(type & SYMBOL_TYPE_STRUCT)) {
+            pdebug(DEBUG_WARN, "Bad field name %s!", field_name);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+
+        rc = template_get(tag, table, (uint16_t)(type & SYMBOL_TYPE_TEMPLATE_MASK), &tmpl);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        member = find_member(tmpl, name, (int)(p - name));
+
+        if(!member) {
+            pdebug(DEBUG_WARN, "Field %.*s not found in %s!", (int)(p - name), name, tmpl->name);
+            return PLCTAG_ERR_NOT_FOUND;
+        }
+
+        offset += (int)member->offset;
+        type = member->type;
+        elem_count = member_elem_count(member);
+        bit = (is_bool_type(type) ? member->info : -1);
+
+        if(*p == '[') {
+            char *np = NULL;
+            long index;
+
+            p++;
+            /* Logix indexes are always decimal. */
+            index = strtol(p, &np, 10);
+
+            if(np == p || *np != ']') {
+                pdebug(DEBUG_WARN, "Bad array index in field name %s!", field_name);
+                return PLCTAG_ERR_BAD_PARAM;
+            }
+
+            p = np + 1;
+
+            if(index < 0 || index >= elem_count) {
+                pdebug(DEBUG_WARN, "Array index out of bounds in field name %s!", field_name);
+                return PLCTAG_ERR_OUT_OF_BOUNDS;
+            }
+
+            rc = template_get_type_size(tag, table, type, &elem_size);
+
+            if(rc != PLCTAG_STATUS_OK) {
+                return rc;
+            }
+
+            offset += (int)index * elem_size;
+            elem_count = 1;
+        }
+
+        if(*p == '.') {
+            p++;
+        } else if(*p) {
+            pdebug(DEBUG_WARN, "Bad field name %s!", field_name);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    }
+
+    rc = template_get_type_size(tag, table, type, &elem_size);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    info->offset = offset;
+    info->type = type;
+    info->bit = bit;
+    info->elem_count = elem_count;
+    info->elem_size = elem_size;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int load_template(ab_tag_p tag, uint16_t template_id, ab_template_p *result)
+{
+    ab_template_p tmpl = NULL;
+    uint32_t def_size = 0;
+    uint8_t *buf = NULL;
+    int buf_size = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Reading template %x.", template_id);
+
+    tmpl = (ab_template_p)mem_alloc(sizeof(struct ab_template_t));
+
+    if(!tmpl) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    tmpl->id = template_id;
+
+    do {
+        rc = read_template_attribs(tag, tmpl, &def_size);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        buf_size = (int)(def_size * 4) - TEMPLATE_DEF_OVERHEAD;
+
+        if(buf_size < tmpl->num_members * TEMPLATE_MEMBER_DESC_SIZE) {
+            pdebug(DEBUG_WARN, "Template definition is too small!");
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
+        buf = (uint8_t*)mem_alloc(buf_size);
+
+        if(!buf) {
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        rc = read_template_data(tag, tmpl, buf, buf_size);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        rc = decode_template(tmpl, buf, buf_size);
+    } while(0);
+
+    if(buf) {
+        mem_free(buf);
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        template_destroy_all(tmpl);
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO, "Template %s has %d members and is %u bytes.", tmpl->name, tmpl->num_members, tmpl->struct_size);
+
+    *result = tmpl;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * read_template_attribs
+ *
+ * Get the sizes of the template with Get Attribute List.  Each attribute
+ * in the reply is its ID, a status and the value.
+ */
+
+int read_template_attribs(ab_tag_p tag, ab_template_p tmpl, uint32_t *def_size)
+{
+    uint8_t service[32];
+    uint8_t *data = service;
+    ab_request_p req = NULL;
+    uint8_t *reply = NULL;
+    uint8_t *reply_end = NULL;
+    int num_attribs = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    *data = AB_EIP_CMD_CIP_GET_ATTR_LIST;
+    data++;
+    data = encode_template_path(data, tmpl->id);
+
+    *((uint16_t*)data) = h2le16(4);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(TEMPLATE_ATTR_DEF_SIZE);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(TEMPLATE_ATTR_STRUCT_SIZE);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(TEMPLATE_ATTR_MEMBER_COUNT);
+    data += sizeof(uint16_t);
+    *((uint16_t*)data) = h2le16(TEMPLATE_ATTR_HANDLE);
+    data += sizeof(uint16_t);
+
+    rc = eip_cip_send_sync(tag, service, (int)(data - service), &req, &reply, &reply_end);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        if(req) {
+            request_release(req);
+        }
+
+        return (rc == PLCTAG_STATUS_PENDING ? PLCTAG_ERR_BAD_DATA : rc);
+    }
+
+    data = reply;
+
+    if(data + sizeof(uint16_t) <= reply_end) {
+        num_attribs = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+    }
+
+    while(num_attribs > 0 && rc == PLCTAG_STATUS_OK) {
+        uint16_t attrib_id;
+        uint16_t status;
+
+        if(data + 2*sizeof(uint16_t) > reply_end) {
+            rc = PLCTAG_ERR_BAD_DATA;
+            break;
+        }
+
+        attrib_id = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+        status = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+
+        if(status != 0) {
+            pdebug(DEBUG_WARN, "Error %x getting template attribute %d!", status, attrib_id);
+            rc = PLCTAG_ERR_REMOTE_ERR;
+            break;
+        }
+
+        switch(attrib_id) {
+            case TEMPLATE_ATTR_DEF_SIZE:
+            case TEMPLATE_ATTR_STRUCT_SIZE:
+                if(data + sizeof(uint32_t) > reply_end) {
+                    rc = PLCTAG_ERR_BAD_DATA;
+                    break;
+                }
+
+                if(attrib_id == TEMPLATE_ATTR_DEF_SIZE) {
+                    *def_size = le2h32(*((uint32_t*)data));
+                } else {
+                    tmpl->struct_size = le2h32(*((uint32_t*)data));
+                }
+
+                data += sizeof(uint32_t);
+                break;
+
+            case TEMPLATE_ATTR_MEMBER_COUNT:
+            case TEMPLATE_ATTR_HANDLE:
+                if(data + sizeof(uint16_t) > reply_end) {
+                    rc = PLCTAG_ERR_BAD_DATA;
+                    break;
+                }
+
+                if(attrib_id == TEMPLATE_ATTR_MEMBER_COUNT) {
+                    tmpl->num_members = le2h16(*((uint16_t*)data));
+                }
+
+                data += sizeof(uint16_t);
+                break;
+
+            default:
+                rc = PLCTAG_ERR_BAD_DATA;
+                break;
+        }
+
+        num_attribs--;
+    }
+
+    request_release(req);
+
+    if(rc == PLCTAG_STATUS_OK && (!*def_size || !tmpl->struct_size)) {
+        pdebug(DEBUG_WARN, "Template attributes missing!");
+        rc = PLCTAG_ERR_BAD_DATA;
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * read_template_data
+ *
+ * Read the template definition.  The PLC sends as much as fits in each
+ * reply and a partial status until it is all sent.
+ */
+
+int read_template_data(ab_tag_p tag, ab_template_p tmpl, uint8_t *buf, int buf_size)
+{
+    int offset = 0;
+    int rc = PLCTAG_STATUS_PENDING;
+
+    while(rc == PLCTAG_STATUS_PENDING && offset < buf_size) {
+        uint8_t service[32];
+        uint8_t *data = service;
+        ab_request_p req = NULL;
+        uint8_t *reply = NULL;
+        uint8_t *reply_end = NULL;
+        int amount;
+
+        *data = AB_EIP_CMD_CIP_READ;
+        data++;
+        data = encode_template_path(data, tmpl->id);
+
+        *((uint32_t*)data) = h2le32((uint32_t)offset);
+        data += sizeof(uint32_t);
+        *((uint16_t*)data) = h2le16((uint16_t)(buf_size - offset));
+        data += sizeof(uint16_t);
+
+        rc = eip_cip_send_sync(tag, service, (int)(data - service), &req, &reply, &reply_end);
+
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+
+        amount = (int)(reply_end - reply);
+
+        if(amount > buf_size - offset) {
+            amount = buf_size - offset;
+        }
+
+        mem_copy(buf + offset, reply, amount);
+        offset += amount;
+
+        request_release(req);
+
+        if(rc == PLCTAG_STATUS_PENDING && amount <= 0) {
+            /* no progress, do not spin forever. */
+            return PLCTAG_ERR_BAD_DATA;
+        }
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * decode_template
+ *
+ * The definition is the member descriptions followed by the zero
+ * terminated template name, "name;extra", and then the member names.
+ */
+
+int decode_template(ab_template_p tmpl, uint8_t *buf, int buf_size)
+{
+    uint8_t *data = buf;
+    uint8_t *end = buf + buf_size;
+    int name_index;
+    int i;
+
+    if(tmpl->num_members > 0) {
+        tmpl->members = (struct ab_template_member_t *)mem_alloc(tmpl->num_members * (int)sizeof(struct ab_template_member_t));
+
+        if(!tmpl->members) {
+            return PLCTAG_ERR_NO_MEM;
+        }
+    }
+
+    for(i=0; i < tmpl->num_members; i++) {
+        tmpl->members[i].info = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+        tmpl->members[i].type = le2h16(*((uint16_t*)data));
+        data += sizeof(uint16_t);
+        tmpl->members[i].offset = le2h32(*((uint32_t*)data));
+        data += sizeof(uint32_t);
+    }
+
+    /* the template name and then each member name */
+    for(name_index = -1; name_index < tmpl->num_members; name_index++) {
+        char *name = (name_index < 0 ? tmpl->name : tmpl->members[name_index].name);
+        int name_len = 0;
+
+        while(data < end && *data) {
+            if(name_len < MAX_SYMBOL_NAME - 1) {
+                name[name_len] = (char)*data;
+                name_len++;
+            }
+
+            data++;
+        }
+
+        if(data >= end) {
+            pdebug(DEBUG_WARN, "Template names are truncated!");
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        /* skip the terminator */
+        data++;
+    }
+
+    /* the template name has extra information after a semicolon. */
+    for(i=0; tmpl->name[i]; i++) {
+        if(tmpl->name[i] == ';') {
+            tmpl->name[i] = 0;
+            break;
+        }
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+struct ab_template_member_t *find_member(ab_template_p tmpl, const char *name, int name_len)
+{
+    int i;
+
+    for(i=0; i < tmpl->num_members; i++) {
+        if(str_length(tmpl->members[i].name) == name_len && str_cmp_i_n(tmpl->members[i].name, name, name_len) == 0) {
+            return &tmpl->members[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/* BOOL members use info for the bit number, others for the array length. */
+int member_elem_count(struct ab_template_member_t *member)
+{
+    if(is_bool_type(member->type) || member->info == 0) {
+        return 1;
+    }
+
+    return member->info;
+}
+
+
+
+int is_bool_type(uint16_t type)
+{
+    return !(type & SYMBOL_TYPE_STRUCT) && (type & 0xFF) == 0xC1;
+}
+
+
+
+uint8_t *encode_template_path(uint8_t *data, uint16_t template_id)
+{
+    *data = 3; /* path size in words */
+    data++;
+    *data = 0x20;
+    data++;
+    *data = TEMPLATE_CLASS;
+    data++;
+    *data = 0x25;
+    data++;
+    *data = 0;
+    data++;
+    *data = template_id & 0xFF;
+    data++;
+    *data = (template_id >> 8) & 0xFF;
+    data++;
+
+    return data;
+}
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PLCTAG_AB_TEMPLATE_H__
+#define __PLCTAG_AB_TEMPLATE_H__ 1
+
+#include <lib/libplctag.h>
+#include <ab/ab_common.h>
+#include <ab/symbol.h>
+#include <ab/tag.h>
+
+/*
+ * Logix structures (UDTs) are described by instances of the Template
+ * class (0x6C).  The instance ID is the low bits of the symbol type word.
+ * Each template is read once and kept with the symbol table of its PLC
+ * so that field lookups only walk the member list in memory.
+ */
+
+typedef struct ab_template_t *ab_template_p;
+
+struct ab_template_member_t {
+    char name[MAX_SYMBOL_NAME];
+    uint16_t type;
+    uint16_t info; /* bit number for BOOL, array length for arrays */
+    uint32_t offset;
+};
+
+struct ab_template_t {
+    ab_template_p next;
+
+    uint16_t id;
+    char name[MAX_SYMBOL_NAME];
+    uint32_t struct_size;
+
+    int num_members;
+    struct ab_template_member_t *members;
+};
+
+extern int template_get(ab_tag_p tag, ab_symbol_table_p table, uint16_t template_id, ab_template_p *result);
+extern int template_get_type_size(ab_tag_p tag, ab_symbol_table_p table, uint16_t type, int *size);
+extern int template_find_tag_type(ab_tag_p tag, ab_symbol_table_p table, uint16_t *type, int *elem_count);
+extern int template_get_field_info(ab_tag_p tag, const char *field_name, plc_tag_field_info *info);
+extern void template_destroy_all(ab_template_p templates);
+
+#endif
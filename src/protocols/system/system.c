@@ -43,7 +43,7 @@ static int system_tag_read(plc_tag_p tag);
 static int system_tag_status(plc_tag_p tag);
 static int system_tag_write(plc_tag_p tag);
 
-struct tag_vtable_t system_tag_vtable = { system_tag_abort, system_tag_destroy, system_tag_read, system_tag_status, system_tag_write};
+struct tag_vtable_t system_tag_vtable = { system_tag_abort, system_tag_destroy, system_tag_read, system_tag_status, system_tag_write, NULL, NULL, NULL, NULL};
 
 
 plc_tag_p system_tag_create(attr attribs)
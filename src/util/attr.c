@@ -342,6 +342,38 @@ extern float attr_get_float(attr attrs, const char *name, float def)
 }
 
 
+
+/*
+ * attr_next_name
+ *
+ * Return the name that comes right after prev in sort order, or the
+ * first name if prev is NULL.  Returns NULL when there are no more.
+ * This walks the names in the same order no matter what order they
+ * were set in.
+ */
+extern const char *attr_next_name(attr attrs, const char *prev)
+{
+    attr_entry e;
+    const char *next = NULL;
+
+    if(!attrs) {
+        return NULL;
+    }
+
+    for(e = attrs->head; e; e = e->next) {
+        if(prev && str_cmp(e->name, prev) <= 0) {
+            continue;
+        }
+
+        if(!next || str_cmp(e->name, next) < 0) {
+            next = e->name;
+        }
+    }
+
+    return next;
+}
+
+
 extern int attr_remove(attr attrs, const char *name)
 {
     attr_entry e, p;